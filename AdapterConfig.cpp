@@ -0,0 +1,223 @@
+/*******************************************************************************
+ * @file AdapterConfig.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "AdapterConfig.h"
+#include "Logging.h"
+
+extern int  BufSize;
+extern int  SleepTimeout;
+extern bool IgnoreActiveFlag;
+extern bool ClearScramblingBit;
+extern int  IdleFlushMs;
+
+static const int MAX_CPUS = 64;   // Cpus is a 64 bit mask
+
+
+/*******************************************************************************
+ * "0,2-3" to a bit mask, 'all' to 0. false on errors.
+ ******************************************************************************/
+static bool ParseCpus(const std::string& Text, uint64_t& Mask) {
+  Mask = 0;
+  if (Text == "all")
+     return true;
+  for(size_t pos = 0; pos <= Text.size();) {
+     size_t end = Text.find(',', pos);
+     if (end == std::string::npos)
+        end = Text.size();
+     int first, last, n = 0;
+     std::string range = Text.substr(pos, end - pos);
+     if ((sscanf(range.c_str(), "%d-%d%n", &first, &last, &n) < 2) or (n != int(range.size()))) {
+        n = 0;
+        if ((sscanf(range.c_str(), "%d%n", &first, &n) < 1) or (n != int(range.size())))
+           return false;
+        last = first;
+        }
+     if ((first < 0) or (last < first) or (last >= MAX_CPUS))
+        return false;
+     for(int i = first; i <= last; i++)
+        Mask |= uint64_t(1) << i;
+     pos = end + 1;
+     }
+  return Mask != 0;
+}
+
+
+static std::string CpusText(uint64_t Mask) {
+  if (!Mask)
+     return "all";
+  std::string s;
+  for(int i = 0; i < MAX_CPUS; i++) {
+     if (!(Mask & (uint64_t(1) << i)))
+        continue;
+     int last = i;
+     while((last + 1 < MAX_CPUS) and (Mask & (uint64_t(1) << (last + 1))))
+        last++;
+     s += (s.empty() ? "" : ",") + std::to_string(i);
+     if (last > i)
+        s += "-" + std::to_string(last);
+     i = last;
+     }
+  return s;
+}
+
+
+
+/*******************************************************************************
+ * class cAdapterConfig
+ ******************************************************************************/
+cAdapterConfig::cAdapterConfig(const std::string& Settings) :
+  BufSize(::BufSize), SleepTimeout(::SleepTimeout),
+  IgnoreActiveFlag(::IgnoreActiveFlag), ClearScramblingBit(::ClearScramblingBit),
+  IdleFlush(IdleFlushMs), Chunk(0), Retries(3), Nice(0), Cpus(0), schedSerial(0)
+{
+  for(auto s:Split(Settings))
+     Set(s);
+}
+
+
+std::vector<std::string> cAdapterConfig::Split(const std::string& Settings) {
+  std::vector<std::string> settings;
+  for(size_t pos = 0; pos < Settings.size();) {
+     size_t end = Settings.find_first_of(" \t", pos);
+     if (end == std::string::npos)
+        end = Settings.size();
+     if (end > pos)
+        settings.push_back(Settings.substr(pos, end - pos));
+     pos = end + 1;
+     }
+  return settings;
+}
+
+
+std::string cAdapterConfig::Check(const std::string& Settings) {
+  cAdapterConfig check;
+  for(auto s:Split(Settings)) {
+     std::string error = check.Set(s);
+     if (!error.empty())
+        return error;
+     }
+  return "";
+}
+
+
+std::string cAdapterConfig::Set(const std::string& Setting) {
+  size_t eq = Setting.find('=');
+  if (eq == std::string::npos)
+     return "missing '=' in " + Setting;
+  std::string name = Setting.substr(0, eq);
+
+  if (name == "cpus") {
+     uint64_t mask;
+     if (!ParseCpus(Setting.substr(eq + 1), mask))
+        return "cpus is 'all' or a list like 0,2-3 of CPUs below " + std::to_string(MAX_CPUS);
+     if (Cpus.exchange(mask) != mask)
+        schedSerial++;
+     return "";
+     }
+
+  int value;
+  char rest;
+  if (sscanf(Setting.c_str() + eq + 1, "%d%c", &value, &rest) != 1)
+     return "invalid value in " + Setting;
+
+  if (name == "bufsz") {
+     if ((value < 1500) or (value > 10000))
+        return "bufsz out of range 1500..10000";
+     BufSize = value;
+     }
+  else if (name == "sleeptimer") {
+     if ((value < 1) or (value > 1000))
+        return "sleeptimer out of range 1..1000";
+     SleepTimeout = value;
+     }
+  else if ((name == "ignact") or (name == "clrsct")) {
+     if ((value < 0) or (value > 1))
+        return name + " is 0 or 1";
+     (name == "ignact" ? IgnoreActiveFlag : ClearScramblingBit) = value;
+     }
+  else if (name == "idleflush") {
+     if ((value < 0) or (value > 5000) or (value and (value < 10)))
+        return "idleflush is 0 or 10..5000";
+     IdleFlush = value;
+     }
+  else if (name == "chunk") {
+     if ((value < 0) or (value > 10000) or (value and (value < 16)))
+        return "chunk is 0 or 16..10000";
+     Chunk = value;
+     }
+  else if (name == "retries") {
+     if ((value < 0) or (value > 100))
+        return "retries out of range 0..100";
+     Retries = value;
+     }
+  else if (name == "nice") {
+     if ((value < -20) or (value > 19))
+        return "nice out of range -20..19";
+     if (Nice.exchange(value) != value)
+        schedSerial++;
+     }
+  else
+     return "unknown setting " + name;
+  return "";
+}
+
+
+std::string cAdapterConfig::Text(void) {
+  return "bufsz="       + std::to_string(BufSize) +
+         " sleeptimer=" + std::to_string(SleepTimeout) +
+         " ignact="     + std::to_string(IgnoreActiveFlag) +
+         " clrsct="     + std::to_string(ClearScramblingBit) +
+         " idleflush="  + std::to_string(IdleFlush) +
+         " chunk="      + std::to_string(Chunk) +
+         " retries="    + std::to_string(Retries) +
+         " nice="       + std::to_string(Nice) +
+         " cpus="       + CpusText(Cpus);
+}
+
+
+void cAdapterConfig::ApplySched(unsigned& Serial) {
+  unsigned serial = schedSerial.load(std::memory_order_relaxed);
+  if (serial == Serial)
+     return;
+  Serial = serial;
+
+  pid_t tid = syscall(SYS_gettid);
+  if (setpriority(PRIO_PROCESS, tid, Nice) < 0)
+     log(1, "setpriority(" + std::to_string(Nice) + ") failed for thread " +
+         std::to_string(tid) + ": " + strerror(errno));
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  uint64_t mask = Cpus;
+  int cpus = sysconf(_SC_NPROCESSORS_CONF);
+  for(int i = 0; (i < MAX_CPUS) and (i < cpus); i++)
+     if (!mask or (mask & (uint64_t(1) << i)))
+        CPU_SET(i, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+     log(1, "sched_setaffinity(" + CpusText(mask) + ") failed for thread " +
+         std::to_string(tid) + ": " + strerror(errno));
+}
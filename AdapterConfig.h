@@ -0,0 +1,80 @@
+/*******************************************************************************
+ * @file AdapterConfig.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*******************************************************************************
+ * The settings of one CI adapter, from its profile in adapters.conf (see
+ * cProfiles), changed at runtime with the SVDRP command CONF. Without a
+ * profile, they are the values of the command line:
+ *   bufsz      --bufsz,      buffer size in packets, 1500..10000
+ *   sleeptimer --sleeptimer, the shortest TS thread timeout in ms, 1..1000
+ *   ignact     --ignact,     0/1, ignore the active flag of the CAM slot
+ *   clrsct     --clrsct,     0/1, clear the scrambling control bits
+ *   idleflush  --idle-flush, ms, 0 = off, 10..5000
+ *   chunk                    max packets per write to the CAM, 0 = all in
+ *                            the send buffer (default), 16..10000
+ *   retries                  times the deliver thread waits for VDR before
+ *                            it drops a packet, 0..100, default 3
+ *   nice                     nice value of the adapter's threads, -20..19
+ *   cpus                     CPUs the adapter's threads run on, f.i. 2,3
+ *                            or 0-1, 'all' is the default
+ * All but bufsz take effect at once, nice and cpus once each thread comes
+ * by ApplySched(). The buffers get a new size at the next quiescent point
+ * of the adapter, see cAdapter::Resize().
+ ******************************************************************************/
+class cAdapterConfig {
+public:
+  std::atomic<int>  BufSize;            //< wanted, cAdapter::BufSize() is the current one
+  std::atomic<int>  SleepTimeout;
+  std::atomic<bool> IgnoreActiveFlag;
+  std::atomic<bool> ClearScramblingBit;
+  std::atomic<int>  IdleFlush;
+  std::atomic<int>  Chunk;
+  std::atomic<int>  Retries;
+  std::atomic<int>  Nice;
+  std::atomic<uint64_t> Cpus;           //< CPU bit mask, 0 = all
+  std::atomic<unsigned> schedSerial;    //< counts changes of Nice or Cpus
+
+  /* Settings: as Split() takes them, already checked. */
+  cAdapterConfig(const std::string& Settings = "");
+
+  /* blank separated settings to a list. */
+  static std::vector<std::string> Split(const std::string& Settings);
+
+  /* the first error message of blank separated settings, or "". */
+  static std::string Check(const std::string& Settings);
+
+  /* sets one setting, f.i. "bufsz=3000". Returns an error message or an
+   * empty string. */
+  std::string Set(const std::string& Setting);
+
+  /* all settings, as Set() takes them, separated by blanks. */
+  std::string Text(void);
+
+  /* called by each thread of the adapter in its loop: sets its nice value
+   * and CPU affinity, if they changed since Serial. */
+  void ApplySched(unsigned& Serial);
+};
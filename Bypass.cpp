@@ -0,0 +1,151 @@
+/*******************************************************************************
+ * @file Bypass.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstring>
+#include "Bypass.h"
+#include "Common.h"
+
+static const int BYPASS_STALL_MS  = 500;   // no CAM data and a packet waits
+static const int BYPASS_RESYNC_MS = 2000;  // a packet waits, CAM data or not
+
+
+/*******************************************************************************
+ * class cBypass
+ ******************************************************************************/
+cBypass::cBypass(int Packets) :
+  ring(BufferSize(Packets) / TS_SIZE), head(0), tail(0), count(0), sent(0), received(0),
+  bypassed(0), stalls(0)
+{
+  memset(pidType, ptUnknown, sizeof(pidType));
+  for(auto& s:lastSent)
+     s = 0;
+}
+
+
+bool cBypass::Bypassable(const uint8_t* Packet) {
+  int pid = TsPid(Packet);
+  /* the unique PIDs of MTD sub slots carry an index of VDR's PID mapper,
+   * not the real PID: the fixed PIDs below are told by their data then. */
+  bool mapped = SubSlotOf(pid);
+
+  if (!mapped and (pid == 0x1FFF))   // null packets
+     return true;
+  if (TsIsScrambled(Packet))
+     return false;
+
+  /* PAT, NIT, SDT/BAT, EIT, RST, TDT/TOT: never CA related. The CAT (PID 1)
+   * tells the CAM about EMMs, it has to go through. */
+  if (!mapped and ((pid == 0x00) or ((pid >= 0x10) and (pid <= 0x14))))
+     return true;
+
+  /* (re)classify on each payload unit start: a PES starts with 00 00 01, a
+   * section with the pointer field and its table id. */
+  if (TsPayloadStart(Packet) and TsHasPayload(Packet)) {
+     int o = TsPayloadOffset(Packet);
+     if (o + 3 <= TS_SIZE) {
+        if (Packet[o] == 0 and Packet[o + 1] == 0 and Packet[o + 2] == 1)
+           pidType[pid] = ptPes;
+        else {
+           int t = o + 1 + Packet[o];
+           pidType[pid] = ((t < TS_SIZE) and SiTable(Packet[t])) ? ptSi : ptSection;
+           }
+        }
+     }
+  else if (mapped and (pidType[pid] == ptUnknown) and IsStuffingPacket(Packet))
+     return true;   // a null packet
+  return (pidType[pid] == ptPes) or (pidType[pid] == ptSi);
+}
+
+
+bool cBypass::Put(const uint8_t* Packet) {
+  if (count.load(std::memory_order_acquire) >= ring.size())
+     return false;
+
+  tPacket& p = ring[tail];
+  p.tag = sent.load(std::memory_order_relaxed);
+  p.time = cTimeMs::Now();
+  memcpy(p.data, Packet, TS_SIZE);
+  tail = (tail + 1) % ring.size();
+  count.fetch_add(1, std::memory_order_release);
+  ++bypassed;
+  return true;
+}
+
+
+int64_t cBypass::Before(void) {
+  if (!count.load(std::memory_order_acquire))
+     return -1;
+  uint64_t tag = ring[head].tag;
+  uint64_t rcvd = received;
+  return tag > rcvd ? tag - rcvd : 0;
+}
+
+
+uint8_t* cBypass::Due(void) {
+  if (!count.load(std::memory_order_acquire))
+     return nullptr;
+
+  tPacket& p = ring[head];
+  if (p.tag > received) {
+     uint64_t waited = cTimeMs::Now() - p.time;
+     if ((waited < BYPASS_STALL_MS) or
+        ((waited < BYPASS_RESYNC_MS) and (lastRecv.Elapsed() < BYPASS_STALL_MS)))
+        return nullptr;
+     // the CAM lost packets: don't wait forever.
+     received = p.tag;
+     ++stalls;
+     }
+  return p.data;
+}
+
+
+void cBypass::Del(void) {
+  head = (head + 1) % ring.size();
+  count.fetch_sub(1, std::memory_order_release);
+}
+
+
+void cBypass::Received(int Packets) {
+  if (Packets) {
+     received.fetch_add(Packets, std::memory_order_relaxed);
+     lastRecv.Set();
+     }
+}
+
+
+void cBypass::Resize(int Packets) {
+  cMutexLock MutexLock(&mutex);
+
+  ring = std::vector<tPacket>(BufferSize(Packets) / TS_SIZE);
+  head = tail = 0;
+  count = 0;
+}
+
+
+void cBypass::Drop(void) {
+  cMutexLock MutexLock(&mutex);
+
+  /* no Put() now, the cTsSender mutex is locked. The counters are synced
+   * by Sync(), once the stale CAM output is gone. */
+  size_t n = count.load(std::memory_order_acquire);
+  head = (head + n) % ring.size();
+  count.fetch_sub(n, std::memory_order_release);
+}
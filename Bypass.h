@@ -0,0 +1,126 @@
+/*******************************************************************************
+ * @file Bypass.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <vdr/thread.h>
+#include <vdr/tools.h>
+#include <vdr/remux.h>   // TS_SIZE
+#include "Common.h"      // SUB_SLOTS
+
+/*******************************************************************************
+ * The CAM bypass: packets which are not scrambled don't need the CAM round
+ * trip. cTsSender hands them to this class instead of the CAM send buffer,
+ * tagged with the number of packets sent to the CAM before them. The CAM
+ * slot merges them back into the CAM output, after the tagged number of
+ * packets came back from the CAM, so the packet order stays the same.
+ *
+ * Only packets of PIDs carrying PES data, the fixed DVB SI PIDs and null
+ * packets are bypassed, under MTD the PAT and the SI tables by their table
+ * id. Everything else carries sections which may be ECMs, EMMs or PMTs the
+ * CAM needs to see, so it always goes through the CAM.
+ *
+ * If the CAM loses packets, the tags are reached later. If a packet waits
+ * for BYPASS_STALL_MS and nothing came back from the CAM meanwhile, or for
+ * BYPASS_RESYNC_MS in any case, it is delivered anyway and the counters are
+ * synced to it.
+ ******************************************************************************/
+class cBypass {
+private:
+  enum ePidType : uint8_t { ptUnknown, ptPes, ptSi, ptSection };
+  struct tPacket {
+     uint64_t tag;                //< packets sent to the CAM before this one
+     uint64_t time;               //< cTimeMs::Now() of Put()
+     uint8_t data[TS_SIZE];
+     };
+  cMutex mutex;                   //< protects the receive side and the ring
+  std::vector<tPacket> ring;      //< the bypassed packets, BufSize packets
+  size_t head;                    //< next packet to merge
+  size_t tail;                    //< next free entry
+  std::atomic<size_t> count;      //< packets in ring
+  std::atomic<uint64_t> sent;     //< packets written to the CAM send buffer
+  std::atomic<uint64_t> received; //< packets received from the CAM
+  std::atomic<uint64_t> lastSent[SUB_SLOTS]; //< sent, up to the last packet of each MTD sub slot
+  cTimeMs lastRecv;               //< time of the last CAM data
+  ePidType pidType[0x2000];       //< sender side only
+  std::atomic<uint64_t> bypassed;
+  std::atomic<uint64_t> stalls;
+
+  /* PAT (0x00) and DVB SI (0x40..0x7F): never CA related, unlike the CAT,
+   * PMT, ECMs and EMMs. */
+  static bool SiTable(uint8_t TableId) { return (TableId == 0x00) or (TableId >= 0x40 and TableId <= 0x7F); }
+
+public:
+  cBypass(int Packets);
+
+  /* sender side, called with the cTsSender mutex locked */
+
+  /* true, if Packet doesn't need to be sent to the CAM. */
+  bool Bypassable(const uint8_t* Packet);
+  /* queues Packet, false if the bypass is full. */
+  bool Put(const uint8_t* Packet);
+  /* Packets of SubSlot (0 without MTD) were written to the CAM send buffer. */
+  void Sent(int Packets, int SubSlot = 0) {
+     uint64_t s = sent.fetch_add(Packets, std::memory_order_relaxed) + Packets;
+     if (SubSlot and Packets)
+        lastSent[SubSlot].store(s, std::memory_order_relaxed);
+     }
+
+  /* receive side, the deliver thread only. Before(), Due() and Del() with
+   * Mutex() locked. */
+  cMutex& Mutex(void) { return mutex; }
+
+  /* true, if there are packets to merge. */
+  bool Pending(void) { return count.load(std::memory_order_relaxed); }
+
+  /* number of CAM packets to pass before the next bypassed packet is due,
+   * -1 if there is none.
+   */
+  int64_t Before(void);
+
+  /* the next packet, if it is due. Del() it after use. */
+  uint8_t* Due(void);
+  void Del(void);
+
+  /* Packets were received from the CAM. */
+  void Received(int Packets);
+
+  /* cTsSender::Clear(): drops the packets queued until now. */
+  void Drop(void);
+
+  /* cTsSender::Resize(), with the deliver thread held and nothing
+   * Pending(): a new ring of Packets. */
+  void Resize(int Packets);
+
+  /* cAdapter::Cleared(): the CAM output restarts after packet Sent. */
+  void Sync(uint64_t Sent) { received.store(Sent, std::memory_order_relaxed); }
+
+  /* the packets sent to / received from the CAM so far */
+  uint64_t SentCount(void)     { return sent.load(std::memory_order_acquire); }
+  uint64_t ReceivedCount(void) { return received.load(std::memory_order_acquire); }
+  /* SentCount() after the last packet of SubSlot, 0 if none */
+  uint64_t LastSent(int SubSlot) { return lastSent[SubSlot].load(std::memory_order_relaxed); }
+
+  uint64_t Bypassed(void) { return bypassed; }
+  uint64_t Stalls(void)   { return stalls; }
+};
@@ -0,0 +1,130 @@
+/*******************************************************************************
+ * @file CamPool.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <algorithm>
+#include "CamPool.h"
+#include "CiAdapter.h"
+
+static const int POOL_MARGIN_KBIT = 2000;  // bitrates closer than this are equal
+static const int POOL_MARGIN_PCT  = 10;    // ... or closer than this
+
+
+/*******************************************************************************
+ * the load of one CAM, as compared by the pool.
+ ******************************************************************************/
+struct tCamLoad {
+  int services;
+  uint64_t kbit;
+  int pids;
+  tCamLoad(cAdapter* Adapter) :
+     services(Adapter->Services()), kbit(Adapter->Governor().Load() * 8 / 1000),
+     pids(Adapter->Governor().Pids()) {}
+};
+
+
+/* < 0, if A is less loaded than B; 0, if they are equal. */
+static int Compare(const tCamLoad& A, const tCamLoad& B) {
+  if (A.services != B.services)
+     return A.services < B.services ? -1 : 1;
+
+  uint64_t hi = std::max(A.kbit, B.kbit);
+  uint64_t diff = hi - std::min(A.kbit, B.kbit);
+  if ((diff > uint64_t(POOL_MARGIN_KBIT)) and (diff * 100 > hi * POOL_MARGIN_PCT))
+     return A.kbit < B.kbit ? -1 : 1;
+
+  if (A.pids != B.pids)
+     return A.pids < B.pids ? -1 : 1;
+  return 0;
+}
+
+
+
+/*******************************************************************************
+ * class cCamPool
+ ******************************************************************************/
+cMutex cCamPool::mutex;
+std::vector<cAdapter*> cCamPool::adapters;
+
+
+void cCamPool::Add(cAdapter* Adapter) {
+  cMutexLock MutexLock(&mutex);
+  adapters.push_back(Adapter);
+}
+
+
+void cCamPool::Del(cAdapter* Adapter) {
+  cMutexLock MutexLock(&mutex);
+  adapters.erase(std::remove(adapters.begin(), adapters.end(), Adapter), adapters.end());
+}
+
+
+bool cCamPool::Preferred(cAdapter* Adapter, std::string& Better) {
+  cMutexLock MutexLock(&mutex);
+
+  std::string group = Adapter->CaSystemIds();
+  if (group.empty())
+     return true;
+
+  tCamLoad load(Adapter);
+  bool before = true;   // other is before Adapter in the pool
+  for(auto other:adapters) {
+     if (other == Adapter) {
+        before = false;
+        continue;
+        }
+     if ((other->CaSystemIds() != group) or !other->Available())
+        continue;
+     int c = Compare(tCamLoad(other), load);
+     if ((c < 0) or ((c == 0) and before)) {
+        Better = other->DevPath();
+        return false;
+        }
+     }
+  return true;
+}
+
+
+std::string cCamPool::Stats(void) {
+  cMutexLock MutexLock(&mutex);
+
+  std::vector<std::string> groups;
+  for(auto a:adapters) {
+     std::string g = a->CaSystemIds();
+     if (std::find(groups.begin(), groups.end(), g) == groups.end())
+        groups.push_back(g);
+     }
+
+  std::string s;
+  for(auto& g:groups) {
+     s += "CA system ids " + (g.empty() ? std::string("unknown") : g) + ":\n";
+     for(auto a:adapters) {
+        if (a->CaSystemIds() != g)
+           continue;
+        tCamLoad l(a);
+        s += "  " + a->DevPath() + ": " + std::to_string(l.services) + " services, " +
+             std::to_string(l.kbit) + " kbit/s, " + std::to_string(l.pids) + " scrambled PIDs" +
+             (a->Available() ? "" : ", not available") + "\n";
+        }
+     }
+  if (!s.empty())
+     s.pop_back();
+  return s;
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************
+ * @file CamPool.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <vector>
+#include <string>
+#include <vdr/thread.h>
+
+/*******************************************************************************
+ * forward declarations.
+ ******************************************************************************/
+class cAdapter;
+
+
+
+/*******************************************************************************
+ * The CAM pool: with several CI adapters holding CAMs for the same CA
+ * systems, VDR assigns a new service to the first CAM which says yes. So
+ * recordings pile up on the first one, while the others are idle.
+ *
+ * With CamBalance, the adapters are grouped by the CA system ids of their
+ * CAMs, and a CAM refuses a new service to VDR as long as another one of
+ * its group is less loaded and can take it. The load is compared by
+ *  - the number of services (devices assigned to the CAM or its MTD sub
+ *    slots) first, as these are known immediately after an assignment,
+ *  - then the bitrate sent to the CAM, if it differs by more than
+ *    POOL_MARGIN_KBIT and POOL_MARGIN_PCT,
+ *  - then the number of scrambled PIDs.
+ * Equal loads are broken by the adapter order, so exactly one CAM of a
+ * group accepts, and VDR never runs out of choices.
+ ******************************************************************************/
+class cCamPool {
+private:
+  static cMutex mutex;
+  static std::vector<cAdapter*> adapters;
+
+public:
+  /* called by cAdapter's constructor and destructor. */
+  static void Add(cAdapter* Adapter);
+  static void Del(cAdapter* Adapter);
+
+  /* false, if another CAM of Adapter's group should get the next service.
+   * Sets Better to that CAM's device path then. */
+  static bool Preferred(cAdapter* Adapter, std::string& Better);
+
+  /* one line per group with its CAMs and their loads. */
+  static std::string Stats(void);
+};
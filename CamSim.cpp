@@ -0,0 +1,366 @@
+/*******************************************************************************
+ * @file CamSim.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <sstream>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/dvb/ca.h>
+#include <vdr/remux.h>   // TS_SIZE, TS_SCRAMBLING_CONTROL
+#include "CamSim.h"
+#include "CiAdapter.h"
+#include "Logging.h"
+
+static const int SIM_CHUNK   = 512 * TS_SIZE;   // max bytes read from secY at once
+static const int SIM_SOCKBUF = 1024 * 1024;     // socket buffer size of secY
+static const int SIM_POLL    = 10;              // max poll timeout in ms
+
+
+/*******************************************************************************
+ * class cCamSim
+ ******************************************************************************/
+cCamSim::cCamSim(int Number, const tCamSimParams& Params, caDevice& Ca) :
+  cThread(), params(Params), secIn(-1), secOut(-1), caPeer(-1), lastDue(0), queued(0),
+  tokens(0), rng(Number), resetRequest(false), pktIn(0), pktOut(0), pktLost(0),
+  resets(0), replaying(false)
+{
+  std::string adapter = "sim/adapter" + std::to_string(Number);
+  name = adapter + "/ca0";
+  SetDescription("cCamSim %s", name.c_str());
+
+  int w[2] = { -1, -1 };   // plugin writes w[0], we read w[1]
+  int r[2] = { -1, -1 };   // we write r[1], plugin reads r[0]
+  int c[2] = { -1, -1 };   // caY
+
+  if ((socketpair(AF_UNIX, SOCK_STREAM, 0, w) < 0) or
+      (socketpair(AF_UNIX, SOCK_STREAM, 0, r) < 0) or
+      (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, c) < 0)) {
+     log(1, "cCamSim " + name + ": couldn't create sockets: " + strerror(errno));
+     for(int fd:{ w[0], w[1], r[0], r[1], c[0], c[1] })
+        if (fd >= 0) close(fd);
+     return;
+     }
+
+  for(int fd:{ w[0], w[1], r[0], r[1] }) {
+     setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SIM_SOCKBUF, sizeof(SIM_SOCKBUF));
+     setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SIM_SOCKBUF, sizeof(SIM_SOCKBUF));
+     }
+  // the same modes as cPluginDDCI3::Find() uses on the real devices.
+  fcntl(r[0], F_SETFL, O_NONBLOCK);
+
+  secIn  = w[1];
+  secOut = r[1];
+  caPeer = c[1];
+
+  Ca.Number  = 0;
+  Ca.ca      = name;
+  Ca.sec     = adapter + "/sec0";
+  Ca.fd      = c[0];
+  Ca.sec_fdw = w[0];
+  Ca.sec_fdr = r[0];
+  Ca.Sim     = this;
+
+  log(2, "cCamSim " + name + ": delay " + std::to_string(params.DelayMs) +
+      "ms, jitter " + std::to_string(params.JitterMs) +
+      "ms, rate " + std::to_string(params.RateKbit) +
+      "kbit/s, loss " + std::to_string(params.LossPermille) +
+      "/1000, reset " + std::to_string(params.ResetSec) +
+      "s, scrambled " + std::to_string(params.ScrambledPermille) +
+      "/1000, hold " + std::to_string(params.HoldPackets) +
+      ", null loss " + std::to_string(params.NullLossPermille) + "/1000");
+}
+
+
+cCamSim::~cCamSim(void) {
+  _entering;
+
+  Cancel(3);
+  CleanUp();
+
+  _leaving;
+}
+
+
+void cCamSim::CleanUp(void) {
+  for(int* fd:{ &secIn, &secOut, &caPeer })
+     if (*fd != -1) { close(*fd); *fd = -1; }
+}
+
+
+bool cCamSim::ParseParams(std::string Arg, tCamSimParams& Params) {
+  std::stringstream ss(Arg);
+  std::string item;
+
+  while(std::getline(ss, item, ',')) {
+     size_t eq = item.find('=');
+     if (eq == std::string::npos)
+        return false;
+     std::string key = item.substr(0, eq);
+     int value;
+     if ((sscanf(item.c_str() + eq + 1, "%d", &value) < 1) or (value < 0))
+        return false;
+
+     if      (key == "delay")  Params.DelayMs      = value;
+     else if (key == "jitter") Params.JitterMs     = value;
+     else if (key == "rate")   Params.RateKbit     = value;
+     else if (key == "loss")   Params.LossPermille = value;
+     else if (key == "reset")  Params.ResetSec     = value;
+     else if (key == "scrambled") Params.ScrambledPermille = value;
+     else if (key == "hold")   Params.HoldPackets  = value;
+     else if (key == "nullloss") Params.NullLossPermille = value;
+     else
+        return false;
+     }
+  return (Params.LossPermille <= 1000) and (Params.ScrambledPermille <= 1000) and
+         (Params.NullLossPermille <= 1000);
+}
+
+
+int cCamSim::Ioctl(unsigned long Request, void* Arg) {
+  switch(Request) {
+     case CA_RESET:
+        resetRequest = true;
+        return 0;
+     case CA_GET_CAP: {
+        ca_caps_t* caps = (ca_caps_t*) Arg;
+        memset(caps, 0, sizeof(*caps));
+        caps->slot_num  = 1;
+        caps->slot_type = CA_CI_LINK;
+        return 0;
+        }
+     case CA_GET_SLOT_INFO: {
+        ca_slot_info_t* info = (ca_slot_info_t*) Arg;
+        if (info->num != 0) {
+           errno = EINVAL;
+           return -1;
+           }
+        info->type  = CA_CI_LINK;
+        info->flags = CA_CI_MODULE_PRESENT;
+        return 0;
+        }
+     default:
+        errno = ENOTTY;
+        return -1;
+     }
+}
+
+
+bool cCamSim::Start(void) {
+  log(3, std::string(__PRETTY_FUNCTION__) + "      " + name);
+
+  if (secIn < 0)
+     return false;
+  return cThread::Start();
+}
+
+
+void cCamSim::Cancel(int waitSec) {
+  _entering;
+
+  cThread::Cancel(waitSec);
+
+  _leaving;
+}
+
+
+void cCamSim::DoReset(void) {
+  // whatever is inside the CAM is lost on reset.
+  for(auto& c:queue)
+     pktLost += (c.data.size() - c.sent) / TS_SIZE;
+  queue.clear();
+  queued = 0;
+  lastDue = 0;
+  ++resets;
+  log(2, "cCamSim " + name + ": CAM reset");
+}
+
+
+bool cCamSim::Receive(uint64_t now) {
+  int max = SIM_CHUNK;
+  if (params.RateKbit) {
+     if (tokens < TS_SIZE)
+        return true;
+     if (tokens < max)
+        max = tokens;
+     }
+  max -= max % TS_SIZE;
+
+  tChunk c;
+  c.data.resize(max);
+  c.sent = 0;
+
+  ssize_t n = recv(secIn, c.data.data(), max, MSG_DONTWAIT);
+  if (n == 0)
+     return false;   // the plugin closed sec_fdw
+  if (n < 0)
+     return true;
+
+  /* the stream socket may split packets. Keep the rest for the next read,
+   * a real CAM works on whole packets as well. */
+  if (!part.empty()) {
+     c.data.insert(c.data.begin(), part.begin(), part.end());
+     n += part.size();
+     part.clear();
+     }
+  int rest = n % TS_SIZE;
+  if (rest)
+     part.assign(c.data.begin() + n - rest, c.data.begin() + n);
+  n -= rest;
+  c.data.resize(n);
+  if (params.RateKbit)
+     tokens -= n;
+
+  if (replaying) {
+     pktIn += n / TS_SIZE;
+     return true;
+     }
+
+  // lose and descramble
+  std::uniform_int_distribution<int> loss(0, 999);
+  size_t out = 0;
+  for(size_t i = 0; i < size_t(n); i += TS_SIZE) {
+     ++pktIn;
+     if ((params.LossPermille and (loss(rng) < params.LossPermille)) or
+         (params.NullLossPermille and (TsPid(&c.data[i]) == 0x1FFF) and (loss(rng) < params.NullLossPermille))) {
+        ++pktLost;
+        continue;
+        }
+     if (out != i)
+        memmove(&c.data[out], &c.data[i], TS_SIZE);
+     if (!params.ScrambledPermille or (loss(rng) >= params.ScrambledPermille))
+        c.data[out + 3] &= ~TS_SCRAMBLING_CONTROL;
+     out += TS_SIZE;
+     }
+  c.data.resize(out);
+  if (!out)
+     return true;
+
+  int64_t delay = params.DelayMs;
+  if (params.JitterMs) {
+     std::uniform_int_distribution<int> jitter(-params.JitterMs, params.JitterMs);
+     delay += jitter(rng);
+     }
+  c.due = now + (delay > 0 ? delay : 0);
+  if (c.due < lastDue)
+     c.due = lastDue;
+  lastDue = c.due;
+  queued += c.data.size();
+  queue.push_back(std::move(c));
+  return true;
+}
+
+
+void cCamSim::Schedule(uint64_t DueMs, const uint8_t* Data, int Count) {
+  tChunk c;
+  c.due = DueMs;
+  c.data.assign(Data, Data + Count);
+  c.sent = 0;
+
+  cMutexLock MutexLock(&scheduleMutex);
+  scheduled.push_back(std::move(c));
+}
+
+
+void cCamSim::Send(uint64_t now) {
+  while(!queue.empty() and (queue.front().due <= now)) {
+     tChunk& c = queue.front();
+     size_t len = c.data.size() - c.sent;
+     size_t hold = Hold();
+     if (queued <= hold)
+        return;   // waits for more packets to be pushed in
+     if (queued - hold < len)
+        len = queued - hold;
+     ssize_t n = send(secOut, c.data.data() + c.sent, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+     if (n <= 0)
+        return;   // plugin doesn't read, keep it
+     c.sent += n;
+     queued -= n;
+     if (c.sent < c.data.size())
+        return;
+     pktOut += c.data.size() / TS_SIZE;
+     queue.pop_front();
+     }
+}
+
+
+void cCamSim::Action(void) {
+  log(3, std::string(__PRETTY_FUNCTION__) + "      " + name);
+
+  uint64_t last = cTimeMs::Now();
+  cTimeMs resetTimer(params.ResetSec * 1000);
+  uint8_t tpdu[4096];
+
+  while(Running()) {
+     uint64_t now = cTimeMs::Now();
+
+     if (params.RateKbit) {
+        // kbit/s = bytes/ms * 8
+        tokens += (now - last) * params.RateKbit / 8.0;
+        if (tokens > SIM_CHUNK)
+           tokens = SIM_CHUNK;
+        }
+     last = now;
+
+     if (resetRequest.exchange(false) or
+         (params.ResetSec and resetTimer.TimedOut())) {
+        DoReset();
+        resetTimer.Set(params.ResetSec * 1000);
+        }
+
+     if (replaying) {
+        cMutexLock MutexLock(&scheduleMutex);
+        while(!scheduled.empty()) {
+           queued += scheduled.front().data.size();
+           queue.push_back(std::move(scheduled.front()));
+           scheduled.pop_front();
+           }
+        }
+
+     Send(now);
+
+     int timeout = SIM_POLL;
+     if (!queue.empty() and (queue.front().due > now) and (queue.front().due - now < uint64_t(timeout)))
+        timeout = queue.front().due - now;
+
+     cPoller Poller;
+     Poller.Add(caPeer, false);
+     if (!params.RateKbit or (tokens >= TS_SIZE))
+        Poller.Add(secIn, false);
+     if (!queue.empty() and (queue.front().due <= now) and
+         (queued > Hold()))
+        Poller.Add(secOut, true);
+
+     if (!Poller.Poll(timeout))
+        continue;
+
+     // TPDUs are swallowed, there is no CI protocol here.
+     if ((caPeer >= 0) and (recv(caPeer, tpdu, sizeof(tpdu), MSG_DONTWAIT) == 0)) {
+        close(caPeer);
+        caPeer = -1;
+        }
+
+     if (!Receive(cTimeMs::Now())) {
+        log(3, "cCamSim " + name + ": sec_fdw closed");
+        break;
+        }
+     } // while(Running())
+
+  _leaving;
+}
@@ -0,0 +1,146 @@
+/*******************************************************************************
+ * @file CamSim.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <random>
+#include <vdr/thread.h>
+#include <vdr/tools.h>
+#include <vdr/remux.h>   // TS_SIZE
+
+/*******************************************************************************
+ * forward declarations.
+ ******************************************************************************/
+class caDevice;
+
+
+/*******************************************************************************
+ * parameters of a simulated CAM
+ ******************************************************************************/
+struct tCamSimParams {
+  int DelayMs;       //< descramble delay, time a packet stays inside the CAM
+  int JitterMs;      //< +/- random jitter added to DelayMs
+  int RateKbit;      //< CI throughput cap in kbit/s, 0 = unlimited
+  int LossPermille;  //< packets lost inside the CAM, in 1/1000
+  int ResetSec;      //< CAM resets itself every n seconds, 0 = never
+  int ScrambledPermille; //< packets returned still scrambled, in 1/1000
+  int HoldPackets;   //< packets kept inside the CAM until new ones are pushed in
+  int NullLossPermille; //< null packets lost inside the CAM, in 1/1000, on top of LossPermille
+  tCamSimParams(void) : DelayMs(10), JitterMs(0), RateKbit(96000), LossPermille(0),
+                        ResetSec(0), ScrambledPermille(0), HoldPackets(0), NullLossPermille(0) {}
+};
+
+
+/*******************************************************************************
+ * This class simulates a DD CI adapter with a CAM, so that the whole TS data
+ * path can run without hardware.
+ *
+ * secY is a pair of unix stream sockets: whatever the plugin writes to
+ * sec_fdw comes back on sec_fdr after DelayMs (+/- JitterMs), with the
+ * scrambling control bits cleared and limited to RateKbit. Like the DD CI
+ * hardware, the last HoldPackets stay inside until new packets are pushed
+ * in. caY is a socket
+ * as well, TPDUs written to it are swallowed and nothing is ever answered:
+ * there is no CI protocol, the module is reported as present but not ready.
+ * The CA ioctls of cAdapter end up in Ioctl().
+ ******************************************************************************/
+class cCamSim : public cThread {
+private:
+  struct tChunk {
+     uint64_t due;                //< time in ms when the chunk leaves the CAM
+     std::vector<uint8_t> data;   //< the descrambled packets
+     size_t sent;                 //< bytes already written to secY
+     };
+  tCamSimParams params;
+  std::string name;
+  int secIn;                      //< sim side of sec_fdw
+  int secOut;                     //< sim side of sec_fdr
+  int caPeer;                     //< sim side of the caY fd
+  std::deque<tChunk> queue;       //< packets inside the CAM
+  std::vector<uint8_t> part;      //< incomplete packet of the last read
+  uint64_t lastDue;               //< the CAM never reorders packets
+  size_t queued;                  //< bytes inside the CAM, not yet sent
+  double tokens;                  //< rate limiter, bytes allowed to read
+  std::mt19937 rng;
+  std::atomic<bool> resetRequest;
+  std::atomic<uint64_t> pktIn;
+  std::atomic<uint64_t> pktOut;
+  std::atomic<uint64_t> pktLost;
+  std::atomic<uint64_t> resets;
+  std::atomic<bool> replaying;    //< CAM output comes from Schedule() only
+  cMutex scheduleMutex;           //< protects scheduled
+  std::deque<tChunk> scheduled;   //< Schedule() data, not yet in queue
+
+  void CleanUp(void);
+  size_t Hold(void) { return replaying ? 0 : params.HoldPackets * TS_SIZE; }
+  void DoReset(void);
+  bool Receive(uint64_t now);
+  void Send(uint64_t now);
+
+protected:
+  virtual void Action(void);
+
+public:
+  /* Constructor, creates the sockets and fills Ca with the plugin side
+   * file handles and device names, as cPluginDDCI3::Find() does for a
+   * real device. Ca.Sim is set to this object.
+   * @param Number - number of the simulated adapter, used for the names
+   * @param Params - the CAM behaviour
+   * @param Ca     - the device to fill
+   */
+  cCamSim(int Number, const tCamSimParams& Params, caDevice& Ca);
+
+  /* Destructor */
+  virtual ~cCamSim(void);
+
+  /* Parses a parameter list "delay=10,jitter=2,rate=96000,loss=0,reset=0,scrambled=0,hold=0,
+   * nullloss=0".
+   * Unknown keys or invalid values return false.
+   */
+  static bool ParseParams(std::string Arg, tCamSimParams& Params);
+
+  /* Handles the CA ioctls cAdapter does on caY: CA_RESET, CA_GET_CAP and
+   * CA_GET_SLOT_INFO. Returns -1 with errno = ENOTTY for all others.
+   */
+  int Ioctl(unsigned long Request, void* Arg);
+
+  bool Start(void);
+  void Cancel(int waitSec = 0);
+
+  /* Replay mode, used by tools/ddci3-replay: data written to secY is
+   * swallowed, the CAM output is what Schedule() queues.
+   */
+  void Replay(void) { replaying = true; }
+
+  /* Queues Count bytes of Data to leave the CAM at DueMs (cTimeMs::Now()).
+   * Thread safe, the chunks have to be scheduled in time order.
+   */
+  void Schedule(uint64_t DueMs, const uint8_t* Data, int Count);
+
+  /* statistics */
+  uint64_t PacketsIn(void)   { return pktIn;   }
+  uint64_t PacketsOut(void)  { return pktOut;  }
+  uint64_t PacketsLost(void) { return pktLost; }
+  uint64_t Resets(void)      { return resets;  }
+};
@@ -25,25 +25,31 @@
 #include "TsSender.h"
 #include "Logging.h"
 
+#include <algorithm>
 #include <vdr/remux.h>
 
-extern bool IgnoreActiveFlag;   // global flag
-extern bool ClearScramblingBit; // global flag
+extern bool CamDedup;           // global flag
 
 static const int SCT_DBG_TMO = 2000;   // 2000 milliseconds
 static const int CNT_SCT_DBG_MAX = 20;
+static const uint64_t SUB_FLUSH_MS = 3000;  // max time to drop a flushed MTD sub slot
 
 
 /*******************************************************************************
  * class cCiCamSlot
  ******************************************************************************/
 cCiCamSlot::cCiCamSlot(cAdapter& Adapter, cTsSender& TsSend) :
-   cCamSlot(&Adapter, true), adapter(Adapter), tsSend(TsSend),
-   clear_rBuffer(false), delivered(false), active(false), cntSctPkt(0),
-   cntSctPktL(0), cntSctClrPkt(0), cntSctDbg(0)
+   cCamSlot(&Adapter, true), adapter(Adapter), tsSend(TsSend), rBuffer(new cReceiveBuffer(Adapter.BufSize())),
+   rbPut(0), rbGot(0), rbMark(0), rbAcked(0), delivered(false), active(false), cntSctPkt(0),
+   cntSctPktL(0), cntSctClrPkt(0), cntSctDbg(0), cntDelivered(0), flushing(0)
 {
   log(3, std::string(__FUNCTION__) + ": " + Adapter.DevPath());
 
+  for(auto& f:flush) {
+     f.until = 0;
+     f.time = 0;
+     }
+
   MtdEnable();
 }
 
@@ -52,6 +58,7 @@ cCiCamSlot::~cCiCamSlot(void) {
   _entering;
 
   StopIt();
+  delete rBuffer;
 
   _leaving;
 }
@@ -61,6 +68,7 @@ bool cCiCamSlot::Reset(void) {
   _entering;
   log(2, __FUNCTION__);
 
+  adapter.Trace().Add(teSlotReset);
   bool ret = cCamSlot::Reset();
   if (ret)
      StopIt();
@@ -70,16 +78,55 @@ bool cCiCamSlot::Reset(void) {
 }
 
 
+bool cCiCamSlot::CanDecrypt(const cChannel* Channel, cMtdMapper* MtdMapper) {
+  /* with MTD, VDR asks before a new sub slot is spawned: refuse, if the
+   * CAM is loaded already, so VDR picks another CAM or device. A sub slot
+   * asks with its MtdMapper; without MTD, a slot with a device serves no
+   * other one. Either way, its device zaps: no new service. VDR polls
+   * here, a refusal isn't counted, see cAdapter::Assign(). */
+  bool known = MtdMapper or (!MtdActive() and Device());
+  if (!known and !adapter.Admissible(true))
+     return false;
+  return cCamSlot::CanDecrypt(Channel, MtdMapper);
+}
+
+
+void cCiCamSlot::SetPid(int Pid, bool Active) {
+  pidMutex.Lock();
+  if (Active)
+     pids.insert(Pid);
+  else
+     pids.erase(Pid);
+  pidMutex.Unlock();
+  cCamSlot::SetPid(Pid, Active);
+}
+
+
+std::vector<int> cCiCamSlot::ActivePids(void) {
+  cMutexLock MutexLock(&pidMutex);
+  return std::vector<int>(pids.begin(), pids.end());
+}
+
+
 void cCiCamSlot::StartDecrypting(void) {
   _entering;
   log(2, __FUNCTION__);
+  adapter.Trace().Add(teSlotStart);
+  adapter.Zap().Start();
 
   mutex.Lock();    // to lock the processing against StopIt
   active = true;
   mutex.Unlock();  // need to unlock it before base class call to avoid deadlock
+  adapter.Unpark();
 
-  if (!MtdActive())
+  /* with MTD, a sub slot calls us before it starts: what is still on the
+   * way for it belongs to its last channel. */
+  if (MtdActive())
+     FlushSubSlots();
+  else {
+     adapter.Watch().Restart(0);
      cCamSlot::StartDecrypting();
+     }
 
   _leaving;
 }
@@ -88,9 +135,18 @@ void cCiCamSlot::StartDecrypting(void) {
 void cCiCamSlot::StopDecrypting(void) {
   _entering;
   log(2, __FUNCTION__);
+  adapter.Trace().Add(teSlotStop);
 
+  /* with MTD, a sub slot calls us once none decrypts anymore. What a
+   * stopped sub slot left on the way is flushed by the next start, see
+   * StartDecrypting(). */
   cCamSlot::StopDecrypting();
   StopIt();
+  for(int i = 0; i < cScrambleWatch::SLOTS; i++)
+     adapter.Watch().Restart(i);
+  pidMutex.Lock();
+  pids.clear();   // as VDR clears its CA program list
+  pidMutex.Unlock();
 
   _leaving;
 }
@@ -105,12 +161,17 @@ uint8_t* cCiCamSlot::Decrypt(uint8_t* Data, int& Count) {
   if (Data)
      Count -= (Count % TS_SIZE);  // we write only whole TS frames
 
-  if (!(active || IgnoreActiveFlag))
+  if (!(active || adapter.Config().IgnoreActiveFlag))
      return 0;
 
   /* WRITE */
-  if (Data)
-     Count = tsSend.Write(Data, Count);
+  if (Data) {
+     int cnt = Count;
+     int subSlot = (MtdActive() and Count) ? SubSlotOf(TsPid(Data)) : 0;
+     Count = tsSend.Write(Data, Count, subSlot);
+     if (Count < cnt)
+        adapter.Trace().Add(teDecShort, cnt - Count);
+     }
 
   /* with MTD support active, decrypted TS packets are sent to the
    * individual MTD CAM slots in DataRecv(). */
@@ -123,29 +184,51 @@ uint8_t* cCiCamSlot::Decrypt(uint8_t* Data, int& Count) {
    * only chance we have is to delete now the last sent frame from the
    * buffer.*/
   if (delivered) {
-     rBuffer.Del(TS_SIZE);
+     rBuffer->Del(TS_SIZE);
+     ++rbGot;
      delivered = false;
      }
 
-  if (clear_rBuffer) {
-     rBuffer.Clear();
-     clear_rBuffer = false;
+  /* after a clear, everything is stale until the deliver thread got rid of
+   * the stale CAM output, then up to its mark. */
+  bool acked = rbAcked.load(std::memory_order_acquire) == tsSend.Epoch();
+  uint64_t mark = acked ? rbMark.load(std::memory_order_relaxed) : UINT64_MAX;
+  if (rbGot < mark) {
+     uint64_t dropped = 0;
+     int cnt = 0;
+     uint8_t* data;
+     while((rbGot < mark) and (data = rBuffer->Get(cnt)) and (cnt >= TS_SIZE)) {
+        int n = std::min(uint64_t(cnt / TS_SIZE), mark - rbGot);
+        rBuffer->Del(n * TS_SIZE);
+        rbGot += n;
+        dropped += n;
+        }
+     if (dropped)
+        adapter.Trace().Add(teSlotClear, dropped);
+     if (!acked)
+        return 0;
      }
 
   int cnt = 0;
-  uint8_t* data = rBuffer.Get(cnt);
+  uint8_t* data = rBuffer->Get(cnt);
 
-  if (!data || (cnt < TS_SIZE))
+  if (!data || (cnt < TS_SIZE)) {
      data = 0;
+     if (cntDelivered) {
+        adapter.Trace().Add(teDecEmpty, cntDelivered);
+        cntDelivered = 0;
+        }
+     }
   else {
      if (TsIsScrambled(data)) {
         ++cntSctPkt;
-        if (ClearScramblingBit) {
+        if (adapter.Config().ClearScramblingBit) {
            data[3] &= ~TS_SCRAMBLING_CONTROL;
            ++cntSctClrPkt;
            }
         }
      if ((cntSctPkt != cntSctPktL) && (cntSctDbg < CNT_SCT_DBG_MAX) && timSctDbg.TimedOut()) {
+        adapter.Trace().Add(teDecScrambled, cntSctPkt);
         cntSctPktL = cntSctPkt;
         ++cntSctDbg;
         log(3, "cCamSlot(" + tsSend.DevPath() + ") got " +
@@ -155,6 +238,9 @@ uint8_t* cCiCamSlot::Decrypt(uint8_t* Data, int& Count) {
         timSctDbg.Set(SCT_DBG_TMO);
         }
      delivered = true;
+     ++cntDelivered;
+     if (adapter.Zap().Tracking() and adapter.Zap().Delivered(data, TS_SIZE))
+        adapter.ZapDone();
      }
 
   return data;
@@ -166,43 +252,242 @@ bool cCiCamSlot::Inject(uint8_t* Data, int Count) {
 }
 
 
-int cCiCamSlot::DataRecv(uint8_t* Data, int Count) {
-  if (!(active || IgnoreActiveFlag))
-     return Count;   // not active, eat all the Data
-
+int cCiCamSlot::Put(uint8_t* Data, int Count) {
   int written;
 
   if (MtdActive())
      written = MtdPutData(Data, Count);
   else {
-     int free = rBuffer.Free();
+     int free = rBuffer->Free();
      free -= free % TS_SIZE;   // write only whole packets
      if (free >= TS_SIZE) {
         if (free < Count)
            Count = free;
-        written = rBuffer.Put(Data, Count);
-        if (written != Count)
+        written = rBuffer->Put(Data, Count);
+        rbPut.fetch_add(written / TS_SIZE, std::memory_order_release);
+        if (written != Count) {
            log(1, std::string(__PRETTY_FUNCTION__) +
                ": Couldn't write previously checked free Data ?!? " +
                strerror(errno));
+           adapter.Trace().Error(errno);
+           }
         }
      else
         written = 0;
      }
+  return written;
+}
+
+
+int cCiCamSlot::SubSlotNumber(cCamSlot* Slot) {
+  if (Slot->IsMasterSlot())
+     return 0;
+  /* VDR numbers the sub slots of a master from 1 up, in the order they are
+   * spawned; each is added to CamSlots when it is created. */
+  cCamSlot* master = Slot->MasterSlot();
+  int n = 0;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s)) {
+     if ((s->MasterSlot() != master) or s->IsMasterSlot())
+        continue;
+     ++n;
+     if (s == Slot)
+        return n;
+     }
+  return 0;
+}
+
+
+cCamSlot* cCiCamSlot::SubSlot(int Number) {
+  int n = 0;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s)) {
+     if ((s->MasterSlot() == this) and !s->IsMasterSlot() and (++n == Number))
+        return s;
+     }
+  return nullptr;
+}
+
+
+void cCiCamSlot::FlushSubSlots(void) {
+  cBypass& bypass = adapter.Bypass();
+  uint64_t received = bypass.ReceivedCount();
+  ExpireFlushes(received);
+
+  std::string flushed;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s)) {
+     if ((s->MasterSlot() != this) or s->IsMasterSlot() or s->IsDecrypting())
+        continue;
+     int n = SubSlotNumber(s);
+     if ((n <= 0) or (n >= SUB_SLOTS))
+        continue;
+     adapter.Watch().Restart(n);
+     uint64_t until = bypass.LastSent(n);
+     if (until <= received) {
+        // nothing of it on the way, its new packets are not to be dropped.
+        uint64_t old = flush[n].until.exchange(0);
+        if (old)
+           --flushing;
+        continue;
+        }
+     flush[n].time = cTimeMs::Now();
+     if (!flush[n].until.exchange(until))
+        ++flushing;
+     flushed += " " + std::to_string(n);
+     }
+  if (!flushed.empty())
+     log(3, "cCamSlot(" + tsSend.DevPath() + ") flushing MTD sub slot(s)" + flushed);
+}
+
+
+void cCiCamSlot::ExpireFlushes(uint64_t Received) {
+  for(int n = 1; n < SUB_SLOTS; n++) {
+     uint64_t until = flush[n].until.load(std::memory_order_relaxed);
+     if (until and ((until <= Received) or (cTimeMs::Now() - flush[n].time >= SUB_FLUSH_MS)) and
+         flush[n].until.compare_exchange_strong(until, 0))
+        --flushing;
+     }
+}
+
+
+bool cCiCamSlot::Flushed(const uint8_t* Packet, uint64_t Sequence) {
+  int n = SubSlotOf(TsPid(Packet));
+  if (n >= SUB_SLOTS)
+     return false;
+  uint64_t until = flush[n].until.load(std::memory_order_relaxed);
+  if (!until)
+     return false;
+  /* If the CAM lost packets, Sequence never gets there. Nothing stays in
+   * the CAM for SUB_FLUSH_MS. */
+  if ((Sequence < until) and (cTimeMs::Now() - flush[n].time < SUB_FLUSH_MS))
+     return true;
+  if (flush[n].until.compare_exchange_strong(until, 0))
+     --flushing;
+  return false;
+}
+
+
+int cCiCamSlot::PutCam(uint8_t* Data, int Count) {
+  if (!CamDedup and !flushing)
+     return Put(Data, Count);
+
+  if (flushing)
+     ExpireFlushes(adapter.Bypass().ReceivedCount());
+
+  cDedup& dedup = adapter.Dedup();
+  if (!MtdActive()) {
+     // no sub slots to copy to, but the entries have to be passed.
+     int written = Put(Data, Count);
+     for(int i = 0; CamDedup and (i < written); i += TS_SIZE) {
+        dedup.Lost(dedup.Claim(Data + i));
+        dedup.Done();
+        }
+     return written;
+     }
+
+  // packet by packet, the copies have to follow their original.
+  uint64_t seq = adapter.Bypass().ReceivedCount();
+  uint8_t copy[TS_SIZE];
+  int done = 0;
+  while(Count - done >= TS_SIZE) {
+     uint8_t* p = Data + done;
+     int copies = CamDedup ? dedup.Claim(p) : 0;
+     if (!Flushed(p, seq) and !MtdPutData(p, TS_SIZE))
+        break;
+     for(int i = 0; i < copies; i++) {
+        dedup.Copy(p, i, copy);
+        if (!Flushed(copy, seq) and !MtdPutData(copy, TS_SIZE))
+           dedup.Lost(1);
+        }
+     if (CamDedup)
+        dedup.Done();
+     done += TS_SIZE;
+     ++seq;
+     }
+  return done;
+}
+
+
+int cCiCamSlot::Merge(uint8_t* Data, int Count) {
+  cBypass& bypass = adapter.Bypass();
+  cMutexLock MutexLock(&bypass.Mutex());
+  uint64_t stalls = bypass.Stalls();
+  int done = 0;
+
+  for(;;) {
+     // first the bypassed packets which are due now,
+     uint8_t* p;
+     while((p = bypass.Due())) {
+        if (!(flushing and Flushed(p, bypass.ReceivedCount())) and !Put(p, TS_SIZE))
+           return done;
+        bypass.Del();
+        }
+     if (done >= Count)
+        break;
+
+     // then the CAM packets up to the next bypassed packet.
+     int n = Count - done;
+     int64_t before = bypass.Before();
+     if ((before >= 0) && (before * TS_SIZE < n))
+        n = before * TS_SIZE;
+     int w = PutCam(Data + done, n);
+     bypass.Received(w / TS_SIZE);
+     done += w;
+     if (w < n)
+        break;
+     }
+
+  if (bypass.Stalls() != stalls)
+     adapter.Trace().Add(teBypassStall, bypass.Stalls() - stalls);
+  return done;
+}
+
+
+int cCiCamSlot::DataRecv(uint8_t* Data, int Count) {
+  if (!(active || adapter.Config().IgnoreActiveFlag))
+     return Count;   // not active, eat all the Data
+
+  int written;
+  cBypass& bypass = adapter.Bypass();
+
+  if (bypass.Pending())
+     written = Merge(Data, Count);
+  else {
+     written = PutCam(Data, Count);
+     bypass.Received(written / TS_SIZE);
+     }
+
+  if (!Count)
+     return 0;
+  if (written)
+     adapter.Trace().Add(teSlotPut, written);
+  else
+     adapter.Trace().Add(teSlotFull, Count);
 
   return written;
 }
 
 
+void cCiCamSlot::Cleared(uint32_t Epoch) {
+  rbMark.store(rbPut.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  rbAcked.store(Epoch, std::memory_order_release);
+}
+
+
+void cCiCamSlot::ResizeBuffer(int Packets) {
+  delete rBuffer;
+  rBuffer = new cReceiveBuffer(Packets);
+  rbGot = rbPut.load(std::memory_order_relaxed);
+  delivered = false;
+}
+
+
 void cCiCamSlot::StopIt(void) {
   cMutexLock MutexLock(&mutex);
   active = false;
-  clear_rBuffer = true;
-  delivered = false;
   cntSctPkt = 0;
   cntSctClrPkt = 0;
   cntSctDbg = 0;
   timSctDbg.Set(SCT_DBG_TMO);
+  cntDelivered = 0;
 
   adapter.ClrBuffers();
 }
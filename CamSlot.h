@@ -21,6 +21,9 @@
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
 #pragma once
+#include <atomic>
+#include <set>
+#include <vector>
 #include <vdr/ci.h>
 #include "Common.h"
 
@@ -40,16 +43,19 @@ private:
   //-------------------------
   class cReceiveBuffer: public cRingBufferLinear {
      public:
-        cReceiveBuffer() : cRingBufferLinear(BufferSize(), TS_SIZE, DebugBuffers,
-                           "DDCI Slot cReceiveBuffer" ) {}
+        cReceiveBuffer(int Packets) : cRingBufferLinear(BufferSize(Packets), TS_SIZE,
+                           DebugBuffers, "DDCI Slot cReceiveBuffer" ) {}
         virtual ~cReceiveBuffer() {}
     };
   //-------------------------
   cAdapter& adapter;       //< the adapter of this CAM slot
   cMutex mutex;            //< the synchronization mutex for Start/StopDecrypting
   cTsSender& tsSend;       //< the CAM TS sender
-  cReceiveBuffer rBuffer;  //< the receive buffer
-  bool clear_rBuffer;      //< true, when the receive buffer shall be cleared
+  cReceiveBuffer* rBuffer; //< the receive buffer, replaced by ResizeBuffer()
+  std::atomic<uint64_t> rbPut;    //< packets put to rBuffer, never reset
+  uint64_t rbGot;                 //< packets deleted from rBuffer, Decrypt() only
+  std::atomic<uint64_t> rbMark;   //< rBuffer packets up to here are stale
+  std::atomic<uint32_t> rbAcked;  //< the cTsSender::Clear() epoch of rbMark
   bool delivered;          //< true, if Decrypt did deliver data at last call
   bool active;             //< true, if this slot does decrypting
   int cntSctPkt;           //< number of scrambled packets got from CAM
@@ -57,9 +63,44 @@ private:
   int cntSctClrPkt;        //< number of cleared scrambling control bits
   int cntSctDbg;           //< counter for scrambling control debugging
   cTimeMs timSctDbg;       //< timer for scrambling control debugging
+  int cntDelivered;        //< packets delivered since the buffer ran empty
+
+  struct tFlush {
+     std::atomic<uint64_t> until;   //< drop the CAM output up to this packet, 0: none
+     std::atomic<uint64_t> time;    //< cTimeMs::Now() of the flush
+     };
+  tFlush flush[SUB_SLOTS];  //< per MTD sub slot
+  std::atomic<int> flushing;//< sub slots with a flush running
+  cMutex pidMutex;         //< locks pids
+  std::set<int> pids;      //< the PIDs VDR set active, see SetPid()
 
   void StopIt(void);
 
+  /* drops the packets of the MTD sub slots which aren't decrypting (now
+   * stopped or about to (re)start) from the CAM output, up to the last one
+   * each of them sent, and starts their cScrambleWatch over. The other sub
+   * slots keep theirs. */
+  void FlushSubSlots(void);
+
+  /* ends the flushes whose packets all came back, Received is the CAM
+   * output so far, or which ran for SUB_FLUSH_MS. */
+  void ExpireFlushes(uint64_t Received);
+
+  /* true, if Packet belongs to a flushed sub slot. Sequence is its number
+   * in the CAM output, counted by the bypass. */
+  bool Flushed(const uint8_t* Packet, uint64_t Sequence);
+
+  /* puts Count bytes to the receive buffer or the MTD slots.
+   * @return the number of bytes actually written */
+  int Put(uint8_t* Data, int Count);
+
+  /* Put() for packets from the CAM: with CamDedup, puts the copies for
+   * the other sub slots behind each packet. */
+  int PutCam(uint8_t* Data, int Count);
+
+  /* DataRecv() while there are bypassed packets: merges them in order. */
+  int Merge(uint8_t* Data, int Count);
+
 public:
   /* Constructor, creates a new CAM slot for the given adapter.
    * The adapter will take care of deleting the CAM slot, so the
@@ -75,6 +116,8 @@ public:
   /* see <vdr/ci.h> for the following functions */
 
   virtual bool Reset(void);
+  virtual bool CanDecrypt(const cChannel* Channel, cMtdMapper* MtdMapper = nullptr);
+  virtual void SetPid(int Pid, bool Active);
   virtual void StartDecrypting(void);
   virtual void StopDecrypting(void);
 
@@ -106,9 +149,38 @@ public:
    * @param data the received TS packet(s) from the CAM; it have to point to
    *        the beginning of a packet (start with TS_SYNC_BYTE).
    * @param count the number of bytes in data (shall be at least TS_SIZE).
+   *        May be 0, to deliver bypassed packets only.
    * @return the number of bytes actually processed
    */
   int DataRecv(uint8_t* Data, int Count);
 
+  /* cAdapter::Cleared(), from the deliver thread: what is in the receive
+   * buffer now is stale, see cTsSender::Clear(). */
+  void Cleared(uint32_t Epoch);
+
+  /* true, while this slot or one of its MTD sub slots decrypts. */
+  bool Active(void) { return active; }
+
+  /* locks Start/StopDecrypting(), see cAdapter::Resize(). */
+  cMutex& Mutex(void) { return mutex; }
+
+  /* cAdapter::Resize(), with Mutex() locked and not Active(): a new
+   * receive buffer of Packets. What is left in the old one is dropped. */
+  void ResizeBuffer(int Packets);
+
   void StartMtd(void) { MtdEnable(); }
+
+  /* the PIDs set active by VDR since the last StopDecrypting(), without
+   * those of VDR's MTD sub slots. cDevice::HasPid() is protected. */
+  std::vector<int> ActivePids(void);
+
+  /* the CA system ids of the CAM, GetCaSystemIds() is protected. */
+  const int* CaSystemIds(void) { return GetCaSystemIds(); }
+
+  /* The number of the MTD sub slot Slot, as in the upper bits of its unique
+   * PIDs; 0 for a master slot. */
+  static int SubSlotNumber(cCamSlot* Slot);
+
+  /* our MTD sub slot Number, or nullptr. */
+  cCamSlot* SubSlot(int Number);
 };
@@ -0,0 +1,163 @@
+/*******************************************************************************
+ * @file Capture.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstring>
+#include <fcntl.h>
+#include <vdr/tools.h>
+#include "Capture.h"
+#include "Trace.h"     // cTraceRing::Now()
+#include "Logging.h"
+
+static const int CAPTURE_BUFSIZE = MEGABYTE(8);
+
+
+/*******************************************************************************
+ * class cCapture
+ ******************************************************************************/
+cCapture::cCapture(std::string Directory, std::string Device, std::string Suffix, bool Raw) :
+  cThread(), fd(-1), rb(CAPTURE_BUFSIZE, 0, false, "ddci3 cCapture"), raw(Raw),
+  pendingLost(0), bytes(0), lost(0)
+{
+  tCaptureHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.Magic, CAPTURE_MAGIC, sizeof(h.Magic));
+  h.Version  = CAPTURE_VERSION;
+  h.MonoTime = cTraceRing::Now();
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  h.RealTime = uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  strncpy(h.Device, Device.c_str(), sizeof(h.Device) - 1);
+
+  // /dev/dvb/adapter0/ca0 -> ddci3-adapter0-ca0-<seconds><Suffix>
+  file = Device;
+  if (file.find("/dev/dvb/") == 0)
+     file.erase(0, 9);
+  for(auto& c:file)
+     if (c == '/') c = '-';
+  file = Directory + "/ddci3-" + file + "-" + std::to_string(ts.tv_sec) + Suffix;
+
+  SetDescription("cCapture %s", file.c_str());
+
+  fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+     log(1, "couldn't open capture file " + file + ": " + strerror(errno));
+  else if (!raw and (safe_write(fd, &h, sizeof(h)) != sizeof(h))) {
+     log(1, "couldn't write capture file " + file + ": " + strerror(errno));
+     CleanUp();
+     }
+}
+
+
+cCapture::~cCapture(void) {
+  _entering;
+
+  Cancel(3);
+  CleanUp();
+  log(2, "capture " + file + " closed, " + std::to_string(bytes) + " bytes, " +
+      std::to_string(lost) + " bytes lost");
+
+  _leaving;
+}
+
+
+bool cCapture::Start(void) {
+  log(3, std::string(__PRETTY_FUNCTION__) + "     " + file);
+
+  if (fd < 0)
+     return false;
+  return cThread::Start();
+}
+
+
+void cCapture::Cancel(int waitSec) {
+  _entering;
+
+  cThread::Cancel(waitSec);
+
+  _leaving;
+}
+
+
+void cCapture::Add(eCaptureDir Direction, const uint8_t* Data, int Count) {
+  cMutexLock MutexLock(&mutex);
+
+  if (raw) {
+     if (rb.Free() < Count)
+        lost += Count;
+     else {
+        rb.Put(Data, Count);
+        bytes += Count;
+        }
+     return;
+     }
+
+  tCaptureRecord r;
+  memset(&r, 0, sizeof(r));
+  r.Time = cTraceRing::Now();
+
+  int need = sizeof(r) + Count;
+  if (pendingLost)
+     need += sizeof(r);
+  if (rb.Free() < need) {
+     pendingLost += Count;
+     lost += Count;
+     return;
+     }
+
+  if (pendingLost) {
+     r.Length = pendingLost;
+     r.Direction = cdLost;
+     rb.Put((const uchar*) &r, sizeof(r));
+     pendingLost = 0;
+     }
+
+  r.Length = Count;
+  r.Direction = Direction;
+  rb.Put((const uchar*) &r, sizeof(r));
+  rb.Put(Data, Count);
+  bytes += Count;
+}
+
+
+void cCapture::Action(void) {
+  log(3, std::string(__PRETTY_FUNCTION__) + "     " + file);
+
+  rb.SetTimeouts(0, 100);
+
+  /* keep on writing until the buffer is empty, so that nothing added
+   * before Cancel() is missing in the file. */
+  for(;;) {
+     int cnt = 0;
+     uint8_t* data = rb.Get(cnt);
+     if (!data) {
+        if (!Running())
+           break;
+        continue;
+        }
+     if (safe_write(fd, data, cnt) != cnt) {
+        log(1, "couldn't write capture file " + file + ": " + strerror(errno));
+        break;
+        }
+     rb.Del(cnt);
+     }
+
+  _leaving;
+}
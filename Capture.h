@@ -0,0 +1,108 @@
+/*******************************************************************************
+ * @file Capture.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <vdr/thread.h>
+#include <vdr/ringbuffer.h>
+
+/*******************************************************************************
+ * Capture files: a tCaptureHeader, followed by tCaptureRecord, each followed
+ * by 'Length' bytes of TS data as written to / read from adapterX/secY.
+ * Host byte order, like the trace dumps.
+ ******************************************************************************/
+static const char CAPTURE_MAGIC[8] = { 'D','D','C','I','3','C','A','P' };
+static const uint32_t CAPTURE_VERSION = 1;
+
+struct tCaptureHeader {
+  char     Magic[8];     // CAPTURE_MAGIC
+  uint32_t Version;      // CAPTURE_VERSION
+  uint32_t Reserved;
+  uint64_t MonoTime;     // CLOCK_MONOTONIC in ns at start of capture
+  uint64_t RealTime;     // CLOCK_REALTIME in ns at start of capture
+  char     Device[64];   // adapterX/caY device path
+};
+
+enum eCaptureDir : uint8_t {
+  cdToCam   = 0,         // written to secY
+  cdFromCam = 1,         // read from secY
+  cdLost    = 2          // no data, 'Length' bytes were not captured
+};
+
+struct tCaptureRecord {
+  uint64_t Time;         // CLOCK_MONOTONIC in ns
+  uint32_t Length;       // bytes following this record
+  uint8_t  Direction;    // eCaptureDir
+  uint8_t  Reserved[3];
+};
+
+
+
+/*******************************************************************************
+ * This class records both directions of secY to a capture file.
+ * Add() is called by the TS threads and never blocks: the data is copied
+ * to a ring buffer and written by the capture thread. If the disk can't
+ * keep up, data is dropped and a cdLost record is written instead.
+ *
+ * A raw capture (tap) writes only the data, no header and no records: a
+ * plain .ts file of one direction. Lost data is only counted.
+ ******************************************************************************/
+class cCapture : public cThread {
+private:
+  std::string file;      //< the capture file name
+  int fd;                //< the capture file
+  cRingBufferLinear rb;  //< records waiting to be written
+  cMutex mutex;          //< sender and receiver both call Add()
+  bool raw;              //< data only, no header and no records
+  uint32_t pendingLost;  //< bytes lost since the last successful Add()
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> lost;
+
+  void CleanUp(void) { if (fd != -1) { close(fd); fd = -1; } }
+
+protected:
+  virtual void Action(void);
+
+public:
+  /* Constructor, creates the capture file in Directory.
+   * @param Directory - where to create the file
+   * @param Device    - adapterX/caY device path, part of the file name
+   * @param Suffix    - appended to the file name
+   * @param Raw       - write a raw capture, see above
+   */
+  cCapture(std::string Directory, std::string Device, std::string Suffix = ".cap",
+           bool Raw = false);
+
+  /* Destructor, writes the rest of the buffer and closes the file. */
+  virtual ~cCapture(void);
+
+  bool Start(void);
+  void Cancel(int waitSec = 0);
+
+  /* Adds a record with Count bytes of Data. */
+  void Add(eCaptureDir Direction, const uint8_t* Data, int Count);
+
+  std::string File(void) { return file; }
+  uint64_t Bytes(void)   { return bytes; }
+  uint64_t Lost(void)    { return lost; }
+};
@@ -20,14 +20,33 @@
  * You should have received a copy of the GNU General Public License
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
+#include <algorithm>
+#include <vector>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <linux/dvb/ca.h>
 #include <vdr/device.h>
 #include <assert.h>
 #include "CiAdapter.h"
 #include "CamSlot.h"
+#include "CamSim.h"
+#include "CamPool.h"
+#include "Profiles.h"
 #include "Logging.h"
 
+extern bool CamGovernor;
+extern int AdmissionPct;
+extern bool CamBalance;
+extern int RecoverPct;
+extern bool CalibrateCams;
+
+static const int HELD_THREADS   = 3;    // sender, receiver and deliver thread
+static const int RESIZE_HOLD_MS = 500;  // max wait for them, see Resize()
+static const int CAL_WAIT_MS    = 100;  // for flush packets to come back, per push
+static const int CAL_HOLD_MAX   = 1024; // max packets pushed to find what the CAM holds back
+static const int CAL_BURST      = 4096; // packets to measure the throughput with
+static const int CAL_TIMEOUT_MS = 2000; // max time for the burst to come back
+static const int CAL_CHUNK_MS   = 10;   // the CAM's work for one write chunk
 
 /*******************************************************************************
  * !!! NOTE: Most of the code is copied from <vdr/dvbci.c>
@@ -39,22 +58,43 @@
 /*******************************************************************************
  * class cAdapter
  ******************************************************************************/
-cAdapter::cAdapter(caDevice& Ca) : cAdapter(Ca.fd, Ca.sec_fdw, Ca.sec_fdr, Ca.ca, Ca.sec) {}
+cAdapter::cAdapter(caDevice& Ca, const std::string& Profile) :
+  cAdapter(Ca.fd, Ca.sec_fdw, Ca.sec_fdr, Ca.ca, Ca.sec, Ca.Sim, Profile) {}
 
-cAdapter::cAdapter(int ca_fd, int sec_fdw, int sec_fdr, std::string& ca, std::string& sec) :
+cAdapter::cAdapter(int ca_fd, int sec_fdw, int sec_fdr, std::string& ca, std::string& sec,
+                   cCamSim* Sim, const std::string& Profile) :
   fd(ca_fd),
   devpath(ca),
+  config(Profile),
+  bufSize(config.BufSize),
+  bypass(bufSize),
   ciSend(*this, sec_fdw, devpath),
   ciRecv(*this, sec_fdr, devpath),
   started(false), reboots(0),
+  sim(Sim),
+  capture(nullptr),
+  tap{ nullptr, nullptr },
+  capturing(false),
+  flushPending(0),
+  wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  stopFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  stopping(false),
+  ciThread(0),
+  holding(false), held(0), sched(0), calibrated(false), calStep(csIdle), calPushed(0),
+  calHeldBack(0), calSent(0), calRoundTrip(0),
+  calibrating(false), flushReturned(0), flushFirst(0), flushLast(0),
+  runStart(cTimeMs::Now()), runPackets(0), runZaps(0), runZapNs(0),
   CamSlot(nullptr)
 {
   log(3, std::string(__FUNCTION__) + "    " + devpath);
-  ioctl(fd, CA_RESET);
+  if (sim)
+     sim->Start();
+  Ioctl(CA_RESET);
   StartTimer.Set(20000);
   SetDescription("cAdapter %s", devpath.c_str());
+  runConfig = config.Text();
   ca_caps_t Caps;
-  if (ioctl(fd, CA_GET_CAP, &Caps) == 0) {
+  if (Ioctl(CA_GET_CAP, &Caps) == 0) {
      if ((Caps.slot_type & CA_CI_LINK) != 0) {
         int NumSlots = Caps.slot_num;
         if (NumSlots > 0) {
@@ -92,30 +132,552 @@ cAdapter::cAdapter(int ca_fd, int sec_fdw, int sec_fdr, std::string& ca, std::st
 
   ciSend.Start();
   ciRecv.Start();
+  cCamPool::Add(this);
 }
 
 
 cAdapter::~cAdapter(void) {
   _entering;
 
+  cCamPool::Del(this);
   Cancel(3);
   CleanUp();
+  if (wakeFd != -1)
+     close(wakeFd);
+  if (stopFd != -1)
+     close(stopFd);
+  StopCapture();
+  StopTap();
+
+  if (sim) {
+     /* the TS threads have to be gone before the simulator closes
+      * its side of secY. */
+     ciSend.Cancel(3);
+     ciRecv.Cancel(3);
+     delete sim;
+     sim = nullptr;
+     }
 
   _leaving;
 }
 
 
+int cAdapter::Ioctl(unsigned long Request, void* Arg) {
+  if (sim)
+     return sim->Ioctl(Request, Arg);
+  return ioctl(fd, Request, Arg);
+}
+
+
 int cAdapter::DataRecv(uint8_t* Data, int Count) {
   if (!CamSlot)
      return Count; // no slot, eat all the data
 
+  if (RecoverPct)
+     watch.Received(Data, Count, CamSlot->MtdActive());
+
+  if (zap.Tracking()) {
+     zap.Received(Data, Count);
+     // with MTD, the CAM output goes to MtdPutData() now.
+     if (CamSlot->MtdActive() and zap.Delivered(Data, Count))
+        ZapDone();
+     }
+
   return CamSlot->DataRecv(Data, Count);
 }
 
 
+void cAdapter::CheckScrambled(void) {
+  if (!CamSlot)
+     return;
+
+  for(int i = 0; i < cScrambleWatch::SLOTS; i++) {
+     eScrambleAction action = watch.Check(i);
+     if (action == saNone)
+        continue;
+     trace.Add(teScrambled, (i << 24) | action);
+
+     cCamSlot* slot = CamSlot->MtdActive() ? CamSlot->SubSlot(i) : CamSlot;
+     std::string name = devpath + (CamSlot->MtdActive() ? " sub slot " + std::to_string(i) : "");
+
+     switch(action) {
+        case saResend:
+           log(2, name + ": CAM output still scrambled, sending the CA PMT again");
+           if (!slot or !slot->IsDecrypting() or !ResendCaPmt(slot))
+              log(2, name + ": no CA PMT to send again");
+           break;
+        case saReset:
+           log(2, name + ": CAM output still scrambled, resetting the CAM");
+           CamSlot->Reset();
+           break;
+        case saRecovered:
+           log(2, name + ": CAM output decrypted again");
+           break;
+        default:;
+        }
+     }
+}
+
+
+bool cAdapter::ResendCaPmt(cCamSlot* Slot) {
+  /* VDR's StartDecrypting() only sends the CA PMT of programs modified
+   * since the last one. Turning each active PID off and on again marks
+   * its program. The PIDs of VDR's MTD sub slots don't pass our SetPid(),
+   * these get a reset if it stays scrambled. */
+  if (Slot != CamSlot)
+     return false;
+  std::vector<int> pids = CamSlot->ActivePids();
+  if (pids.empty())
+     return false;
+  for(int pid:pids) {
+     CamSlot->SetPid(pid, false);
+     CamSlot->SetPid(pid, true);
+     }
+  // not through ours, that is for a zap.
+  CamSlot->cCamSlot::StartDecrypting();
+  return true;
+}
+
+
+void cAdapter::ZapDone(void) {
+  trace.Add(teDecrypted, zap.LastUs());
+  log(2, devpath + ": zap " + zap.Last());
+}
+
+
+void cAdapter::DataIdle(void) {
+  if (CamSlot && bypass.Pending())
+     CamSlot->DataRecv(nullptr, 0);
+}
+
+
+bool cAdapter::Parked(void) {
+  if (config.IgnoreActiveFlag)
+     return false;
+  return !CamSlot or !CamSlot->Active();
+}
+
+
+void cAdapter::Unpark(void) {
+  ciSend.Unpark();
+  ciRecv.Unpark();
+}
+
+
+bool cAdapter::Resize(void) {
+  int packets = config.BufSize;
+  if (!Parked() or held)
+     return false;
+
+  // StartDecrypting() waits for us.
+  cMutexLock MutexLock(CamSlot ? &CamSlot->Mutex() : nullptr);
+  if (CamSlot and CamSlot->Active())
+     return false;
+
+  holding = true;
+  Unpark();
+  cTimeMs timeout(RESIZE_HOLD_MS);
+  while((held < HELD_THREADS) and !timeout.TimedOut() and !Stopping())
+     cCondWait::SleepMs(1);
+
+  bool done = (held == HELD_THREADS) and ciSend.Resize(packets);
+  if (done) {
+     ciRecv.Resize(packets);
+     if (CamSlot)
+        CamSlot->ResizeBuffer(packets);
+     log(2, devpath + ": buffers resized from " + std::to_string(bufSize) +
+         " to " + std::to_string(packets) + " packets");
+     bufSize = packets;
+     }
+  holding = false;
+  Unpark();
+  return done;
+}
+
+
+void cAdapter::ApplyCamProfile(void) {
+  const char* name = CamSlot->GetCamName();
+  if (!name or !*name or (camName == name))
+     return;
+
+  bool had = !camName.empty() and cProfiles::HasCam(camName.c_str());
+  camName = name;
+  if (!had and !cProfiles::HasCam(name))
+     return;
+  log(2, devpath + ": profile of CAM '" + camName + "'");
+  Configure(cAdapterConfig().Text() + " " + cProfiles::Settings(devpath, name));
+}
+
+
+void cAdapter::FlushReturned(void) {
+  FlushStripped(1);
+  if (calibrating) {
+     uint64_t now = cTraceRing::Now();
+     uint64_t none = 0;
+     flushFirst.compare_exchange_strong(none, now);
+     flushLast = now;
+     ++flushReturned;
+     }
+}
+
+
+bool cAdapter::CalibrationInterrupted(void) {
+  calibrating = false;
+  calStep = csIdle;
+  log(3, devpath + ": calibration interrupted");
+  return false;
+}
+
+
+bool cAdapter::Calibrate(void) {
+  /* StartDecrypting() doesn't wait for us, it all takes seconds. VDR data
+   * goes before the flush packets, they would be off: given up then, and
+   * done again once nothing decrypts. */
+  auto busy = [this]() -> bool {
+     return CamSlot->Active() or CamSlot->Device() or CamSlot->MtdActive() or Stopping();
+     };
+
+  if (calStep == csIdle) {
+     CamSlot->Mutex().Lock();
+     bool idle = !busy() and !FlushPending();
+     if (idle) {
+        calibrating = true;
+        flushReturned = 0;
+        flushFirst = 0;
+        }
+     CamSlot->Mutex().Unlock();
+     if (!idle)
+        return false;
+     calPushed = 0;
+     calHeldBack = 0;
+     calStep = csHold;
+     }
+
+  switch(calStep) {
+     case csHold:
+        /* 1. the round trip: one packet, which may stay in the CAM until
+         * more come. Then double the packets in the CAM, until the first
+         * comes out. */
+        if (busy())
+           return CalibrationInterrupted();
+        if (flushFirst) {
+           calRoundTrip = flushFirst - calSent;
+
+           /* 2. the throughput: a burst the CAM has to work through. All
+            * but the ones it holds back come out, unless it stalls. */
+           flushReturned = 0;
+           flushFirst = 0;
+           flushLast = cTraceRing::Now();
+           ciSend.Flush(CAL_BURST);
+           calTimer.Set(CAL_TIMEOUT_MS);
+           calStep = csBurst;
+           return false;
+           }
+        if (calPushed and !calTimer.TimedOut())
+           return false;
+        if (calPushed >= CAL_HOLD_MAX) {
+           calibrating = false;
+           calStep = csIdle;
+           log(1, devpath + ": calibration failed, no flush packets came back from the CAM");
+           return true;
+           }
+        calHeldBack = calPushed;
+        calPushed += std::max(calPushed, 1);
+        calSent = cTraceRing::Now();
+        ciSend.Flush(calPushed - calHeldBack);
+        calTimer.Set(CAL_WAIT_MS);
+        return false;
+
+     case csBurst:
+        if (busy())
+           return CalibrationInterrupted();
+        if ((flushReturned + calHeldBack < CAL_BURST) and !calTimer.TimedOut() and
+            !(flushReturned and (cTraceRing::Now() - flushLast > uint64_t(CAL_WAIT_MS) * 1000000)))
+           return false;
+        break;
+
+     default:;
+     }
+
+  calibrating = false;
+  calStep = csIdle;
+  int heldBack = calHeldBack;
+  int returned = flushReturned;
+  uint64_t span = flushLast - flushFirst;
+  if ((returned < 2) or !span) {
+     log(1, devpath + ": calibration failed, " + std::to_string(returned) +
+         " of " + std::to_string(CAL_BURST) + " flush packets came back from the CAM");
+     return true;
+     }
+
+  /* bufsz: room for twice what the CAM holds back and works on during a
+   * round trip; the TS threads wake up on data, see cWakeup. chunk:
+   * CAL_CHUNK_MS of the CAM's work, so a Clear() doesn't wait long for a
+   * write. */
+  uint64_t rate = uint64_t(returned - 1) * 1000000000 / span;   // packets/s
+  int rtt = calRoundTrip / 1000000;
+  int bufsz = 2 * (heldBack + rate * rtt / 1000);
+  bufsz = std::min(std::max(bufsz, 1500), 10000);
+  int chunk = std::min(std::max(int(rate * CAL_CHUNK_MS / 1000), 16), bufsz / 4);
+  governor.Calibrated(rate * TS_SIZE);
+
+  // profiles win.
+  std::string settings;
+  std::string profile = cProfiles::Settings(devpath, camName.c_str());
+  for(auto s:{ "bufsz=" + std::to_string(bufsz), "chunk=" + std::to_string(chunk) })
+     if (profile.find(s.substr(0, s.find('=') + 1)) == std::string::npos)
+        settings += " " + s;
+
+  std::string s = std::to_string(rate * TS_SIZE * 8 / 1000) + " kbit/s, round trip " +
+                  std::to_string(rtt) + " ms, " + std::to_string(heldBack) +
+                  " packets held back by the CAM";
+  log(2, devpath + ": calibrated " + s + " ->" +
+      (settings.empty() ? " nothing, all set by profiles" : settings));
+  runMutex.Lock();
+  calibration = s;
+  runMutex.Unlock();
+  Configure(settings);
+  return true;
+}
+
+
+std::string cAdapter::Run(void) {
+  uint64_t ms = cTimeMs::Now() - runStart;
+  uint64_t packets = ciRecv.Delivered() - runPackets;
+  int zaps;
+  uint64_t zapNs;
+  zap.Totals(zaps, zapNs);
+  zaps -= runZaps;
+  zapNs -= runZapNs;
+
+  std::string s = runConfig + ": " + std::to_string(ms / 1000) + " s, " +
+                  std::to_string(ms ? packets * TS_SIZE * 8 / ms : 0) + " kbit/s from the CAM";
+  if (zaps)
+     s += ", zap time avg " + std::to_string(zapNs / zaps / 1000000) + " ms of " +
+          std::to_string(zaps) + " zaps";
+  return s;
+}
+
+
+std::string cAdapter::Configure(std::string Settings) {
+  cMutexLock MutexLock(&runMutex);
+
+  /* all or nothing: check them on a copy first. */
+  std::string error = cAdapterConfig::Check(Settings);
+  if (!error.empty())
+     return error;
+
+  for(auto s:cAdapterConfig::Split(Settings))
+     config.Set(s);
+  if (config.Text() == runConfig)
+     return "";
+
+  lastRun = Run();
+  log(2, devpath + ": config " + config.Text() + ", was " + lastRun);
+  runConfig = config.Text();
+  runStart = cTimeMs::Now();
+  runPackets = ciRecv.Delivered();
+  zap.Totals(runZaps, runZapNs);
+  // a parked thread picks up a new sleep timer, too.
+  Unpark();
+  return "";
+}
+
+
+std::string cAdapter::ConfigStats(void) {
+  cMutexLock MutexLock(&runMutex);
+
+  std::string s = config.Text();
+  if (config.BufSize != bufSize)
+     s += " (buffers still " + std::to_string(bufSize) + " packets, resized once no slot decrypts)";
+  s += "\n  now:    " + Run();
+  if (!lastRun.empty())
+     s += "\n  before: " + lastRun;
+  if (!calibration.empty())
+     s += "\n  calibrated: " + calibration;
+  return s;
+}
+
+
+void cAdapter::UpdatePriorities(void) {
+  if (!CamSlot)
+     return;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s)) {
+     // a slot without device has no priority of its own.
+     if ((s->MasterSlot() == CamSlot) and s->Device())
+        governor.SetPriority(cCiCamSlot::SubSlotNumber(s), s->Priority());
+     }
+}
+
+
+bool cAdapter::Admissible(bool Probe) {
+  if (AdmissionPct and Probe and !governor.Fits(AdmissionPct))
+     return false;
+  if (AdmissionPct and !Probe and !governor.Admissible(AdmissionPct)) {
+     uint64_t load = governor.Load() * 8 / 1000;
+     trace.Add(teAdmRefuse, load);
+     log(3, devpath + ": CAM load " + std::to_string(load) + " kbit/s of " +
+         std::to_string(governor.Capacity() * 8 / 1000) + " kbit/s, no more services");
+     return false;
+     }
+
+  std::string better;
+  if (CamBalance and !cCamPool::Preferred(this, better)) {
+     if (Probe)
+        return false;
+     trace.Add(tePoolRefuse, Services());
+     log(3, devpath + ": " + better + " is less loaded, no more services");
+     return false;
+     }
+  return true;
+}
+
+
+std::string cAdapter::CaSystemIds(void) {
+  std::vector<int> ids;
+  if (CamSlot) {
+     const int* p = CamSlot->CaSystemIds();
+     for(; p && *p; p++)
+        ids.push_back(*p);
+     }
+  std::sort(ids.begin(), ids.end());
+
+  std::string s;
+  char buf[8];
+  for(auto id:ids) {
+     snprintf(buf, sizeof(buf), "%04X ", id);
+     s += buf;
+     }
+  if (!s.empty())
+     s.pop_back();
+  return s;
+}
+
+
+int cAdapter::Services(void) {
+  if (!CamSlot)
+     return 0;
+  int n = 0;
+  bool mtd = CamSlot->MtdActive();
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s)) {
+     if ((s->MasterSlot() == CamSlot) and s->Device() and (!mtd or !s->IsMasterSlot()))
+        ++n;
+     }
+  return n;
+}
+
+
+bool cAdapter::Decrypts(cDevice* Device) {
+  if (!CamSlot)
+     return false;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s)) {
+     if ((s->MasterSlot() == CamSlot) and (s->Device() == Device) and s->IsDecrypting())
+        return true;
+     }
+  return false;
+}
+
+
+bool cAdapter::Available(void) {
+  // VDR knows the CA system ids once the CAM is initialized.
+  if (!CamSlot or CaSystemIds().empty())
+     return false;
+  if (AdmissionPct and !governor.Fits(AdmissionPct))
+     return false;
+  // without MTD, a CAM decrypts for one device only.
+  return CamSlot->MtdAvailable() or !CamSlot->Device();
+}
+
+
 void cAdapter::ClrBuffers(void) {
   ciSend.Clear();
-  ciRecv.Clear();
+  dedup.Clear();
+  flushPending = 0;
+  // the deliver thread has to finish the clear, even if parked.
+  Unpark();
+}
+
+
+void cAdapter::Cleared(uint32_t Epoch) {
+  bypass.Sync(ciSend.ClearMark());
+  if (CamSlot)
+     CamSlot->Cleared(Epoch);
+}
+
+
+std::string cAdapter::StartCapture(void) {
+  cMutexLock MutexLock(&captureMutex);
+
+  if (capture)
+     return capture->File();
+
+  cCapture* c = new cCapture(TraceDir, devpath);
+  if (!c->Start()) {
+     delete c;
+     return "";
+     }
+  log(2, "capturing " + devpath + " to " + c->File());
+  capture = c;
+  capturing = true;
+  return c->File();
+}
+
+
+std::string cAdapter::StopCapture(void) {
+  cCapture* c;
+  {
+  cMutexLock MutexLock(&captureMutex);
+  c = capture;
+  capture = nullptr;
+  capturing = tap[cdToCam];
+  }
+  if (!c)
+     return "";
+
+  // outside the lock: the rest of the buffer is written now.
+  std::string file = c->File();
+  delete c;
+  return file;
+}
+
+
+std::string cAdapter::StartTap(void) {
+  cMutexLock MutexLock(&captureMutex);
+
+  if (!tap[cdToCam]) {
+     cCapture* pre  = new cCapture(TraceDir, devpath, "-pre.ts",  true);
+     cCapture* post = new cCapture(TraceDir, devpath, "-post.ts", true);
+     if (!pre->Start() or !post->Start()) {
+        delete pre;
+        delete post;
+        return "";
+        }
+     log(2, "tapping " + devpath + " to " + pre->File() + ", " + post->File());
+     tap[cdToCam]   = pre;
+     tap[cdFromCam] = post;
+     capturing = true;
+     }
+  return tap[cdToCam]->File() + " " + tap[cdFromCam]->File();
+}
+
+
+std::string cAdapter::StopTap(void) {
+  cCapture* t[2];
+  {
+  cMutexLock MutexLock(&captureMutex);
+  t[0] = tap[0];
+  t[1] = tap[1];
+  tap[0] = tap[1] = nullptr;
+  capturing = capture;
+  }
+  if (!t[0])
+     return "";
+
+  // outside the lock: the rest of the buffers is written now.
+  std::string files = t[0]->File() + " " + t[1]->File();
+  delete t[0];
+  delete t[1];
+  return files;
 }
 
 
@@ -124,6 +686,32 @@ void cAdapter::Cancel(int waitSec) {
 }
 
 
+void cAdapter::Shutdown(bool Force) {
+  if (Force) {
+     cThread::Cancel(0);
+     ciSend.Cancel(0);
+     ciRecv.Cancel(0);
+     return;
+     }
+
+  /* first Running() turns false, then the pollers wake up: a thread woken
+   * by stopFd always sees that it has to end. The TS threads are woken by
+   * their Cancel(). */
+  stopping = true;
+  cThread::Cancel(-1);
+  ciSend.Cancel(-1);
+  ciRecv.Cancel(-1);
+  uint64_t one = 1;
+  if ((stopFd != -1) and (write(stopFd, &one, sizeof(one)) < 0))
+     log(1, "can't wake the threads of " + devpath + ": " + strerror(errno));
+}
+
+
+bool cAdapter::Stopped(void) {
+  return !Active() and !ciSend.Active() and ciRecv.Stopped();
+}
+
+
 void cAdapter::Action(void) {
   if (started) {
      log(1, std::string(__PRETTY_FUNCTION__) + "      " + devpath + " started twice!!");
@@ -132,77 +720,171 @@ void cAdapter::Action(void) {
   started = true;
 
   log(3, std::string(__PRETTY_FUNCTION__) + "      " + devpath);
+  ciThread = cThread::ThreadId();
   cCiAdapter::Action();
 
-  /* thread stopped */
-  ciSend.Cancel(3);
-  ciRecv.Cancel(3);
+  /* thread stopped. On Shutdown(), the plugin waits for all of them. */
+  if (!Stopping()) {
+     ciSend.Cancel(3);
+     ciRecv.Cancel(3);
+     }
 
   _leaving;
 }
 
 
 int cAdapter::Read(uint8_t* Buffer, int MaxLength) {
+  /* cCiAdapter::Action() calls us in a loop, so this is the place to write
+   * error trace dumps outside of the TS data path threads. */
+  trace.DumpPending(TraceDir, devpath);
+  if (cGovernor::Measuring() and PriorityTimer.TimedOut()) {
+     PriorityTimer.Set(1000);
+     UpdatePriorities();
+     }
+
+  if (zap.TimedOut())
+     log(2, devpath + ": zap " + zap.Last());
+  if (RecoverPct and WatchTimer.TimedOut()) {
+     WatchTimer.Set(1000);
+     CheckScrambled();
+     }
+  config.ApplySched(sched);
+  if (CamSlot and ProfileTimer.TimedOut()) {
+     ProfileTimer.Set(1000);
+     ApplyCamProfile();
+     if (CalibrateCams and !calibrated and !camName.empty() and (calStep == csIdle))
+        calibrated = Calibrate();
+     }
+  else if (calStep != csIdle)
+     calibrated = Calibrate();   // the next step
+  if ((config.BufSize != bufSize) and (calStep == csIdle) and ResizeTimer.TimedOut()) {
+     ResizeTimer.Set(1000);
+     Resize();
+     }
+
+  /* Waits for the CAM or for TPDUs queued by other threads: these are
+   * written at once, and the answer is read without another round of
+   * cCiAdapter::Action(). */
   if (Buffer && MaxLength > 0) {
-     struct pollfd pfd[1];
-
-     pfd[0].fd = fd;
-     pfd[0].events = POLLIN;
-     if (poll(pfd, 1, CAM_READ_TIMEOUT) > 0 && (pfd[0].revents & POLLIN)) {
-        int n = safe_read(fd, Buffer, MaxLength);
-        if (n >= 0)
-           return n;
-        log(1, "can't read from CI adapter (" + devpath + ") : " + strerror(errno));
+     cTimeMs timeout(CAM_READ_TIMEOUT);
+     int left;
+     while((left = CAM_READ_TIMEOUT - timeout.Elapsed()) > 0) {
+        WriteQueued();
+
+        struct pollfd pfd[3];            // poll() ignores fds of -1
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = wakeFd;
+        pfd[1].events = POLLIN;
+        pfd[2].fd = stopFd;
+        pfd[2].events = POLLIN;
+        if (poll(pfd, 3, left) <= 0)
+           break;
+        if (pfd[2].revents & POLLIN)
+           break;                         // Shutdown(), Running() is false
+        if ((wakeFd != -1) and (pfd[1].revents & POLLIN)) {
+           uint64_t n;
+           if (read(wakeFd, &n, sizeof(n)) < 0) {} // only reset it
+           }
+        if (pfd[0].revents & POLLIN) {
+           int n = safe_read(fd, Buffer, MaxLength);
+           if (n >= 0)
+              return n;
+           log(1, "can't read from CI adapter (" + devpath + ") : " + strerror(errno));
+           break;
+           }
         }
      }
   return 0;
 }
 
+
 void cAdapter::Write(const uint8_t* Buffer, int Length) {
-  if (Buffer && Length > 0) {
-     if (safe_write(fd, Buffer, Length) != Length) {
-        log(1, "can't write to " + devpath + ", Length = " + std::to_string(Length) + ": " + strerror(errno));
-        if (errno == EAGAIN)
-           log(1, "hmm - was EAGAIN not catched by safe_write?");
-        else if (!StartTimer.TimedOut() && ((errno == EIO) or (errno == EINVAL))) {
-           assert((errno == 0));
-
-         //assert(reboots++ < 3);
-         //if (errno == EINVAL)
-         //   log(1, "looks like Length > ca->slot_info[slot].link_buf_size");
-         //else
-         //   log(1, "fatal I/O error on the CAM slot. Resetting it.");
-         //CamSlot->CancelActivation();
-         //ioctl(fd, CA_RESET);
-         //status = msNone;
-         //StatusTimer.Set(2000);
-         //CamSlot->Assign(0);
-         //for(int i = 0; i < cDevice::NumDevices(); i++)
-         //   CamSlot->Assign(cDevice::GetDevice(i));
-         //CamSlot->StartMtd();
-         //
-         //// try to recover CAM by channel switch now..
-         //const cChannel* Channel = nullptr;
-         //if (*Setup.InitialChannel) {
-         //   LOCK_CHANNELS_READ;
-         //   Channel = Channels->GetByChannelID(tChannelID::FromString(Setup.InitialChannel));
-         //   }
-         //if (Channel && cDevice::GetDeviceForTransponder(Channel,1)) {
-         //   bool result = (!cDevice::GetDeviceForTransponder(Channel,1)->SwitchChannel(Channel, true));
-         //   if (result)
-         //      log(2, "switching to channel " + std::string(Channel->Name()));
-         //   else
-         //      log(2, "switching to channel " + std::string(Channel->Name()) + " failed.");
-         //   }
-           }
+  if (!Buffer or (Length <= 0))
+     return;
+
+  if ((cThread::ThreadId() == ciThread) or (wakeFd == -1)) {
+     WriteQueued();
+     WriteNow(Buffer, Length);
+     return;
+     }
+
+  /* Other threads, f.i. a device thread sending the CA PMT on
+   * StartDecrypting(), don't wait for the CAM here: Read() writes it in
+   * order with the TPDUs of the CI thread. */
+  {
+  cMutexLock MutexLock(&writeMutex);
+  writeQueue.emplace_back(Buffer, Buffer + Length);
+  }
+  uint64_t one = 1;
+  if (write(wakeFd, &one, sizeof(one)) < 0)
+     log(1, "can't wake CI thread of " + devpath + ": " + strerror(errno));
+}
+
+
+void cAdapter::WriteQueued(void) {
+  for(;;) {
+     std::vector<uint8_t> tpdu;
+     {
+     cMutexLock MutexLock(&writeMutex);
+     if (writeQueue.empty())
+        return;
+     tpdu.swap(writeQueue.front());
+     writeQueue.pop_front();
+     }
+     WriteNow(tpdu.data(), tpdu.size());
+     }
+}
+
+
+void cAdapter::WriteNow(const uint8_t* Buffer, int Length) {
+  int program = zap.CaPmt(Buffer, Length);
+  if (program >= 0)
+     trace.Add(teCaPmt, program);
+
+  if (safe_write(fd, Buffer, Length) != Length) {
+     log(1, "can't write to " + devpath + ", Length = " + std::to_string(Length) + ": " + strerror(errno));
+     if (errno == EAGAIN)
+        log(1, "hmm - was EAGAIN not catched by safe_write?");
+     else if (!StartTimer.TimedOut() && ((errno == EIO) or (errno == EINVAL))) {
+        assert((errno == 0));
+
+      //assert(reboots++ < 3);
+      //if (errno == EINVAL)
+      //   log(1, "looks like Length > ca->slot_info[slot].link_buf_size");
+      //else
+      //   log(1, "fatal I/O error on the CAM slot. Resetting it.");
+      //CamSlot->CancelActivation();
+      //ioctl(fd, CA_RESET);
+      //status = msNone;
+      //StatusTimer.Set(2000);
+      //CamSlot->Assign(0);
+      //for(int i = 0; i < cDevice::NumDevices(); i++)
+      //   CamSlot->Assign(cDevice::GetDevice(i));
+      //CamSlot->StartMtd();
+      //
+      //// try to recover CAM by channel switch now..
+      //const cChannel* Channel = nullptr;
+      //if (*Setup.InitialChannel) {
+      //   LOCK_CHANNELS_READ;
+      //   Channel = Channels->GetByChannelID(tChannelID::FromString(Setup.InitialChannel));
+      //   }
+      //if (Channel && cDevice::GetDeviceForTransponder(Channel,1)) {
+      //   bool result = (!cDevice::GetDeviceForTransponder(Channel,1)->SwitchChannel(Channel, true));
+      //   if (result)
+      //      log(2, "switching to channel " + std::string(Channel->Name()));
+      //   else
+      //      log(2, "switching to channel " + std::string(Channel->Name()) + " failed.");
+      //   }
         }
      }
 }
 
 
 bool cAdapter::Reset(int Slot) {
+  trace.Add(teAdpReset, Slot);
   ClrBuffers();
-  if (ioctl(fd, CA_RESET) == 0) {
+  if (Ioctl(CA_RESET) == 0) {
   //if (ioctl(fd, CA_RESET, 1 << Slot) == 0)  {
      log(3, std::string(__FUNCTION__) + "       " + devpath + " - " + std::to_string(Slot));
      return true;
@@ -230,7 +912,7 @@ eModuleStatus cAdapter::GetModuleStatus(int Slot) {
 
   ca_slot_info_t sinfo;
   sinfo.num = Slot;
-  if (ioctl(fd, CA_GET_SLOT_INFO, &sinfo) != -1) {
+  if (Ioctl(CA_GET_SLOT_INFO, &sinfo) != -1) {
      if ((sinfo.flags & CA_CI_MODULE_READY) != 0)
         return msReady;
      if ((sinfo.flags & CA_CI_MODULE_PRESENT) != 0)
@@ -246,6 +928,11 @@ eModuleStatus cAdapter::GetModuleStatus(int Slot) {
 bool cAdapter::Assign(cDevice* Device, bool Query) {
   _entering;
 
+  /* VDR tries the next CAM or device, if this one is loaded already. The
+   * assignment itself follows a query, it's never refused. A device we
+   * decrypt for already zaps, that's no new service. */
+  if (Device and Query and !Decrypts(Device) and !Admissible())
+     return false;
   return true;
 
   _leaving;
@@ -21,10 +21,20 @@
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
 #pragma once
+#include <deque>
 #include <string>
+#include <vector>
 #include <vdr/ci.h>
 #include "TsSender.h"
 #include "TsReceiver.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Bypass.h"
+#include "Dedup.h"
+#include "Governor.h"
+#include "ZapTimer.h"
+#include "ScrambleWatch.h"
+#include "AdapterConfig.h"
 
 
 
@@ -32,6 +42,8 @@
  * forward declarations.
  ******************************************************************************/
 class cCiCamSlot;
+class cCamSim;
+extern std::string TraceDir;
 
 
 
@@ -46,8 +58,9 @@ public:
   int fd;           /* rw    file handle adapterX/caY  */
   int sec_fdw;      /* write file handle adapterX/secY */
   int sec_fdr;      /* read  file handle adapterX/secY */
+  cCamSim* Sim;     /* the CAM simulator, if any       */
 public:
-  caDevice(void) : Number(-1), fd(-1), sec_fdw(-1), sec_fdr(-1) {}
+  caDevice(void) : Number(-1), fd(-1), sec_fdw(-1), sec_fdr(-1), Sim(nullptr) {}
 };
 
 
@@ -59,6 +72,14 @@ class cAdapter: public cCiAdapter {
 private:
   int fd;               //< adapterX/caY device file handle
   std::string devpath;  //< adapterX/caY device path
+  cAdapterConfig config; //< the settings of this adapter, SVDRP CONF
+  int bufSize;          //< packets, the size of the buffers now
+  cTraceRing  trace;    //< the hot path trace ring of this adapter
+  cBypass     bypass;   //< unscrambled packets, not sent to the CAM
+  cDedup      dedup;    //< packets of MTD sub slots, decrypted once
+  cGovernor   governor; //< CAM bandwidth per MTD sub slot
+  cZapTimer   zap;      //< zap time instrumentation
+  cScrambleWatch watch; //< scrambled CAM output, RecoverPct
   cTsSender   ciSend;   //< the CAM TS sender   adapterX/secY
   cTsReceiver ciRecv;   //< the CAM TS receiver adapterX/secY
   volatile bool started;
@@ -66,6 +87,46 @@ private:
   eModuleStatus status;
   int reboots;
   cTimeMs StartTimer;
+  cTimeMs PriorityTimer;
+  cTimeMs WatchTimer;
+  cCamSim* sim;         //< CAM simulator instead of adapterX/caY, owned by us
+  cMutex captureMutex;  //< protects capture and tap against Start/Stop
+  cCapture* capture;    //< secY capture, if running
+  cCapture* tap[2];     //< .ts files of the CAM input/output, if running
+  std::atomic<bool> capturing; //< capture or tap running
+  std::atomic<int> flushPending; //< idle flush packets not yet stripped
+  int wakeFd;           //< eventfd, wakes Read() for queued TPDUs
+  int stopFd;           //< eventfd, set once by Shutdown(), wakes Read() for good
+  std::atomic<bool> stopping; //< Shutdown() was called, the plugin joins our threads
+  cMutex writeMutex;    //< protects writeQueue
+  std::deque<std::vector<uint8_t>> writeQueue; //< TPDUs of other threads
+  pid_t ciThread;       //< the thread of Action()
+  std::atomic<bool> holding; //< Resize() holds the TS threads
+  std::atomic<int> held;     //< TS threads holding
+  cTimeMs ResizeTimer;
+  cTimeMs ProfileTimer;
+  std::string camName;  //< the CAM of the last ApplyCamProfile()
+  unsigned sched;       //< config.ApplySched() of the CI thread
+  enum eCalStep { csIdle, csHold, csBurst };
+  bool calibrated;      //< Calibrate() is done
+  std::string calibration; //< its results
+  eCalStep calStep;     //< where Calibrate() is
+  cTimeMs calTimer;     //< the wait of the current step
+  int calPushed;        //< flush packets pushed to find what the CAM holds back
+  int calHeldBack;      //< of them, held back by the CAM
+  uint64_t calSent;     //< ns, the last of these pushes
+  uint64_t calRoundTrip;//< ns, found by csHold
+  std::atomic<bool> calibrating;       //< FlushReturned() counts and stamps
+  std::atomic<int> flushReturned;      //< flush packets back since Calibrate() reset it
+  std::atomic<uint64_t> flushFirst;    //< ns, the first of them, 0 = none yet
+  std::atomic<uint64_t> flushLast;     //< ns, the last of them
+  cMutex runMutex;      //< protects the following
+  std::string runConfig; //< config.Text() of the current run
+  uint64_t runStart;    //< cTimeMs::Now() at the start of the current run
+  uint64_t runPackets;  //< ciRecv.Delivered() at the start of the current run
+  int runZaps;          //< zaps at the start of the current run
+  uint64_t runZapNs;    //< their time at the start of the current run
+  std::string lastRun;  //< the report of the run before
 
   // FIXME: after VDR base class change, this is not necessary
   cCiCamSlot* CamSlot;  //< the one and only slot of a DD CI adapter
@@ -73,6 +134,49 @@ private:
   void CleanUp(void) { if (fd != -1) { close(fd); fd = -1; } }
   eModuleStatus GetModuleStatus(int Slot);
 
+  /* hands the VDR priorities of our CAM slot and its MTD sub slots to the
+   * governor. */
+  void UpdatePriorities(void);
+
+  /* resends the CA PMT or resets the CAM, if the CAM output of a service
+   * stays scrambled. See cScrambleWatch. */
+  void CheckScrambled(void);
+
+  /* sends the CA PMT of Slot's programs again. false, if there was none. */
+  bool ResendCaPmt(cCamSlot* Slot);
+
+  /* all CA ioctls go through here, to be answered by the simulator if any */
+  int Ioctl(unsigned long Request, void* Arg = nullptr);
+
+  /* writes a TPDU to caY, the CI thread only. */
+  void WriteNow(const uint8_t* Buffer, int Length);
+
+  /* writes the TPDUs queued by other threads, the CI thread only. */
+  void WriteQueued(void);
+
+  /* the CI thread, while config.BufSize isn't the size of the buffers:
+   * resizes them at a quiescent point, no slot decrypting and all TS
+   * threads held at the top of their loops. */
+  bool Resize(void);
+
+  /* the CI thread, once the CAM told its name: applies its profile, see
+   * cProfiles. */
+  void ApplyCamProfile(void);
+
+  /* the CI thread, with --calibrate, once the CAM told its name and while
+   * no slot decrypts: measures round trip, throughput and the packets the
+   * CAM holds back with flush packets, and derives bufsz and chunk. One
+   * step per Read(), it never waits. false, while it runs or if it has to
+   * be tried again later. */
+  bool Calibrate(void);
+
+  /* Calibrate() gives up, a slot started decrypting. */
+  bool CalibrationInterrupted(void);
+
+  /* what happened since the config was changed the last time, with
+   * runMutex locked. */
+  std::string Run(void);
+
 protected:
   /* see file ci.h in the VDR include directory for the description of
    * the following functions */
@@ -92,9 +196,13 @@ public:
    * @param sec_fdr - the read  file handle for the adapterX/secY device
    * @param ca      - device path for adapterX/caY
    * @param sec     - device path for adapterX/secY
+   * @param Sim     - a CAM simulator behind the file handles or nullptr.
+   *                  The adapter takes the ownership.
+   * @param Profile - the settings from adapters.conf, see cAdapterConfig.
    */
-  cAdapter(int ca_fd, int sec_fdw, int sec_fdr, std::string& ca, std::string& sec);
-  cAdapter(caDevice& Ca);
+  cAdapter(int ca_fd, int sec_fdw, int sec_fdr, std::string& ca, std::string& sec,
+           cCamSim* Sim = nullptr, const std::string& Profile = "");
+  cAdapter(caDevice& Ca, const std::string& Profile = "");
 
   /* Destructor */
   virtual ~cAdapter(void);
@@ -107,12 +215,135 @@ public:
    */
   int DataRecv(uint8_t* Data, int Count);
 
+  /* Called by the deliver thread when there is no CAM data, to deliver
+   * bypassed packets anyway. */
+  void DataIdle(void);
+
+  /* the settings of this adapter, see cAdapterConfig. */
+  cAdapterConfig& Config(void) { return config; }
+
+  /* the current size of the buffers in packets, config.BufSize once
+   * Resize() could apply it. */
+  int BufSize(void) { return bufSize; }
+
+  /* SVDRP CONF: applies Settings, blank separated name=value pairs, see
+   * cAdapterConfig::Set(). Returns an error message or an empty string. */
+  std::string Configure(std::string Settings);
+
+  /* SVDRP CONF: the settings, the CAM output rate and the zap times since
+   * they were changed the last time and before. */
+  std::string ConfigStats(void);
+
+  /* Resize() holds the TS threads at the top of their loops: while
+   * Holding(), they call Held(true), wait and call Held(false). */
+  bool Holding(void) { return holding.load(std::memory_order_acquire); }
+  void Held(bool On) { held.fetch_add(On ? 1 : -1); }
+
+  /* true, while no slot of this adapter decrypts: the TS threads park
+   * then, see cWakeup. Unpark() wakes them for something to do. */
+  bool Parked(void);
+  void Unpark(void);
+
+  /* idle flush accounting, see cTsSender::IdleFlush(). */
+  void FlushSent(int Packets) { flushPending += Packets; }
+  void FlushStripped(int Packets) { flushPending -= Packets; }
+  /* the deliver thread stripped one that came back from the CAM. */
+  void FlushReturned(void);
+  bool FlushPending(void) { return flushPending.load(std::memory_order_relaxed) > 0; }
+  int FlushPendingCount(void) { return flushPending.load(std::memory_order_relaxed); }
+
   /* get the caX device name */
   std::string DevPath(void) { return devpath; }
 
-  /* clear the CAM send and receive buffer */
+  /* clear the CAM send and receive buffer, see cTsSender::Clear() */
   void ClrBuffers(void);
 
+  /* the CAM TS sender, for the clear protocol of the receiver */
+  cTsSender& Sender(void) { return ciSend; }
+
+  /* Called by the deliver thread, once the CAM output of Clear() request
+   * Epoch is dropped: everything delivered from now on is new. */
+  void Cleared(uint32_t Epoch);
+
+  /* the CAM bypass of this adapter */
+  cBypass& Bypass(void) { return bypass; }
+
+  /* the decrypt once fan-out of this adapter */
+  cDedup& Dedup(void) { return dedup; }
+
+  /* the scrambled output watch of this adapter */
+  cScrambleWatch& Watch(void) { return watch; }
+
+  /* the zap time instrumentation of this adapter */
+  cZapTimer& Zap(void) { return zap; }
+
+  /* a zap is over, cZapTimer::Delivered() returned true: trace and log it. */
+  void ZapDone(void);
+
+  /* the CAM bandwidth governor of this adapter */
+  cGovernor& Governor(void) { return governor; }
+
+  /* admission control (AdmissionPct) and CAM pool (CamBalance): false,
+   * if the CAM can't or shouldn't take another service. Probe: VDR only
+   * polls, a refusal isn't counted or logged. */
+  bool Admissible(bool Probe = false);
+
+  /* true, if a slot of this CAM decrypts for Device. */
+  bool Decrypts(cDevice* Device);
+
+  /* for the CAM pool: the sorted CA system ids of the CAM, as text, empty
+   * if the CAM isn't initialized yet; the number of devices assigned to the CAM or its MTD
+   * sub slots; true, if it could take another service now. */
+  std::string CaSystemIds(void);
+  int Services(void);
+  bool Available(void);
+
+  /* the trace ring of this adapter */
+  cTraceRing& Trace(void) { return trace; }
+
+  /* write the trace ring to TraceDir, returns the file name */
+  std::string DumpTrace(void) { return trace.Dump(TraceDir, devpath, "on demand"); }
+
+  /* start/stop capturing both directions of secY to a file in TraceDir.
+   * Both return the file name, or an empty string if not possible.
+   */
+  std::string StartCapture(void);
+  std::string StopCapture(void);
+  bool Capturing(void) { cMutexLock MutexLock(&captureMutex); return capture; }
+
+  /* start/stop the tap: the scrambled stream sent to the CAM and the
+   * decrypted stream received from the CAM are written to two .ts files
+   * in TraceDir. Returns the file names, or an empty string.
+   */
+  std::string StartTap(void);
+  std::string StopTap(void);
+  bool Tapping(void) { cMutexLock MutexLock(&captureMutex); return tap[cdToCam]; }
+
+  /* true, if the TS threads have to call Capture(). */
+  bool CaptureOrTap(void) { return capturing.load(std::memory_order_relaxed); }
+
+  /* Called by the TS threads for each chunk written to / read from secY. */
+  void Capture(eCaptureDir Direction, const uint8_t* Data, int Count) {
+     if (capturing.load(std::memory_order_relaxed)) {
+        cMutexLock MutexLock(&captureMutex);
+        if (capture)
+           capture->Add(Direction, Data, Count);
+        if (tap[Direction])
+           tap[Direction]->Add(Direction, Data, Count);
+        }
+     }
+
   /* stop this thread */
   void Cancel(int waitSec = 0);
+
+  /* plugin shutdown, see cPluginDDCI3::Stop(): tells the CI thread and the
+   * TS threads of this adapter to end and returns at once. With Force, the
+   * ones still running are cancelled. */
+  void Shutdown(bool Force = false);
+
+  /* true, once all threads of this adapter ended. */
+  bool Stopped(void);
+
+  /* true after Shutdown(): the threads don't wait for each other then. */
+  bool Stopping(void) { return stopping.load(std::memory_order_relaxed); }
 };
@@ -20,6 +20,7 @@
  * You should have received a copy of the GNU General Public License
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
+#include <cstring>
 #include <vdr/remux.h>   // TS_SIZE, TS_SYNC_BYTE
 #include "Common.h"
 
@@ -38,6 +39,55 @@ uint8_t* CheckTsSync(uint8_t* data, int length, int& skipped) {
 }
 
 
+static const char FLUSH_SIGNATURE[] = "ddci3 idle flush";
+
+
+void MakeFlushPacket(uint8_t* data) {
+  memset(data, 0xFF, TS_SIZE);
+  data[0] = TS_SYNC_BYTE;
+  data[1] = 0x1F;
+  data[2] = 0xFF;
+  data[3] = TS_PAYLOAD_EXISTS;
+  memcpy(data + 4, FLUSH_SIGNATURE, sizeof(FLUSH_SIGNATURE));
+}
+
+
+bool IsFlushPacket(const uint8_t* data) {
+  return (data[1] & 0x1F) == 0x1F and data[2] == 0xFF and
+         memcmp(data + 4, FLUSH_SIGNATURE, sizeof(FLUSH_SIGNATURE)) == 0;
+}
+
+
+static const char CLEAR_SIGNATURE[] = "ddci3 clear";
+
+
+void MakeClearPacket(uint8_t* data, uint32_t Epoch) {
+  MakeFlushPacket(data);
+  memcpy(data + 4, CLEAR_SIGNATURE, sizeof(CLEAR_SIGNATURE));
+  memcpy(data + 4 + sizeof(CLEAR_SIGNATURE), &Epoch, sizeof(Epoch));
+}
+
+
+bool IsClearPacket(const uint8_t* data, uint32_t& Epoch) {
+  if ((data[1] & 0x1F) != 0x1F or data[2] != 0xFF or
+      memcmp(data + 4, CLEAR_SIGNATURE, sizeof(CLEAR_SIGNATURE)) != 0)
+     return false;
+  memcpy(&Epoch, data + 4 + sizeof(CLEAR_SIGNATURE), sizeof(Epoch));
+  return true;
+}
+
+
+bool IsStuffingPacket(const uint8_t* data) {
+  if ((data[1] & TS_PAYLOAD_START) or
+      ((data[3] & (TS_SCRAMBLING_CONTROL | TS_ADAPT_FIELD_EXISTS | TS_PAYLOAD_EXISTS)) != TS_PAYLOAD_EXISTS))
+     return false;
+  for(int i = 4; i < TS_SIZE; i++)
+     if (data[i] != 0xFF)
+        return false;
+  return true;
+}
+
+
 bool CheckAllSync(uint8_t* data, int length, uint8_t*&  posnsync) {
   posnsync = nullptr;
   length -= length % TS_SIZE;
@@ -22,6 +22,8 @@
  ******************************************************************************/
 #pragma once
 #include <vdr/tools.h>
+#include <vdr/remux.h>
+#include <vdr/mtd.h>
 
 /*******************************************************************************
  * Plugin global config vars
@@ -40,16 +42,22 @@ extern bool DebugBuffers; // global debug ringbuffers variable
 
 
 // cRingBufferLinear requires one margin and 1 byte for internal reasons
-inline int BufferSize(void) {
-  extern int BufSize; // global config variable
-
-  return 1 + (TS_SIZE * (1 + BufSize));
+inline int BufferSize(int Packets) {
+  return 1 + (TS_SIZE * (1 + Packets));
 }
 
 
 // timeout for package buffer printing
 static const int DBG_PKG_TMO = 10000;
 
+// MTD sub slot numbers, 0 is the master slot without MTD
+static const int SUB_SLOTS = MAXPID >> UNIQ_PID_SHIFT;
+
+// the MTD sub slot of a unique PID, its upper bits (see <vdr/mtd.h>)
+inline int SubSlotOf(int Pid) {
+  return Pid >> UNIQ_PID_SHIFT;
+}
+
 
 
 
@@ -78,3 +86,26 @@ extern uint8_t* CheckTsSync(uint8_t* data, int length, int& skipped);
  * @return true, if the whole buffer contains the expected TS_SYNC_BYTEs
  */
 extern bool CheckAllSync(uint8_t* data, int length, uint8_t*& posnsync);
+
+/* Idle flush packets: null packets with a signature in the payload, written
+ * to the CAM by cTsSender to push out the packets inside the CAM, and
+ * stripped again by cTsReceiver.
+ * @param data the packet to fill / check, TS_SIZE bytes
+ */
+extern void MakeFlushPacket(uint8_t* data);
+extern bool IsFlushPacket(const uint8_t* data);
+
+/* Clear markers: null packets with a signature and the epoch of a
+ * cTsSender::Clear(), written to the CAM after the last stale packet.
+ * cTsReceiver drops the CAM output up to the marker of its epoch.
+ * @param data the packet to fill / check, TS_SIZE bytes
+ */
+extern void MakeClearPacket(uint8_t* data, uint32_t Epoch);
+extern bool IsClearPacket(const uint8_t* data, uint32_t& Epoch);
+
+/* Checks for the data of a null packet: not scrambled, payload only, no
+ * unit start, all 0xFF. MTD sub slots map PID 0x1FFF to a unique PID like any other, so
+ * that's the way to tell their null packets.
+ * @param data the packet to check, TS_SIZE bytes
+ */
+extern bool IsStuffingPacket(const uint8_t* data);
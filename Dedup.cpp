@@ -0,0 +1,204 @@
+/*******************************************************************************
+ * @file Dedup.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstring>
+#include "Dedup.h"
+#include "Common.h"
+
+static const size_t DEDUP_RING   = 1 << 15; // packets on the way, power of 2
+static const size_t DEDUP_INDEX  = 1 << 16; // hash index slots, power of 2
+static const int    DEDUP_PROBES = 16;      // hash index slots probed
+static const int    DEDUP_RESYNC = 256;     // entries searched for a lost packet
+
+extern bool CamDedup;
+
+
+/*******************************************************************************
+ * class cDedup
+ ******************************************************************************/
+/* the tables take about 2MB, only with --dedup; without it, nothing but
+ * Clear() is called. */
+cDedup::cDedup(void) :
+  ring(CamDedup ? DEDUP_RING : 0), index(CamDedup ? DEDUP_INDEX : 0, tIndex{0, 0}),
+  order(CamDedup ? MAXPID : 0, 0), sent(0), received(0), clear(false),
+  head(0), headCopies(0), claimed(false), shared(0), copies(0), lost(0), resyncs(0)
+{}
+
+
+uint64_t cDedup::Hash(const uint8_t* Packet) {
+  uint64_t h = 0;
+  for(int i = 4; i < TS_SIZE; i += 8) {
+     uint64_t w;
+     memcpy(&w, Packet + i, sizeof(w));
+     h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+     }
+  h ^= h >> 29;
+  return h ? h : 1;
+}
+
+
+bool cDedup::OnTheWay(uint64_t Sequence, uint64_t Sent) {
+  return (Sequence < Sent) and (Sequence + ring.size() > Sent) and
+         (Sequence >= received.load(std::memory_order_acquire));
+}
+
+
+bool cDedup::Shared(const uint8_t* Packet, int SubSlot) {
+  /* without payload, the data of different PIDs may be the same; their
+   * CAM output may not. */
+  if (!SubSlot or !TsIsScrambled(Packet) or !TsHasPayload(Packet))
+     return false;
+
+  uint64_t h = Hash(Packet);
+  uint64_t end = sent.load(std::memory_order_relaxed);
+  uint64_t& last = order[TsPid(Packet)];
+  tEntry* found = nullptr;
+  uint64_t sequence = 0;
+  for(int i = 0; (i < DEDUP_PROBES) and !found; i++) {
+     tIndex& x = index[(h + i) & (index.size() - 1)];
+     // an entry before the last packet of this PID comes back before it.
+     if ((x.hash == h) and (x.sequence > last) and OnTheWay(x.sequence - 1, end)) {
+        tEntry& e = Entry(x.sequence - 1);
+        if ((e.hash == h) and (e.subSlot != SubSlot)) {
+           found = &e;
+           sequence = x.sequence;
+           }
+        }
+     }
+  if (!found)
+     return false;
+
+  tEntry& e = *found;
+  uint8_t state = e.state.load(std::memory_order_acquire);
+  int n = state & ~CLAIMED;
+  if ((state & CLAIMED) or (n >= DEDUP_FANOUT))
+     return false;
+  for(int i = 0; i < n; i++)
+     if (SubSlotOf(TsPid(e.header[i])) == SubSlot)
+        return false;   // repeated in this sub slot
+
+  memcpy(e.header[n], Packet, 4);
+  if (!e.state.compare_exchange_strong(state, state + 1, std::memory_order_acq_rel))
+     return false;   // the receive side was faster
+  last = sequence;
+  shared.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+
+void cDedup::Sent(const uint8_t* Data, int Count, int SubSlot) {
+  uint64_t s = sent.load(std::memory_order_relaxed);
+
+  for(int i = 0; i < Count; i += TS_SIZE, s++) {
+     const uint8_t* p = Data + i;
+     tEntry& e = Entry(s);
+     e.pid = TsPid(p);
+     e.cc = p[3] & ~TS_SCRAMBLING_CONTROL;
+     e.subSlot = SubSlot;
+     e.state.store(0, std::memory_order_relaxed);
+     e.hash = 0;
+     if (SubSlot)
+        order[e.pid] = s + 1;
+     if (SubSlot and TsIsScrambled(p) and TsHasPayload(p)) {
+        e.hash = Hash(p);
+        // a free one, or the oldest if all probed are on the way.
+        tIndex* slot = nullptr;
+        for(int j = 0; j < DEDUP_PROBES; j++) {
+           tIndex& x = index[(e.hash + j) & (index.size() - 1)];
+           if (!x.sequence or !OnTheWay(x.sequence - 1, s)) {
+              slot = &x;
+              break;
+              }
+           if (!slot or (x.sequence < slot->sequence))
+              slot = &x;
+           }
+        slot->hash = e.hash;
+        slot->sequence = s + 1;
+        }
+     }
+  sent.store(s, std::memory_order_release);
+}
+
+
+int cDedup::Claim(const uint8_t* Packet) {
+  int pid = TsPid(Packet);
+  uint8_t cc = Packet[3] & ~TS_SCRAMBLING_CONTROL;
+
+  if (clear.exchange(false, std::memory_order_acquire))
+     claimed = false;
+  if (claimed and (head != UINT64_MAX)) {
+     if ((Entry(head).pid == pid) and (Entry(head).cc == cc))
+        return headCopies;
+     // the receiver dropped the claimed packet.
+     Lost(headCopies);
+     received.store(head + 1, std::memory_order_release);
+     }
+
+  uint64_t s = received.load(std::memory_order_relaxed);
+  uint64_t end = sent.load(std::memory_order_acquire);
+  if (end > s + DEDUP_RESYNC)
+     end = s + DEDUP_RESYNC;
+  uint64_t i = s;
+  while((i < end) and ((Entry(i).pid != pid) or (Entry(i).cc != cc)))
+     ++i;
+
+  claimed = true;
+  headCopies = 0;
+  if (i == end) {
+     head = UINT64_MAX;   // not sent by us, e.g. before Clear()
+     return 0;
+     }
+  if (i > s) {
+     // the CAM lost packets, their copies are lost too.
+     resyncs.fetch_add(i - s, std::memory_order_relaxed);
+     for(uint64_t j = s; j < i; j++)
+        Lost(Entry(j).state.fetch_or(CLAIMED, std::memory_order_acq_rel) & ~CLAIMED);
+     }
+  head = i;
+  headCopies = Entry(i).state.fetch_or(CLAIMED, std::memory_order_acq_rel) & ~CLAIMED;
+  return headCopies;
+}
+
+
+void cDedup::Copy(const uint8_t* Packet, int Copy, uint8_t* Data) {
+  const uint8_t* h = Entry(head).header[Copy];
+
+  memcpy(Data, h, 3);
+  // the scrambling control of the CAM output, the rest of the copy's header.
+  Data[3] = (h[3] & ~TS_SCRAMBLING_CONTROL) | (Packet[3] & TS_SCRAMBLING_CONTROL);
+  memcpy(Data + 4, Packet + 4, TS_SIZE - 4);
+  copies.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void cDedup::Done(void) {
+  if (claimed and (head != UINT64_MAX))
+     received.store(head + 1, std::memory_order_release);
+  claimed = false;
+}
+
+
+void cDedup::Clear(void) {
+  /* the deliver thread may be in Claim() now; it drops its claim with
+   * the next one. */
+  received.store(sent.load(std::memory_order_acquire), std::memory_order_release);
+  clear.store(true, std::memory_order_release);
+}
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ * @file Dedup.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <vdr/remux.h>   // TS_SIZE
+
+/*******************************************************************************
+ * Decrypt once fan-out (CamDedup): with MTD, two devices tuned to the same
+ * transponder may decrypt the same service. Their scrambled packets are the
+ * same but for the header, which carries the unique PID of the sub slot and
+ * the continuity counter; the CAM would decrypt the same data twice.
+ *
+ * The sender side hashes the scrambled payload of each packet. If the same
+ * payload is on the way through the CAM for another sub slot, the packet
+ * isn't sent again: its header is added to the entry of the one on the way
+ * and the packet is consumed. When that one comes back decrypted, the CAM
+ * slot puts a copy with each added header into the other sub slots.
+ *
+ * Entries are indexed by the number of packets sent to the CAM before them,
+ * like the bypass tags. Each packet coming back is checked against the PID
+ * and CC of its entry; if the CAM lost packets, the next DEDUP_RESYNC
+ * entries are searched. A packet is delivered to all its sub slots when the first of its
+ * copies comes back. To keep the order of each unique PID, a packet is only
+ * shared with an entry behind the last one of its PID, sent or shared. The
+ * hash index doesn't miss a packet on the way, so it is probed instead of
+ * overwritten on collisions.
+ ******************************************************************************/
+static const int DEDUP_FANOUT = 3;   // copies per packet
+
+class cDedup {
+private:
+  static const uint8_t CLAIMED = 0x80; //< tEntry::state: on the receive side
+  struct tEntry {
+     uint64_t hash;                    //< of the scrambled payload, 0: none
+     uint16_t pid;                     //< the (unique) PID sent to the CAM
+     uint8_t  cc;                      //< adaptation field control and CC
+     uint8_t  subSlot;                 //< its MTD sub slot
+     std::atomic<uint8_t> state;       //< number of copies | CLAIMED
+     uint8_t  header[DEDUP_FANOUT][4]; //< the TS headers of the copies
+     };
+  struct tIndex {
+     uint64_t hash;
+     uint64_t sequence;                //< + 1, 0: unused
+     };
+  std::vector<tEntry> ring;            //< DEDUP_RING entries by sequence
+  std::vector<tIndex> index;           //< hash -> sequence, sender side
+  std::vector<uint64_t> order;         //< unique PID -> sequence + 1 of its last packet
+  std::atomic<uint64_t> sent;          //< packets written to the CAM send buffer
+  std::atomic<uint64_t> received;      //< packets received from the CAM
+  std::atomic<bool> clear;             //< Clear() called
+  uint64_t head;                       //< the claimed entry, receive side
+  int headCopies;                      //< its number of copies
+  bool claimed;                        //< Claim() without Done()
+  std::atomic<uint64_t> shared;        //< packets not sent, as on the way
+  std::atomic<uint64_t> copies;        //< copies made
+  std::atomic<uint64_t> lost;          //< copies not delivered
+  std::atomic<uint64_t> resyncs;       //< packets lost by the CAM
+
+  static uint64_t Hash(const uint8_t* Packet);
+  tEntry& Entry(uint64_t Sequence) { return ring[Sequence & (ring.size() - 1)]; }
+  /* true, if the packet Sequence is still in the CAM, Sent packets sent. */
+  bool OnTheWay(uint64_t Sequence, uint64_t Sent);
+
+public:
+  cDedup(void);
+
+  /* sender side, called with the cTsSender mutex locked */
+
+  /* true, if the payload of Packet is on the way through the CAM for
+   * another sub slot; Packet is consumed then, its copy comes back with
+   * that one. */
+  bool Shared(const uint8_t* Packet, int SubSlot);
+  /* Count bytes of SubSlot (0 without MTD) were written to the CAM send
+   * buffer. */
+  void Sent(const uint8_t* Data, int Count, int SubSlot);
+
+  /* receive side, the deliver thread only */
+
+  /* Packet came back from the CAM: returns the number of copies to put
+   * into other sub slots. Repeated calls for the same Packet, until Done()
+   * is called, return the same. */
+  int Claim(const uint8_t* Packet);
+  /* copy number Copy of the claimed Packet, with the header of its sub slot */
+  void Copy(const uint8_t* Packet, int Copy, uint8_t* Data);
+  /* the claimed packet was delivered */
+  void Done(void);
+  /* copies not delivered, as the sub slot's buffer was full */
+  void Lost(int Copies) { lost.fetch_add(Copies, std::memory_order_relaxed); }
+
+  /* forget the packets on the way, on ClrBuffers(). */
+  void Clear(void);
+
+  uint64_t Shares(void)  { return shared; }
+  uint64_t Copies(void)  { return copies; }
+  uint64_t Losses(void)  { return lost; }
+  uint64_t Resyncs(void) { return resyncs; }
+};
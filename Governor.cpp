@@ -0,0 +1,251 @@
+/*******************************************************************************
+ * @file Governor.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstring>
+#include <vdr/remux.h>   // TS_SIZE
+#include "Governor.h"
+#include "Trace.h"
+
+extern bool CamGovernor;
+extern int AdmissionPct;
+extern bool CamBalance;
+
+static const int GOV_INTERVAL_MS = 500;  // measuring interval
+static const int GOV_CONGESTED   = 25;   // % of the send buffer filled
+static const int GOV_HEADROOM    = 90;   // % of the capacity handed out
+
+
+/*******************************************************************************
+ * class cGovernor
+ ******************************************************************************/
+cGovernor::cGovernor(void) :
+  last(cTraceRing::Now()), congested(false), wasCongested(false), measured(false), written(0), busy(0),
+  writtenLast(0), busyLast(0), capacity(0), congestions(0), updated(last), load(0),
+  actives(0), rejections(0), pids(0)
+{
+  memset(pidSeen, 0, sizeof(pidSeen));
+  for(auto& s:slots) {
+     s.priority = 0;
+     s.offered = s.admitted = s.refused = 0;
+     s.offeredLast = s.admittedLast = s.refusedLast = 0;
+     s.rate = s.tokens = 0;
+     s.share = -1;
+     s.refill = last;
+     s.tier = 0;
+     s.active = s.starved = false;
+     }
+}
+
+
+void cGovernor::Update(uint64_t Now) {
+  double dt = (Now - last) / 1e9;
+  last = Now;
+
+  /* If the buffer is congested and writing blocks most of the time, the
+   * CAM is the bottleneck: the throughput while writing is what it
+   * sustains. Shorter writes go to the driver's buffer only and say
+   * nothing. Without congestion, whatever went through is sustainable. */
+  uint64_t w = written - writtenLast;
+  uint64_t b = busy - busyLast;
+  writtenLast += w;
+  busyLast += b;
+  double cap = capacity;
+  if (congested) {
+     ++congestions;
+     if (b > dt * 1e9 / 2) {
+        double sample = w * 1e9 / b;
+        cap = measured ? (cap * 3 + sample) / 4 : sample;
+        measured = true;
+        }
+     }
+  else if (w / dt > cap)
+     cap = measured ? (cap * 3 + w / dt) / 4 : w / dt;
+  capacity = cap;
+  wasCongested = congested;
+  congested = false;
+
+  int n = 0;
+  for(auto& s:slots) {
+     uint64_t a = s.admitted;
+     uint64_t o = s.offered;
+     uint64_t r = s.refused;
+     s.rate = (a - s.admittedLast) / dt;
+     s.active = o != s.offeredLast;
+     s.starved = r != s.refusedLast;
+     s.admittedLast = a;
+     s.offeredLast = o;
+     s.refusedLast = r;
+     n += s.active;
+     }
+  load = (load * 3 + w / dt) / 4;
+  actives = n;
+  int p = 0;
+  for(auto& bits:pidSeen) {
+     p += __builtin_popcountll(bits);
+     bits = 0;
+     }
+  pids = p;
+  updated = Now;
+
+  /* tier: the number of distinct higher priorities among the active sub
+   * slots. share: at most the capacity left by the higher ones, split among
+   * those of the same priority. The admitted rate of a higher sub slot
+   * which was refused data is less than it wants: then the share is
+   * halved, otherwise it grows back by 1/20 of the capacity. */
+  for(auto& s:slots) {
+     int prio = s.priority;
+     int higher[SLOTS];
+     int tiers = 0, same = s.active ? 0 : 1;
+     double used = 0;
+     bool starved = false;
+     for(auto& o:slots) {
+        if (!o.active)
+           continue;
+        int p = o.priority;
+        if (p == prio)
+           ++same;
+        else if (p > prio) {
+           used += o.rate;
+           starved |= o.starved;
+           bool known = false;
+           for(int i = 0; i < tiers; i++)
+              known |= higher[i] == p;
+           if (!known)
+              higher[tiers++] = p;
+           }
+        }
+     s.tier = tiers;
+     if (!tiers or !cap)
+        s.share = -1;
+     else {
+        double left = cap * GOV_HEADROOM / 100 - used;
+        double fair = (left > 0 ? left : 0) / same;
+        if (starved)
+           s.share = (s.share < 0 ? fair : s.share) / 2;
+        else if ((s.share < 0) or (s.share + cap / 20 > fair))
+           s.share = fair;
+        else
+           s.share += cap / 20;
+        }
+     }
+}
+
+
+bool cGovernor::Measuring(void) {
+  return CamGovernor or AdmissionPct or CamBalance;
+}
+
+
+int cGovernor::Admit(int SubSlot, const uint8_t* Data, int Count, int Free, int Size) {
+  tSubSlot& s = slots[SubSlot % SLOTS];
+  uint64_t now = cTraceRing::Now();
+
+  if (now - last >= uint64_t(GOV_INTERVAL_MS) * 1000000)
+     Update(now);
+
+  if (s.share >= 0) {
+     double burst = s.share * GOV_INTERVAL_MS / 1000;
+     s.tokens += s.share * (now - s.refill) / 1e9;
+     if (s.tokens > burst)
+        s.tokens = burst;
+     }
+  s.refill = now;
+
+  s.offered += Count;
+  for(int i = 0; i < Count; i += TS_SIZE) {
+     if (TsIsScrambled(Data + i)) {
+        int pid = TsPid(Data + i);
+        pidSeen[pid / 64] |= uint64_t(1) << (pid % 64);
+        }
+     }
+  int n = Count < Free ? Count : Free;
+  int fill = Size - Free;
+  bool congest = fill >= Size / 100 * GOV_CONGESTED;
+  congested |= congest;
+  if (!CamGovernor)
+     return Count;   // measuring for Admissible() only
+  if (congest) {
+     // the highest tier may fill the whole buffer, the next half of it...
+     int limit = s.tier < 2 ? Size >> s.tier : Size / 100 * GOV_CONGESTED;
+     if (n > limit - fill)
+        n = limit - fill;
+     }
+  // the shares apply, as long as the buffer is congested now and then.
+  bool limited = (s.share >= 0) and (congested or wasCongested);
+  if (limited and (n > s.tokens))
+     n = s.tokens;
+  if (n < 0)
+     n = 0;
+  n -= n % TS_SIZE;
+  if (limited)
+     s.tokens -= n;
+
+  s.admitted += n;
+  if (n < Count)
+     s.refused += Count - n;
+  return n;
+}
+
+
+bool cGovernor::Idle(void) {
+  return cTraceRing::Now() - updated > uint64_t(2 * GOV_INTERVAL_MS) * 1000000;
+}
+
+
+bool cGovernor::Fits(int Percent) {
+  uint64_t cap = capacity;
+  int n = actives;
+  if (!measured or !cap or !n or Idle())
+     return true;
+  // a new service is expected to need the average of the ones running.
+  uint64_t l = load;
+  return l + l / n <= cap / 100 * Percent;
+}
+
+
+bool cGovernor::Admissible(int Percent) {
+  if (Fits(Percent))
+     return true;
+  ++rejections;
+  return false;
+}
+
+
+std::string cGovernor::Stats(void) {
+  std::string s = "CAM throughput " + std::to_string(capacity * 8 / 1000) + " kbit/s" +
+                  (measured ? "" : " (not congested yet)") +
+                  ", load " + std::to_string(Load() * 8 / 1000) + " kbit/s, " +
+                  std::to_string(Pids()) + " scrambled PIDs, " +
+                  std::to_string(congestions) + " congested intervals, " +
+                  std::to_string(rejections) + " services refused";
+  for(int i = 0; i < SLOTS; i++) {
+     tSubSlot& t = slots[i];
+     if (!t.offered)
+        continue;
+     s += "\n  sub slot " + std::to_string(i) +
+          ": priority " + std::to_string(t.priority) +
+          ", offered "  + std::to_string(t.offered  / 1024) + " kB";
+     if (CamGovernor)
+        s += ", admitted " + std::to_string(t.admitted / 1024) + " kB" +
+             ", refused "  + std::to_string(t.refused  / 1024) + " kB";
+     }
+  return s;
+}
@@ -0,0 +1,137 @@
+/*******************************************************************************
+ * @file Governor.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include "Common.h"
+
+/*******************************************************************************
+ * The CAM bandwidth governor: if the MTD sub slots together send more than
+ * the CAM can decrypt, the send buffer fills up and cTsSender::Write() has
+ * to refuse data. Without the governor, whoever comes first wins.
+ *
+ * The governor measures the throughput the CAM sustains while the send
+ * buffer is backlogged, and decides per sub slot how much it may put into
+ * the send buffer, by the priority VDR gave the sub slot's device:
+ *  - the highest priority tier may fill the whole buffer, the next one
+ *    half of it, the others GOV_CONGESTED of it.
+ *  - if the buffer was filled above GOV_CONGESTED in this or the last
+ *    interval, all but the highest tier get token buckets, filled with the
+ *    CAM throughput left over by the higher tiers.
+ * Refused bytes are counted per sub slot. VDR offers them again, so they
+ * are attempts; the data is lost when VDR's own buffer overflows.
+ *
+ * Without --governor, Admit() only measures, for the admission control.
+ *
+ * Sub slot 0 is the master slot without MTD, the others are the MTD sub slots
+ * (the upper bits of their unique PIDs, see <vdr/mtd.h>).
+ ******************************************************************************/
+class cGovernor {
+public:
+  static const int SLOTS = SUB_SLOTS;
+private:
+  struct tSubSlot {
+     std::atomic<int> priority;      //< set by the CI thread
+     std::atomic<uint64_t> offered;  //< bytes
+     std::atomic<uint64_t> admitted; //< bytes
+     std::atomic<uint64_t> refused;  //< bytes
+     uint64_t offeredLast;           //< offered at the last Update()
+     uint64_t admittedLast;          //< admitted at the last Update()
+     uint64_t refusedLast;           //< refused at the last Update()
+     double rate;                    //< admitted bytes/s, last interval
+     double share;                   //< bytes/s while congested, < 0: any
+     double tokens;                  //< bytes, refilled with share
+     uint64_t refill;                //< ns, last token refill
+     int tier;                       //< 0 = highest priority
+     bool active;                    //< offered data in the last interval
+     bool starved;                   //< was refused data in the last interval
+     };
+  tSubSlot slots[SLOTS];
+  uint64_t last;                     //< ns, last Update()
+  bool congested;                    //< the buffer was congested since Update()
+  bool wasCongested;                 //< ... in the interval before
+  std::atomic<bool> measured;        //< capacity was measured while congested
+  std::atomic<uint64_t> written;     //< bytes written to the CAM
+  std::atomic<uint64_t> busy;        //< ns spent writing to the CAM
+  uint64_t writtenLast;
+  uint64_t busyLast;
+  std::atomic<uint64_t> capacity;    //< bytes/s the CAM sustains, 0 = unknown
+  std::atomic<uint64_t> congestions; //< intervals with a congested buffer
+  std::atomic<uint64_t> updated;     //< ns, last Update(), for other threads
+  std::atomic<uint64_t> load;        //< bytes/s admitted, smoothed
+  std::atomic<int> actives;          //< sub slots which offered data
+  std::atomic<uint64_t> rejections;  //< new work refused by Admissible()
+  uint64_t pidSeen[0x2000 / 64];     //< scrambled PIDs since Update()
+  std::atomic<int> pids;             //< scrambled PIDs, last interval
+
+  /* once per GOV_INTERVAL_MS: rates, capacity, tiers and shares. */
+  void Update(uint64_t Now);
+
+public:
+  cGovernor(void);
+
+  /* true, if the sender has to call Admit() and Written(): for the
+   * governor itself, the admission control and the CAM pool. */
+  static bool Measuring(void);
+
+  /* sender side, called with the cTsSender mutex locked.
+   * Returns how many of Count bytes of Data SubSlot may put into the send
+   * buffer of Size bytes with Free bytes free, a multiple of TS_SIZE. */
+  int Admit(int SubSlot, const uint8_t* Data, int Count, int Free, int Size);
+
+  /* the sender thread wrote Bytes to the CAM within Ns nanoseconds. */
+  void Written(int Bytes, uint64_t Ns) {
+     written.fetch_add(Bytes, std::memory_order_relaxed);
+     busy.fetch_add(Ns, std::memory_order_relaxed);
+     }
+
+  /* the CI thread, from the VDR priorities of the sub slots. */
+  void SetPriority(int SubSlot, int Priority) { slots[SubSlot % SLOTS].priority = Priority; }
+
+  /* admission control: true, if the CAM can take another service without
+   * exceeding Percent of its capacity. Unknown as long as the CAM wasn't
+   * congested once; then and while idle, it's always true. */
+  bool Admissible(int Percent);
+  /* the same, without counting a rejection. */
+  bool Fits(int Percent);
+
+  /* the CAM throughput found by cAdapter::Calibrate(), in bytes/s: the
+   * capacity until the governor measured one itself. */
+  void Calibrated(uint64_t BytesPerSec) {
+     if (!measured) {
+        capacity = BytesPerSec;
+        measured = true;
+        }
+     }
+
+  /* the measured CAM throughput in bytes/s, 0 if not known yet. */
+  uint64_t Capacity(void) { return capacity; }
+  /* bytes/s sent to the CAM and scrambled PIDs, 0 while idle. */
+  uint64_t Load(void) { return Idle() ? 0 : load.load(); }
+  int Pids(void) { return Idle() ? 0 : pids.load(); }
+  bool Idle(void);
+  uint64_t Refused(int SubSlot) { return slots[SubSlot % SLOTS].refused; }
+
+  /* one line per sub slot which ever offered data. */
+  std::string Stats(void);
+};
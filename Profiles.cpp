@@ -0,0 +1,101 @@
+/*******************************************************************************
+ * @file Profiles.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <fstream>
+#include <fnmatch.h>
+#include "Profiles.h"
+#include "AdapterConfig.h"
+#include "Logging.h"
+
+
+
+/*******************************************************************************
+ * class cProfiles
+ ******************************************************************************/
+cMutex cProfiles::mutex;
+std::vector<cProfiles::tProfile> cProfiles::profiles;
+
+
+bool cProfiles::Load(const std::string& FileName) {
+  std::ifstream file(FileName);
+  if (!file)
+     return false;
+
+  cMutexLock MutexLock(&mutex);
+  profiles.clear();
+  std::string line;
+  for(int n = 1; std::getline(file, line); n++) {
+     size_t pos = line.find_first_not_of(" \t");
+     if ((pos == std::string::npos) or (line[pos] == '#'))
+        continue;
+
+     tProfile p;
+     size_t end;
+     p.Cam = line[pos] == '"';
+     if (p.Cam) {
+        end = line.find('"', ++pos);
+        if (end == std::string::npos) {
+           log(1, FileName + ":" + std::to_string(n) + ": missing '\"'");
+           continue;
+           }
+        p.Pattern = line.substr(pos, end++ - pos);
+        }
+     else {
+        end = line.find_first_of(" \t", pos);
+        if (end == std::string::npos)
+           end = line.size();
+        p.Pattern = line.substr(pos, end - pos);
+        }
+     p.Settings = line.substr(end);
+
+     std::string error = cAdapterConfig::Check(p.Settings);
+     if (!error.empty()) {
+        log(1, FileName + ":" + std::to_string(n) + ": " + error);
+        continue;
+        }
+     profiles.push_back(p);
+     }
+  log(2, std::to_string(profiles.size()) + " adapter profiles from " + FileName);
+  return true;
+}
+
+
+std::string cProfiles::Settings(const std::string& DevPath, const char* CamName) {
+  cMutexLock MutexLock(&mutex);
+  std::string s;
+  for(auto p:profiles) {
+     const char* name = p.Cam ? CamName : DevPath.c_str();
+     if (name and (fnmatch(p.Pattern.c_str(), name, 0) == 0)) {
+        for(auto setting:cAdapterConfig::Split(p.Settings))
+           s += (s.empty() ? "" : " ") + setting;
+        }
+     }
+  return s;
+}
+
+
+bool cProfiles::HasCam(const char* CamName) {
+  cMutexLock MutexLock(&mutex);
+  for(auto p:profiles)
+     if (p.Cam and (fnmatch(p.Pattern.c_str(), CamName, 0) == 0))
+        return true;
+  return false;
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+ * @file Profiles.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <vector>
+#include <string>
+#include <vdr/thread.h>
+
+/*******************************************************************************
+ * Per adapter profiles, read by cPluginDDCI3::Start() from adapters.conf in
+ * the plugin's config directory, or the file given by --profiles. One
+ * profile per line, '#' starts a comment line:
+ *   <device>       <setting>=<value> ...
+ *   "<CAM name>"   <setting>=<value> ...
+ * <device> is the path of the adapter's ca device, f.i. /dev/dvb/adapter0/ca0,
+ * <CAM name> the name the CAM tells VDR. Both may contain shell wildcards.
+ * The settings are those of cAdapterConfig.
+ *
+ * All profiles matching an adapter apply in the order of the file, a later
+ * line overrides an earlier one. The device profiles apply when the adapter
+ * is created, the CAM profiles once its CAM told the name. Another CAM
+ * starts over from the command line and the device profiles.
+ ******************************************************************************/
+class cProfiles {
+private:
+  struct tProfile {
+     bool Cam;              //< Pattern is a CAM name, not a device path
+     std::string Pattern;
+     std::string Settings;
+     };
+  static cMutex mutex;
+  static std::vector<tProfile> profiles;
+
+public:
+  /* reads FileName, invalid lines are logged and skipped. false, if
+   * FileName can't be read. */
+  static bool Load(const std::string& FileName);
+
+  /* the settings of all profiles of the adapter at DevPath, with the CAM
+   * profiles of CamName, if not nullptr. */
+  static std::string Settings(const std::string& DevPath, const char* CamName = nullptr);
+
+  /* true, if a CAM profile matches CamName. */
+  static bool HasCam(const char* CamName);
+};
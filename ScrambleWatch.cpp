@@ -0,0 +1,117 @@
+/*******************************************************************************
+ * @file ScrambleWatch.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <vdr/remux.h>
+#include <vdr/tools.h>
+#include "ScrambleWatch.h"
+
+extern int RecoverPct;
+extern int RecoverSec;
+
+
+/*******************************************************************************
+ * class cScrambleWatch
+ ******************************************************************************/
+cScrambleWatch::cScrambleWatch(void) : lastReset(0), resends(0), resets(0) {
+  for(auto& s:slots) {
+     s.packets = 0;
+     s.scrambled = 0;
+     s.seconds = 0;
+     s.stage = saNone;
+     s.restart = false;
+     }
+}
+
+
+void cScrambleWatch::Received(const uint8_t* Data, int Count, bool Mtd) {
+  uint32_t packets[SLOTS] = { 0 };
+  uint32_t scrambled[SLOTS] = { 0 };
+
+  for(int i = 0; i + TS_SIZE <= Count; i += TS_SIZE) {
+     const uint8_t* ts = Data + i;
+     int pid = TsPid(ts);
+     if (!TsHasPayload(ts) or (pid == 0x1FFF))
+        continue;
+     int slot = Mtd ? SubSlotOf(pid) : 0;
+     ++packets[slot];
+     if (TsIsScrambled(ts))
+        ++scrambled[slot];
+     }
+
+  for(int i = 0; i < SLOTS; i++) {
+     if (!packets[i])
+        continue;
+     slots[i].packets.fetch_add(packets[i], std::memory_order_relaxed);
+     if (scrambled[i])
+        slots[i].scrambled.fetch_add(scrambled[i], std::memory_order_relaxed);
+     }
+}
+
+
+eScrambleAction cScrambleWatch::Check(int SubSlot) {
+  tSlot& s = slots[SubSlot];
+  uint32_t packets = s.packets.exchange(0, std::memory_order_relaxed);
+  uint32_t scrambled = s.scrambled.exchange(0, std::memory_order_relaxed);
+
+  if (s.restart.exchange(false, std::memory_order_relaxed)) {
+     s.seconds = 0;
+     s.stage = saNone;
+     return saNone;
+     }
+
+  if (packets < MIN_PACKETS) {
+     // stopped, or nothing to judge.
+     s.seconds = 0;
+     return saNone;
+     }
+
+  if (uint64_t(scrambled) * 100 < uint64_t(packets) * RecoverPct) {
+     s.seconds = 0;
+     if (s.stage == saNone)
+        return saNone;
+     s.stage = saNone;
+     return saRecovered;
+     }
+
+  if (++s.seconds < RecoverSec)
+     return saNone;
+  switch(s.stage) {
+     case saNone:
+        s.seconds = 0;
+        s.stage = saResend;
+        ++resends;
+        return saResend;
+     case saResend:
+        if (lastReset and (cTimeMs::Now() - lastReset < RECOVER_HOLDOFF_MS))
+           return saNone;
+        s.seconds = 0;
+        s.stage = saReset;
+        lastReset = cTimeMs::Now();
+        ++resets;
+        return saReset;
+     default:
+        if (s.seconds < RecoverSec * GIVEN_UP_RESEND)
+           return saNone;
+        s.seconds = 0;
+        ++resends;
+        return saResend;
+     }
+}
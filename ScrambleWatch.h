@@ -0,0 +1,80 @@
+/*******************************************************************************
+ * @file ScrambleWatch.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include "Common.h"
+
+/*******************************************************************************
+ * Scrambled output detector (RecoverPct): a CAM may silently lose the
+ * descrambling state of a service and return its packets scrambled, which
+ * ruins a recording until the next zap.
+ *
+ * The deliver thread counts the packets with payload coming back from the
+ * CAM and those still scrambled, per MTD sub slot (0 without MTD). The CI
+ * thread looks at the counts once a second: if RecoverPct % or more were
+ * scrambled for RecoverSec seconds in a row, the CA PMT is sent again; if
+ * that doesn't help within another RecoverSec, the CAM is reset, at most
+ * once in RECOVER_HOLDOFF_MS for all sub slots, as the others need some
+ * time to come back after it. If the reset didn't help either, f.i. for a
+ * service the card isn't entitled to, only the CA PMT is sent again now and
+ * then, until the sub slot recovers. A zap takes less than RecoverSec, so
+ * its scrambled start doesn't count; a new service starts from scratch,
+ * see Restart().
+ ******************************************************************************/
+enum eScrambleAction { saNone, saResend, saReset, saRecovered };
+
+class cScrambleWatch {
+public:
+  static const int SLOTS = SUB_SLOTS;    //< MTD sub slot numbers
+private:
+  static const int MIN_PACKETS = 50;     //< per second, less isn't judged
+  static const int RECOVER_HOLDOFF_MS = 60000; //< between two CAM resets
+  static const int GIVEN_UP_RESEND = 12; //< RecoverSec between the resends after a reset
+  struct tSlot {
+     std::atomic<uint32_t> packets;      //< with payload, since the last Check()
+     std::atomic<uint32_t> scrambled;    //< of them still scrambled
+     int seconds;                        //< scrambled in a row, CI thread only
+     int stage;                          //< saNone, saResend or saReset done
+     std::atomic<bool> restart;          //< a new service, for Check()
+     };
+  tSlot slots[SLOTS];
+  uint64_t lastReset;                    //< cTimeMs::Now() of the last saReset, CI thread only
+  std::atomic<uint64_t> resends;
+  std::atomic<uint64_t> resets;
+
+public:
+  cScrambleWatch(void);
+
+  /* the deliver thread: Data came back from the CAM. */
+  void Received(const uint8_t* Data, int Count, bool Mtd);
+
+  /* the CI thread, once a second for each sub slot: what to do about it. */
+  eScrambleAction Check(int SubSlot);
+
+  /* any thread: SubSlot stops or starts decrypting, what was done for its
+   * last service doesn't count for the next one. */
+  void Restart(int SubSlot) { slots[SubSlot].restart.store(true, std::memory_order_relaxed); }
+
+  uint64_t Resends(void) { return resends; }
+  uint64_t Resets(void)  { return resets; }
+};
@@ -0,0 +1,101 @@
+/*******************************************************************************
+ * @file Trace.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include "Trace.h"
+#include "Logging.h"
+
+// error dumps are rate limited, a broken CAM must not fill the disk.
+static const uint64_t TRACE_DUMP_INTERVAL = 60 * 1000000000ULL; // 60s in ns
+
+
+/*******************************************************************************
+ * class cTraceRing
+ ******************************************************************************/
+std::string cTraceRing::Dump(std::string Directory, std::string Device, std::string Reason) {
+  Add(teDump, Reason == "error");
+
+  /* take a snapshot first, the data path continues to write while the file
+   * is written. */
+  uint32_t end = pos.load(std::memory_order_acquire);
+  uint32_t n = (end < TRACE_RECORDS) ? end : TRACE_RECORDS;
+  std::vector<tTraceRecord> snapshot(n);
+  for(uint32_t i = 0; i < n; i++)
+     snapshot[i] = records[(end - n + i) & (TRACE_RECORDS - 1)];
+
+  tTraceHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.Magic, TRACE_MAGIC, sizeof(h.Magic));
+  h.Version = TRACE_VERSION;
+  h.Records = n;
+  h.MonoTime = Now();
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  h.RealTime = uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  strncpy(h.Device, Device.c_str(), sizeof(h.Device) - 1);
+  strncpy(h.Reason, Reason.c_str(), sizeof(h.Reason) - 1);
+
+  /* /dev/dvb/adapter0/ca0 -> ddci3-adapter0-ca0-<seconds>-<n>.trace, n counts
+   * the dumps of this ring; so two dumps within a second don't overwrite
+   * each other. */
+  std::string name(Device);
+  if (name.find("/dev/dvb/") == 0)
+     name.erase(0, 9);
+  for(auto& c:name)
+     if (c == '/') c = '-';
+  name = Directory + "/ddci3-" + name + "-" + std::to_string(ts.tv_sec) + "-" +
+         std::to_string(dumps.fetch_add(1, std::memory_order_relaxed)) + ".trace";
+
+  int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+     log(1, "couldn't open trace file " + name + ": " + strerror(errno));
+     return "";
+     }
+
+  bool ok = (write(fd, &h, sizeof(h)) == sizeof(h));
+  if (ok && n)
+     ok = (write(fd, snapshot.data(), n * sizeof(tTraceRecord)) == ssize_t(n * sizeof(tTraceRecord)));
+  close(fd);
+
+  if (!ok) {
+     log(1, "couldn't write trace file " + name + ": " + strerror(errno));
+     return "";
+     }
+
+  log(2, "trace of " + Device + " (" + std::to_string(n) + " events) written to " + name);
+  return name;
+}
+
+
+void cTraceRing::DumpPending(std::string Directory, std::string Device) {
+  if (!dumpRequest.load(std::memory_order_acquire))
+     return;
+
+  uint64_t now = Now();
+  if (lastDump && (now - lastDump < TRACE_DUMP_INTERVAL))
+     return; // keep the request, dump again when the interval is over
+
+  dumpRequest.store(false, std::memory_order_relaxed);
+  lastDump = now;
+  Dump(Directory, Device, "error");
+}
@@ -0,0 +1,191 @@
+/*******************************************************************************
+ * @file Trace.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*******************************************************************************
+ * NOTE: this header is also used by tools/ddci3-trace.cpp, which is built
+ * without VDR. Don't include any VDR or plugin header here.
+ ******************************************************************************/
+
+
+/*******************************************************************************
+ * The events recorded in the trace ring. Never change the numbers of
+ * existing events, old dump files would be decoded wrong. Append only.
+ * Only per chunk or state change events are traced, never per TS packet;
+ * so the ring covers some seconds of history even at full CAM bitrate.
+ ******************************************************************************/
+enum eTraceEvent : uint16_t {
+  teNone         =  0,
+  teSndFull      =  1,  // cTsSender::Write/WriteAll,  value: bytes rejected
+  teSndGet       =  2,  // cTsSender::Action,          value: bytes available
+  teSndWrite     =  3,  // cTsSender::Action,          value: bytes written to secY
+  teSndDel       =  4,  // cTsSender::Action,          value: bytes deleted from rb
+  teSndClear     =  5,  // cTsSender::Action,          value: packets to drop
+  teRcvPoll      =  6,  // cTsReceiver::Action,        value: 1 = data, 0 = timeout
+  teRcvRead      =  7,  // cTsReceiver::Action,        value: bytes read from secY
+  teRcvOverflow  =  8,  // cTsReceiver::Action
+  teRcvGet       =  9,  // cTsReceiver::Deliver,       value: bytes available
+  teRcvDel       = 10,  // cTsReceiver::Deliver,       value: bytes deleted from rb
+  teRcvClear     = 11,  // cTsReceiver::Deliver,       value: bytes dropped
+  teRcvRetry     = 12,  // cTsReceiver::Deliver,       value: retry number
+  teRcvDrop      = 13,  // cTsReceiver::Deliver,       value: bytes dropped
+  teSyncSkip     = 14,  // sender or receiver,         value: bytes skipped
+  teDecShort     = 15,  // cCiCamSlot::Decrypt,        value: bytes not consumed
+  teDecEmpty     = 16,  // cCiCamSlot::Decrypt,        value: packets since last empty
+  teDecScrambled = 17,  // cCiCamSlot::Decrypt,        value: scrambled packets
+  teSlotPut      = 18,  // cCiCamSlot::DataRecv,       value: bytes put
+  teSlotFull     = 19,  // cCiCamSlot::DataRecv,       value: bytes offered
+  teSlotClear    = 20,  // cCiCamSlot::Decrypt,        value: packets dropped
+  teSlotStart    = 21,  // cCiCamSlot::StartDecrypting
+  teSlotStop     = 22,  // cCiCamSlot::StopDecrypting
+  teSlotReset    = 23,  // cCiCamSlot::Reset
+  teAdpReset     = 24,  // cAdapter::Reset,            value: slot
+  teError        = 25,  // any thread,                 value: errno
+  teDump         = 26,  // cTraceRing::Dump,           value: 1 = error, 0 = on demand
+  teBypass       = 27,  // cTsSender::Write,           value: packets bypassed
+  teBypassStall  = 28,  // cCiCamSlot::DataRecv,       value: stalls resolved
+  teSndNull      = 29,  // cTsSender::Write,           value: null packets stripped
+  teSndFlush     = 30,  // cTsSender::IdleFlush,       value: bytes written
+  teGovRefuse    = 31,  // cTsSender::Write,           value: sub slot << 24 | bytes refused
+  teAdmRefuse    = 32,  // cAdapter::Admissible,       value: CAM load in kbit/s
+  tePoolRefuse   = 33,  // cAdapter::Admissible,       value: services on this CAM
+  teDedup        = 34,  // cTsSender::Write,           value: packets shared, not sent
+  teCaPmt        = 35,  // cAdapter::Write,            value: program number
+  teDecrypted    = 36,  // cAdapter::ZapDone,          value: us since the CA PMT
+  teScrambled    = 37,  // cAdapter::CheckScrambled,   value: sub slot << 24 | eScrambleAction
+  teCount
+};
+
+
+inline const char* TraceEventName(uint16_t Event) {
+  static const char* names[] = {
+     "None",      "SndFull",   "SndGet",    "SndWrite",    "SndDel",
+     "SndClear",  "RcvPoll",   "RcvRead",   "RcvOverflow", "RcvGet",
+     "RcvDel",    "RcvClear",  "RcvRetry",  "RcvDrop",     "SyncSkip",
+     "DecShort",  "DecEmpty",  "DecScrambled", "SlotPut",  "SlotFull",
+     "SlotClear", "SlotStart", "SlotStop",  "SlotReset",   "AdpReset",
+     "Error",     "Dump",      "Bypass",    "BypassStall",
+     "SndNull",   "SndFlush",  "GovRefuse", "AdmRefuse",
+     "PoolRefuse", "Dedup",   "CaPmt",     "Decrypted", "Scrambled" };
+
+  if (Event < teCount)
+     return names[Event];
+  return "?";
+}
+
+
+/*******************************************************************************
+ * One trace record, 16 bytes. The dump file is written in host byte order,
+ * decode it on a machine with the same endianess.
+ ******************************************************************************/
+struct tTraceRecord {
+  uint64_t Time;    // CLOCK_MONOTONIC in ns
+  uint32_t Value;   // event specific, see eTraceEvent
+  uint16_t Event;   // eTraceEvent
+  uint16_t Tid;     // lower 16 bits of the thread id
+};
+
+
+/*******************************************************************************
+ * The dump file header, followed by 'Records' tTraceRecord, oldest first.
+ ******************************************************************************/
+static const char TRACE_MAGIC[8] = { 'D','D','C','I','3','T','R','C' };
+static const uint32_t TRACE_VERSION = 1;
+
+struct tTraceHeader {
+  char     Magic[8];     // TRACE_MAGIC
+  uint32_t Version;      // TRACE_VERSION
+  uint32_t Records;      // number of records following this header
+  uint64_t MonoTime;     // CLOCK_MONOTONIC in ns at dump time
+  uint64_t RealTime;     // CLOCK_REALTIME in ns at dump time
+  char     Device[64];   // adapterX/caY device path
+  char     Reason[64];   // why this dump was written
+};
+
+
+/*******************************************************************************
+ * A lock free ring of the last TRACE_RECORDS events of one adapter.
+ * Add() is cheap enough to stay enabled all the time: one relaxed atomic
+ * increment, one vDSO clock read and a 16 byte store. Writers never wait,
+ * a record which is overwritten while being dumped is simply garbage.
+ * With TraceOn false (--no-trace) Add() records nothing.
+ ******************************************************************************/
+static const uint32_t TRACE_RECORDS = 1 << 14;   // 256kB per adapter
+
+extern bool TraceOn;
+
+class cTraceRing {
+private:
+  tTraceRecord records[TRACE_RECORDS];
+  std::atomic<uint32_t> pos;
+  std::atomic<bool> dumpRequest;
+  std::atomic<uint32_t> dumps; //< number of dumps written, part of the file name
+  uint64_t lastDump;     //< CLOCK_MONOTONIC in ns of the last error dump
+
+  static uint16_t Tid(void) {
+     static thread_local uint16_t tid = syscall(SYS_gettid);
+     return tid;
+     }
+
+public:
+  cTraceRing(void) : pos(0), dumpRequest(false), dumps(0), lastDump(0) {}
+
+  static uint64_t Now(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+     }
+
+  void Add(eTraceEvent Event, uint32_t Value = 0) {
+     if (!TraceOn)
+        return;
+     tTraceRecord& r = records[pos.fetch_add(1, std::memory_order_relaxed) & (TRACE_RECORDS - 1)];
+     r.Time  = Now();
+     r.Value = Value;
+     r.Event = Event;
+     r.Tid   = Tid();
+     }
+
+  /* Records an error and asks the owner to dump the ring soon. Safe to be
+   * called from the data path, the file is written by DumpPending().
+   */
+  void Error(int Errno) {
+     Add(teError, Errno);
+     dumpRequest.store(true, std::memory_order_release);
+     }
+
+  /* Writes the ring to a file in Directory, returns the file name or an
+   * empty string on failure.
+   */
+  std::string Dump(std::string Directory, std::string Device, std::string Reason);
+
+  /* Writes a pending error dump, at most once every TRACE_DUMP_INTERVAL.
+   * Must not be called from the TS data path threads.
+   */
+  void DumpPending(std::string Directory, std::string Device);
+};
@@ -20,6 +20,8 @@
  * You should have received a copy of the GNU General Public License
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
+#include <algorithm>
+#include <sys/eventfd.h>
 #include <vdr/tools.h>
 #include "TsReceiver.h"
 #include "Common.h"
@@ -27,8 +29,7 @@
 #include "Logging.h"
 
 
-extern int SleepTimeout;
-static const int CNT_REC_DBG_MAX = 100;
+static const int CNT_REC_DBG_MAX  = 100;
 
 
 /*******************************************************************************
@@ -36,9 +37,11 @@ static const int CNT_REC_DBG_MAX = 100;
  ******************************************************************************/
 cTsReceiver::cTsReceiver(cAdapter& Adapter, int ci_fdr, std::string& sec) :
   cThread(), adapter(Adapter), fd(ci_fdr), devpath(sec),
-  rb(BufferSize(), TS_SIZE, DebugBuffers, "CAM cTsReceiver"),
-  pkgCntR(0), pkgCntW(0), pkgCntRL(0), pkgCntWL(0), clear(false), retry(0),
-  cntRecDbg(0), tsdeliver(*this, sec)
+  rb(new cRingBufferLinear(BufferSize(Adapter.BufSize()), TS_SIZE, DebugBuffers, "CAM cTsReceiver")),
+  pkgCntR(0), pkgCntW(0), pkgCntRL(0), pkgCntWL(0), epoch(0),
+  cleared(true), pkgCntCam(0), camLag(0), clearAt(0), markersLost(0), dropped(0), retry(0),
+  cntRecDbg(0), tsdeliver(*this, sec), pollWait(Adapter.Config().SleepTimeout), deliverWait(Adapter.Config().SleepTimeout),
+  wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), unparked(false)
 {
   // don't use adapter in this function, unless you know what you are doing!
 
@@ -52,6 +55,9 @@ cTsReceiver::~cTsReceiver(void) {
 
   Cancel(3);
   CleanUp();
+  if (wakeFd != -1)
+     close(wakeFd);
+  delete rb;
 
   _leaving;
 }
@@ -67,27 +73,83 @@ bool cTsReceiver::Start(void) {
 void cTsReceiver::Cancel(int waitSec) {
   _entering;
 
+  /* Running() turns false before the wakeups, a parked thread may wait
+   * without timeout. */
+  cThread::Cancel(-1);
+  uint64_t one = 1;
+  if ((wakeFd != -1) and (write(wakeFd, &one, sizeof(one)) < 0)) {} // only wake the poll
+  deliverWait.Signal();
+  /* on plugin shutdown, the deliver thread goes together with us. */
+  if (adapter.Stopping())
+     tsdeliver.Cancel(waitSec);
   cThread::Cancel(waitSec);
 
   _leaving;
 }
 
 
+void cTsReceiver::Unpark(void) {
+  deliverWait.Signal();
+  pollWait.Signal();
+  /* the flag after the write: whoever takes it reads the eventfd after
+   * this write, so it isn't left readable with the flag gone. */
+  uint64_t one = 1;
+  if ((wakeFd != -1) and (write(wakeFd, &one, sizeof(one)) < 0)) {} // only wake the poll
+  unparked = true;
+}
+
+
+void cTsReceiver::Resize(int Packets) {
+  pkgCntCam += rb->Available() / TS_SIZE;
+  delete rb;
+  rb = new cRingBufferLinear(BufferSize(Packets), TS_SIZE, DebugBuffers, "CAM cTsReceiver");
+  rb->SetTimeouts(0, 0);
+}
+
+
 void cTsReceiver::Deliver(void) {
+  cTraceRing& trace = adapter.Trace();
+  cTsSender& sender = adapter.Sender();
+  unsigned sched = 0;
+
   while (Running()) {
-     if (clear) {
-        rb.Clear();
-        pkgCntW = 0;
-        pkgCntR = 0;
-        clear = false;
+     if (adapter.Holding()) {
+        adapter.Held(true);
+        while(adapter.Holding() and Running())
+           deliverWait.Wait(true);
+        adapter.Held(false);
+        }
+     deliverWait.SetLimits(adapter.Config().SleepTimeout);
+     adapter.Config().ApplySched(sched);
+
+     uint32_t e = sender.Epoch();
+     if (e != epoch) {
+        if (sender.Acked() != e) {
+           // the sender didn't apply it yet, anything here may be stale.
+           cCondWait::SleepMs(1);
+           continue;
+           }
+        epoch = e;
+        cleared = false;
+        clearAt = sender.MarkCam() - uint64_t(camLag);
         retry = 0;
-        cntRecDbg = 0;
         }
 
      int cnt = 0;
-     uint8_t* data = rb.Get(cnt);
-     if (!data || cnt < TS_SIZE)
+     uint8_t* data = rb->Get(cnt);
+     trace.Add(teRcvGet, data ? cnt : 0);
+     if (!cleared and data and DropStale(data, cnt))
+        continue;
+     if (!data || cnt < TS_SIZE) {
+        adapter.DataIdle();
+        // bypass packets still waiting go out in the next idle round.
+        bool pending = adapter.Bypass().Pending();
+        if (pending)
+           deliverWait.Busy();
+        deliverWait.Wait(!pending and adapter.Parked());
         continue;
+        }
+     deliverWait.Busy();
 
      int skipped;
      uint8_t* frame = CheckTsSync(data, cnt, skipped);
@@ -95,7 +157,9 @@ void cTsReceiver::Deliver(void) {
         log(1, std::string(__PRETTY_FUNCTION__) +
             ": skipped " + std::to_string(skipped) +
             " bytes to sync on start of TS packet - " + strerror(errno));
-        rb.Del(skipped);
+        trace.Add(teSyncSkip, skipped);
+        trace.Error(errno);
+        rb->Del(skipped);
         cnt -= skipped;
         }
 
@@ -107,22 +171,42 @@ void cTsReceiver::Deliver(void) {
      */
     cnt -= cnt % TS_SIZE;
 
+    /* strip our idle flush packets: deliver up to the first one, delete
+     * it in the next round. */
+    if (adapter.FlushPending()) {
+       int i = 0;
+       while((i < cnt) && !IsFlushPacket(frame + i))
+          i += TS_SIZE;
+       if (i == 0) {
+          rb->Del(TS_SIZE);
+          adapter.FlushReturned();
+          continue;
+          }
+       cnt = i;
+       }
+
     int written = adapter.DataRecv( frame, cnt );
     if (written != 0) {
-       rb.Del( written );
+       rb->Del( written );
+       trace.Add(teRcvDel, written);
        retry = 0;
-       pkgCntR += written / TS_SIZE;
+       pkgCntR.fetch_add(written / TS_SIZE, std::memory_order_relaxed);
+       pkgCntCam += written / TS_SIZE;
        }
     else {
-       if (retry++ < 3) {
+       trace.Add(teRcvRetry, retry);
+       if (retry++ < adapter.Config().Retries) {
           /* The receive buffer of the adapter is full,
            * so we need to wait a little bit. */
-          cCondWait::SleepMs(SleepTimeout);
+          cCondWait::SleepMs(adapter.Config().SleepTimeout);
           }
        else {
           log(1, "Can't write packet VDR CamSlot for CI adapter " +
               std::string(adapter.DevPath()) + ")");
-          rb.Del( TS_SIZE );
+          rb->Del( TS_SIZE );
+          ++pkgCntCam;
+          trace.Add(teRcvDrop, TS_SIZE);
+          trace.Error(ENOBUFS);
           retry = 0;
           }
        }
@@ -130,57 +214,158 @@ void cTsReceiver::Deliver(void) {
 }
 
 
+int cTsReceiver::DropStale(uint8_t* Data, int Count) {
+  int n = 0;
+  bool done = false;
+  while(!done and (n + TS_SIZE <= Count)) {
+     // resyncs byte by byte, like CheckTsSync()
+     if (Data[n] != TS_SYNC_BYTE) {
+        ++n;
+        continue;
+        }
+     uint32_t e;
+     if (IsClearPacket(Data + n, e)) {
+        n += TS_SIZE;
+        if (e == epoch) {
+           // what the CAM lost since the last marker
+           camLag += int64_t(clearAt - pkgCntCam);
+           done = true;
+           }
+        continue;            // or of an older Clear()
+        }
+     if (pkgCntCam >= clearAt) {
+        /* all stale packets are gone, but the marker didn't come: the CAM
+         * lost it, or doesn't pass null packets. */
+        if (!markersLost++)
+           log(1, "no clear marker from CAM " + devpath +
+               ", stale data is dropped by packet count");
+        done = true;
+        continue;
+        }
+     if (!IsFlushPacket(Data + n))
+        ++pkgCntCam;
+     n += TS_SIZE;
+     }
+  rb->Del(n);
+  dropped += n;
+  if (done)
+     ClearDone();
+  return n;
+}
+
+
+void cTsReceiver::ClearDone(void) {
+  cleared = true;
+  adapter.Trace().Add(teRcvClear, dropped);
+  dropped = 0;
+  adapter.Cleared(epoch);
+}
+
+
+int cTsReceiver::ReadCapture(void) {
+  /* rb.Read() doesn't tell where the data went, so read to a local buffer
+   * while capturing. */
+  uint8_t buf[KILOBYTE(64)];
+
+  int max = rb->Free();
+  if (max > int(sizeof(buf)))
+     max = sizeof(buf);
+  if (max <= 0)
+     return 0;
+
+  int r = safe_read(fd, buf, max);
+  if (r > 0) {
+     adapter.Capture(cdFromCam, buf, r);
+     rb->Put(buf, r);
+     }
+  return r;
+}
+
+
 void cTsReceiver::Action(void) {
   log(3, std::string(__PRETTY_FUNCTION__) + "   " + adapter.DevPath());
 
   cPoller Poller(fd);
+  if (wakeFd != -1)
+     Poller.Add(wakeFd, false);
 
+  rb->SetTimeouts(0, 0);   // the deliver thread waits on deliverWait, see cWakeup
   if (!tsdeliver.Start()) {
      log(1, std::string(__PRETTY_FUNCTION__) +
          ": Couldn't start deliver thread - " + strerror(errno));
      return;
      }
 
-  rb.SetTimeouts(0, SleepTimeout);
+  cTraceRing& trace = adapter.Trace();
   cTimeMs t(DBG_PKG_TMO);
+  unsigned sched = 0;
 
   while(Running()) {
-    if (Poller.Poll(SleepTimeout)) {
+    if (adapter.Holding()) {
+       adapter.Held(true);
+       while(adapter.Holding() and Running())
+          pollWait.Wait(true);
+       adapter.Held(false);
+       }
+    pollWait.SetLimits(adapter.Config().SleepTimeout);
+    adapter.Config().ApplySched(sched);
+
+    bool ready = Poller.Poll(((wakeFd != -1) and adapter.Parked()) ? -1 : pollWait.Timeout());
+    if (!Running())
+       break;
+    if (unparked.exchange(false)) {
+       uint64_t n;
+       if (read(wakeFd, &n, sizeof(n)) < 0) {} // only reset it
+       continue;
+       }
+    trace.Add(teRcvPoll, ready);
+    if (!ready)
+       pollWait.Idle();
+    else {
+       pollWait.Busy();
        errno = 0;
-       int r = rb.Read(fd);
+       int r = adapter.CaptureOrTap() ? ReadCapture() : rb->Read(fd);
        if ((r < 0) && FATALERRNO) {
-          if (errno == EOVERFLOW)
+          if (errno == EOVERFLOW) {
              log(1, std::string(__PRETTY_FUNCTION__) +
                  ": Driver buffer overflow on file " + devpath +
                  ":" + strerror(errno));
+             trace.Add(teRcvOverflow);
+             trace.Error(errno);
+             }
           else {
              log(1, std::string(__PRETTY_FUNCTION__) +
                  ": fatal error on file " + devpath + ":" + strerror(errno));
+             trace.Error(errno);
              break;
              }
           }
        if (r > 0) {
+          trace.Add(teRcvRead, r);
           if (cntRecDbg < CNT_REC_DBG_MAX) {
              ++cntRecDbg;
              log(4, "cTsReceiver for " + devpath + " received data from CAM ###");
              }
           pkgCntW += r / TS_SIZE;
+          deliverWait.Signal();
           }
        }
 
     if (t.TimedOut()) {
-       if ((pkgCntR != pkgCntRL) || (pkgCntW != pkgCntWL)) {
+       uint64_t cntR = pkgCntR.load(std::memory_order_relaxed);
+       if ((cntR != pkgCntRL) || (pkgCntW != pkgCntWL)) {
           log(4, "cTsReceiver for " + devpath +
               " CAM buff wr(CAM ->):" + std::to_string(pkgCntW) +
-              ", rd:" + std::to_string(pkgCntR));
-          pkgCntRL = pkgCntR;
+              ", rd:" + std::to_string(cntR));
+          pkgCntRL = cntR;
           pkgCntWL = pkgCntW;
           }
        t.Set(DBG_PKG_TMO);
        }
     } // while(Running())
 
-  tsdeliver.Cancel(3);
+  if (!adapter.Stopping())
+     tsdeliver.Cancel(3);
   CleanUp();
 
   _leaving;
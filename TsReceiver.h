@@ -21,11 +21,13 @@
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
 #pragma once
+#include <atomic>
 #include <string>
 #include <vdr/thread.h>
 #include <vdr/remux.h>   // TS_SIZE, TS_SYNC_BYTE
 #include <vdr/ringbuffer.h>
 #include "TsDeliver.h"
+#include "Wakeup.h"
 
 /*******************************************************************************
  * forward declarations.
@@ -43,19 +45,32 @@ private:
   cAdapter& adapter;     //< the associated CI adapter
   int fd;                //< adapterX/secY device read file handle
   std::string devpath;   //< adapterX/secY device path
-  cRingBufferLinear rb;  //< the CAM read buffer
-  int pkgCntR;           //< packages read from buffer
-  int pkgCntW;           //< packages written to buffer
-  int pkgCntRL;          //< package read counter last
-  int pkgCntWL;          //< package write counter last
-  bool clear;            //< true, when the buffer shall be cleared
+  cRingBufferLinear* rb; //< the CAM read buffer, replaced by Resize()
+  std::atomic<uint64_t> pkgCntR; //< packages read from buffer
+  uint64_t pkgCntW;      //< packages written to buffer
+  uint64_t pkgCntRL;     //< package read counter last
+  uint64_t pkgCntWL;     //< package write counter last
+  uint32_t epoch;        //< the last cTsSender::Clear() seen by Deliver()
+  bool cleared;          //< true, once the clear marker of epoch came
+  uint64_t pkgCntCam;    //< packets taken from rb, not counting flush packets and markers
+  int64_t camLag;        //< cTsSender::MarkCam() - pkgCntCam at the last marker
+  uint64_t clearAt;      //< pkgCntCam at the marker of epoch, if the CAM lost none
+  int markersLost;       //< clear markers the CAM didn't pass
+  uint64_t dropped;      //< bytes dropped for the current clear
   int retry;             //< number of retries to send a packet
   int cntRecDbg;         //< counter for data debugging
   cDeliver tsdeliver;    //< TS Data deliver thread
+  cWakeup pollWait;      //< only the poll timeout of Action()
+  cWakeup deliverWait;   //< the deliver thread waits here for rb data
+  int wakeFd;            //< eventfd, wakes the poll: for good after Cancel(), once after Unpark()
+  std::atomic<bool> unparked; //< wakeFd is to be reset
   volatile bool started;
 
   void CleanUp(void) { if (fd != -1) { close(fd); fd = -1; } }
 
+  /* rb.Read(fd), but the data is passed to the adapter's capture/tap. */
+  int ReadCapture(void);
+
 public:
   /* Constructor, creates a new CAM TS receiver object.
    * @param Adapter - the associated CAM adapter
@@ -72,6 +87,30 @@ public:
   virtual void Action(void);
   void Cancel(int waitSec = 0);
 
-  void Clear(void) { clear = true; }
+  /* wakes the receiver and the deliver thread, if parked, see
+   * cAdapter::Parked(). */
+  void Unpark(void);
+
+  /* cAdapter::Resize(), with both threads held: a new receive buffer of
+   * Packets. What is left in the old one is dropped. */
+  void Resize(int Packets);
+
+  /* packets handed to the CAM slot so far */
+  uint64_t Delivered(void) { return pkgCntR.load(std::memory_order_relaxed); }
+
+  /* true, once this thread and the deliver thread ended. */
+  bool Stopped(void) { return !Active() and !tsdeliver.Active(); }
+
+  /* The deliver thread. The CAM output is dropped up to the clear marker,
+   * see cTsSender::Clear(). */
   void Deliver(void);
+
+  /* Deliver(), while dropping stale data: deletes rb data up to and with
+   * the clear marker of epoch. Without the marker, it stops at clearAt:
+   * packets the CAM lost since the last marker are made up by the same
+   * number of new ones then. Returns the bytes deleted. */
+  int DropStale(uint8_t* Data, int Count);
+
+  /* the stale data is gone: syncs the bypass and the CAM slot buffer. */
+  void ClearDone(void);
 };
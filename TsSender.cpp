@@ -20,13 +20,20 @@
  * You should have received a copy of the GNU General Public License
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
+#include <algorithm>
+#include <vector>
 #include <vdr/tools.h>
 #include "TsSender.h"
 #include "Common.h"
 #include "CiAdapter.h"
 #include "Logging.h"
 
-extern int SleepTimeout;
+extern bool CamBypass;
+extern bool StripNull;
+extern bool CamDedup;
+
+static const int FLUSH_PACKETS = 64;   // packets written by one idle flush
+static const int FLUSH_BURSTS  = 8;    // max idle flushes in a row
 static const int CNT_SND_DBG_MAX = 100;
 
 
@@ -36,11 +43,15 @@ static const int CNT_SND_DBG_MAX = 100;
 
 cTsSender::cTsSender(cAdapter& Adapter, int sec_fdw, std::string& sec) :
    cThread(), adapter(Adapter), fd(sec_fdw), devpath(sec),
-   rb(BufferSize(), TS_SIZE, DebugBuffers, "CAM cTsSender"),
-   pkgCntR(0), pkgCntW(0), pkgCntRL(0), pkgCntWL(0), clear(false), cntSndDbg(0),
+   rb(new cRingBufferLinear(BufferSize(Adapter.BufSize()), TS_SIZE, DebugBuffers, "CAM cTsSender")),
+   wake(Adapter.Config().SleepTimeout),
+   pkgCntR(0), pkgCntW(0), pkgCntRL(0), pkgCntWL(0), nullStripped(0), flushBursts(FLUSH_BURSTS),
+   flushRequest(0),
+   epoch(0), acked(0), clearMark(0), dropUntil(0), pkgCntCam(0), markCam(0), cntSndDbg(0),
    started(false)
 {
   // don't use adapter in this function, unless you know what you are doing!
+  memset(uniqData, false, sizeof(uniqData));
 
   SetDescription("cTsSender %s", devpath.c_str());
   log(3, std::string(__FUNCTION__) + "   " + devpath);
@@ -52,6 +63,7 @@ cTsSender::~cTsSender(void) {
 
   Cancel(3);
   CleanUp();
+  delete rb;
 
   _leaving;
 }
@@ -72,21 +84,37 @@ bool cTsSender::Start(void) {
 void cTsSender::Cancel(int waitSec) {
   _entering;
 
+  /* Running() turns false before the wakeup, a parked thread may wait
+   * without timeout. */
+  cThread::Cancel(-1);
+  wake.Signal();
   cThread::Cancel(waitSec);
 
   _leaving;
 }
 
 
-int cTsSender::Write(const uint8_t* Data, int Count) {
+int cTsSender::Write(const uint8_t* Data, int Count, int SubSlot) {
   cMutexLock MutexLockW(&mutex);
 
-  int free = rb.Free();
+  if (cGovernor::Measuring()) {
+     int n = adapter.Governor().Admit(SubSlot, Data, Count - Count % TS_SIZE, rb->Free(), rb->Size());
+     if (n < Count)
+        adapter.Trace().Add(teGovRefuse, (SubSlot << 24) | (Count - n));
+     Count = n;
+     }
+
+  if (CamBypass or StripNull or (CamDedup and SubSlot))
+     return WriteFiltered(Data, Count, SubSlot);
+
+  int free = rb->Free();
   if (free > Count)
      free = Count;
   free -= free % TS_SIZE;  // only whole TS frames must be written
   if (free > 0)
-     PutAndCheck(Data, free);
+     PutAndCheck(Data, free, SubSlot);
+  if (free < Count)
+     adapter.Trace().Add(teSndFull, Count - free);
 
   return free;
 }
@@ -98,23 +126,119 @@ bool cTsSender::WriteAll(const uint8_t* Data, int Count) {
   if (Count % TS_SIZE)    // have to be a multiple of TS_SIZE
      return false;
 
-  if (rb.Free() < Count)  // all the packets need to be written at once
+  if (rb->Free() < Count) { // all the packets need to be written at once
+     adapter.Trace().Add(teSndFull, Count);
      return false;
+     }
 
   return PutAndCheck(Data, Count);
 }
 
 
 
-bool cTsSender::PutAndCheck(const uint8_t* Data, int& Count) {
+bool cTsSender::IsNull(const uint8_t* Packet, int SubSlot) {
+  int pid = TsPid(Packet);
+  if (!SubSlot)
+     return pid == 0x1FFF;
+
+  /* VDR's MTD maps the null PID to a unique one like any other PID, which
+   * one isn't known here. A unique PID is taken for the null PID as long as
+   * it carries stuffing only; once it carried data, never again. */
+  if (uniqData[pid])
+     return false;
+  if (IsStuffingPacket(Packet))
+     return true;
+  uniqData[pid] = true;
+  return false;
+}
+
+
+int cTsSender::WriteFiltered(const uint8_t* Data, int Count, int SubSlot) {
+  cBypass& bypass = adapter.Bypass();
+  cDedup& dedup = adapter.Dedup();
+  int done = 0;     // bytes consumed
+  int run = 0;      // bytes to the CAM, not yet written
+  int bypassed = 0;
+  int stripped = 0;
+  int shared = 0;
+
+  /* a run of packets to the CAM, returns false if not all were taken */
+  auto PutRun = [&]() -> bool {
+     int free = rb->Free();
+     free -= free % TS_SIZE;
+     int n = (run < free) ? run : free;
+     if (n > 0)
+        PutAndCheck(Data + done, n, SubSlot);
+     done += n;
+     if (n < run)
+        adapter.Trace().Add(teSndFull, run - n);
+     bool all = (n == run);
+     run = 0;
+     return all;
+     };
+
+  Count -= Count % TS_SIZE;
+  for(int i = 0; i < Count; i += TS_SIZE) {
+     /* Null packets are consumed, but neither sent nor bypassed: VDR
+      * doesn't need them back. */
+     if (StripNull and IsNull(Data + i, SubSlot)) {
+        if (run and !PutRun())
+           break;
+        done += TS_SIZE;
+        ++stripped;
+        continue;
+        }
+     // its copy comes back with the one of another sub slot.
+     if (CamDedup and dedup.Shared(Data + i, SubSlot)) {
+        if (run and !PutRun())
+           break;
+        done += TS_SIZE;
+        ++shared;
+        continue;
+        }
+     if (!CamBypass or !bypass.Bypassable(Data + i)) {
+        run += TS_SIZE;
+        continue;
+        }
+     if (run and !PutRun())
+        break;
+     if (!bypass.Put(Data + i)) {
+        adapter.Trace().Add(teSndFull, Count - done);
+        break;
+        }
+     done += TS_SIZE;
+     ++bypassed;
+     }
+  if (run)
+     PutRun();
+
+  if (bypassed)
+     adapter.Trace().Add(teBypass, bypassed);
+  if (stripped) {
+     adapter.Trace().Add(teSndNull, stripped);
+     nullStripped += stripped;
+     }
+  if (shared)
+     adapter.Trace().Add(teDedup, shared);
+  return done;
+}
+
+
+bool cTsSender::PutAndCheck(const uint8_t* Data, int& Count, int SubSlot) {
   bool ret = true;
 
-  int written = rb.Put(Data, Count);
-  pkgCntW += written / TS_SIZE;
+  int written = rb->Put(Data, Count);
+  pkgCntW.fetch_add(written / TS_SIZE, std::memory_order_relaxed);
+  if (written > 0)
+     wake.Signal();
+  adapter.Bypass().Sent(written / TS_SIZE, SubSlot);
+  if (CamDedup)
+     adapter.Dedup().Sent(Data, written, SubSlot);
   if (written != Count) {
      log(1, std::string(__PRETTY_FUNCTION__) +
          ": Couldn't write previously checked free data ?!? - " +
          strerror(errno));
+     adapter.Trace().Error(errno);
      ret = false;
      }
 
@@ -124,43 +248,163 @@ bool cTsSender::PutAndCheck(const uint8_t* Data, int& Count) {
 
 
 
+void cTsSender::IdleFlush(int IdleFlushMs) {
+  if ((flushBursts >= FLUSH_BURSTS) or (lastWrite.Elapsed() < uint64_t(IdleFlushMs)))
+     return;
+  if (flushBursts) {
+     // again, if none of the last ones came back yet.
+     if ((lastFlush.Elapsed() < uint64_t(IdleFlushMs)) or
+         (adapter.FlushPendingCount() < flushBursts * FLUSH_PACKETS))
+        return;
+     }
+  ++flushBursts;
+  lastFlush.Set();
+  WriteFlush(FLUSH_PACKETS);
+}
+
+
+int cTsSender::WriteFlush(int Packets) {
+  /* Written directly, rb is empty now and we are the only writer of fd.
+   * Not counted as sent for the bypass, as they aren't counted as
+   * received when stripped. */
+  static const std::vector<uint8_t> buf = []() {
+     std::vector<uint8_t> b(FLUSH_PACKETS * TS_SIZE);
+     for(int i = 0; i < FLUSH_PACKETS; i++)
+        MakeFlushPacket(b.data() + i * TS_SIZE);
+     return b;
+     }();
+
+  Packets = std::min(Packets, FLUSH_PACKETS);
+  adapter.FlushSent(Packets);
+  int sleepTimeout = adapter.Config().SleepTimeout;
+  int w = WriteAllOrNothing(fd, buf.data(), Packets * TS_SIZE, 5 * sleepTimeout, sleepTimeout);
+  adapter.Trace().Add(teSndFlush, w);
+  if (w < Packets * TS_SIZE) {
+     adapter.FlushStripped(Packets - (w > 0 ? w / TS_SIZE : 0));
+     if (w < 0)
+        log(1, "couldn't write flush packets to CAM " + devpath + ": " + strerror(errno));
+     }
+  return w;
+}
+
+
+void cTsSender::Clear(void) {
+  cMutexLock MutexLockW(&mutex);
+
+  // no writer between the mark and the new epoch, see ApplyClear().
+  clearMark.store(pkgCntW.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  adapter.Bypass().Drop();
+  epoch.fetch_add(1, std::memory_order_release);
+  wake.Signal();
+}
+
+
+void cTsSender::ApplyClear(uint32_t Epoch) {
+  uint64_t mark = clearMark.load(std::memory_order_relaxed);
+
+  // the rest of the stale packets never reaches the CAM.
+  if (pkgCntR < mark)
+     dropUntil = mark;
+
+  /* Everything written until now is stale, as Action() checks the epoch
+   * right before each write: the marker goes behind it. If it can't be
+   * written or the CAM loses it, the deliver thread stops dropping after
+   * markCam packets. */
+  uint8_t marker[TS_SIZE];
+  MakeClearPacket(marker, Epoch);
+  int sleepTimeout = adapter.Config().SleepTimeout;
+  if (WriteAllOrNothing(fd, marker, TS_SIZE, 5 * sleepTimeout, sleepTimeout) != TS_SIZE)
+     log(1, "couldn't write clear marker to CAM " + devpath + ": " + strerror(errno));
+  markCam.store(pkgCntCam, std::memory_order_relaxed);
+  acked.store(Epoch, std::memory_order_release);
+  cntSndDbg = 0;
+  adapter.Trace().Add(teSndClear, dropUntil > pkgCntR ? dropUntil - pkgCntR : 0);
+}
+
+
+bool cTsSender::Resize(int Packets) {
+  cMutexLock MutexLockW(&mutex);
+
+  if (rb->Available() or adapter.Bypass().Pending())
+     return false;
+  delete rb;
+  rb = new cRingBufferLinear(BufferSize(Packets), TS_SIZE, DebugBuffers, "CAM cTsSender");
+  rb->SetTimeouts(0, 0);
+  // no Put() to the bypass without our mutex.
+  adapter.Bypass().Resize(Packets);
+  return true;
+}
+
+
 void cTsSender::Action(void) {
   log(3, std::string(__PRETTY_FUNCTION__) + "     " + adapter.DevPath());
 
-  const int run_check_tmo = SleepTimeout;
-
-  rb.SetTimeouts(0, run_check_tmo);
+  cTraceRing& trace = adapter.Trace();
+  rb->SetTimeouts(0, 0);   // we wait on 'wake' instead, see cWakeup
   cTimeMs t(DBG_PKG_TMO);
+  unsigned sched = 0;
 
   while(Running()) {
-     if (clear) {
-        rb.Clear();
-        pkgCntW = 0;
-        pkgCntR = 0;
-        clear = false;
-        cntSndDbg = 0;
+     if (adapter.Holding()) {
+        adapter.Held(true);
+        while(adapter.Holding() and Running())
+           wake.Wait(true);
+        adapter.Held(false);
         }
+     const int run_check_tmo = adapter.Config().SleepTimeout;
+     const int idleFlushMs = adapter.Config().IdleFlush;
+     wake.SetLimits(run_check_tmo, idleFlushMs ? std::min(idleFlushMs, IDLE_TIMEOUT_MS) : IDLE_TIMEOUT_MS);
+     adapter.Config().ApplySched(sched);
+
+     uint32_t e = epoch.load(std::memory_order_acquire);
+     if (e != acked.load(std::memory_order_relaxed))
+        ApplyClear(e);
 
      int cnt = 0;
-     uint8_t* data = rb.Get(cnt);
+     uint8_t* data = rb->Get(cnt);
+     trace.Add(teSndGet, data ? cnt : 0);
      if (data && cnt >= TS_SIZE) {
+        wake.Busy();
         int skipped;
         uint8_t* frame = CheckTsSync(data, cnt, skipped);
         if (skipped) {
            log(1, "skipped " + std::to_string(skipped) +
                " bytes to sync on start of TS packet: " + strerror(errno));
-           rb.Del(skipped);
+           trace.Add(teSyncSkip, skipped);
+           trace.Error(errno);
+           rb->Del(skipped);
            }
 
         int len = cnt - skipped;
         len -= (len % TS_SIZE);     // only whole TS frames must be written
+        int chunk = adapter.Config().Chunk;
+        if (chunk and (len > chunk * TS_SIZE))
+           len = chunk * TS_SIZE;   // a Clear() waits for one chunk at most
+        if ((len >= TS_SIZE) and (pkgCntR < dropUntil)) {
+           int n = std::min(uint64_t(len / TS_SIZE), dropUntil - pkgCntR);
+           rb->Del(n * TS_SIZE);
+           trace.Add(teSndDel, n * TS_SIZE);
+           pkgCntR += n;
+           continue;
+           }
         if (len >= TS_SIZE) {
+           /* a Clear() since the top of the loop: these packets may be
+            * stale or not, ApplyClear() decides. After this check, all of
+            * them were put before any new Clear(), they are stale then. */
+           if (epoch.load(std::memory_order_acquire) != acked.load(std::memory_order_relaxed))
+              continue;
+           bool measure = cGovernor::Measuring();
+           uint64_t t0 = measure ? cTraceRing::Now() : 0;
            int w = WriteAllOrNothing(fd, frame, len, 5 * run_check_tmo, run_check_tmo);
+           trace.Add(teSndWrite, w);
+           if (measure and (w > 0))
+              adapter.Governor().Written(w, cTraceRing::Now() - t0);
            if (w >= 0) {
               int remain = len - w;
               if (remain > 0) {
                  log(1, "couldn't write all data to CAM " + devpath +
                      ": " + strerror(errno));
+                 trace.Error(errno);
                  len -= remain;
                  }
               if (cntSndDbg < CNT_SND_DBG_MAX) {
@@ -170,20 +414,45 @@ void cTsSender::Action(void) {
               }
            else {
               log(1, "couldn't write to CAM " + devpath + ":" + strerror(errno));
+              trace.Error(errno);
               break;
               }
-           rb.Del(w);
+           if (w > 0)
+              adapter.Capture(cdToCam, frame, w);
+           rb->Del(w);
+           trace.Add(teSndDel, w);
            pkgCntR += w / TS_SIZE;
+           pkgCntCam += w / TS_SIZE;
+           if (w > 0) {
+              if (adapter.Zap().Tracking())
+                 adapter.Zap().Sent(frame, w);
+              lastWrite.Set();
+              flushBursts = 0;
+              }
            }
         }
+     else if (flushRequest > 0) {
+        int n = std::min(flushRequest.load(), FLUSH_PACKETS);
+        WriteFlush(n);
+        flushRequest -= n;
+        }
+     else {
+        if (idleFlushMs)
+           IdleFlush(idleFlushMs);
+        wake.Wait(adapter.Parked());
+        }
 
      if (t.TimedOut()) {
-        if ((pkgCntR != pkgCntRL) || (pkgCntW != pkgCntWL)) {
+        uint64_t cntW = pkgCntW.load(std::memory_order_relaxed);
+        if ((pkgCntR != pkgCntRL) || (cntW != pkgCntWL)) {
            log(4, "cTsSender for " + devpath +
                " CAM buff rd(-> CAM):" + std::to_string(pkgCntR) +
-               ", wr:" + std::to_string(pkgCntW));
+               ", wr:" + std::to_string(cntW) +
+               ", null stripped:" + std::to_string(nullStripped) +
+               (CamDedup ? ", shared:" + std::to_string(adapter.Dedup().Shares()) +
+                           ", copies lost:" + std::to_string(adapter.Dedup().Losses()) : ""));
            pkgCntRL = pkgCntR;
-           pkgCntWL = pkgCntW;
+           pkgCntWL = cntW;
            }
         t.Set(DBG_PKG_TMO);
         }
@@ -21,10 +21,12 @@
  * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
  ******************************************************************************/
 #pragma once
+#include <atomic>             /* std::atomic */
 #include <string>             /* std::string */
 #include <unistd.h>           /* close() */
 #include <vdr/thread.h>       /* cThread */
 #include <vdr/ringbuffer.h>   /* cRingBufferLinear */
+#include "Wakeup.h"           /* cWakeup */
 
 /*******************************************************************************
  * forward declarations.
@@ -43,14 +45,28 @@ private:
   cAdapter& adapter;     //< the associated CI adapter
   int fd;                //< adapterX/secY fd write
   std::string devpath;   //< adapterX/secY device path
-  cRingBufferLinear rb;  //< the send buffer
+  cRingBufferLinear* rb; //< the send buffer, replaced by Resize()
   cMutex mutex;          //< The synchronization mutex for rb write access
-  int pkgCntR;           //< package read counter
-  int pkgCntW;           //< package write counter
-  int pkgCntRL;          //< package read counter last
-  int pkgCntWL;          //< package write counter last
+  cWakeup wake;          //< the sender thread waits here for rb data
+  uint64_t pkgCntR;      //< package read counter, never reset
+  std::atomic<uint64_t> pkgCntW; //< package write counter, never reset
+  uint64_t pkgCntRL;     //< package read counter last
+  uint64_t pkgCntWL;     //< package write counter last
+  uint64_t nullStripped; //< null packets not sent to the CAM
+  bool uniqData[0x2000]; //< unique PIDs seen with data: not the null PID of a sub slot
+  cTimeMs lastWrite;     //< last data written to the CAM
+  cTimeMs lastFlush;     //< last idle flush written to the CAM
+  int flushBursts;       //< idle flushes since lastWrite
+  std::atomic<int> flushRequest; //< flush packets asked for by Flush()
+
+  /* the clear protocol, see Clear() */
+  std::atomic<uint32_t> epoch;      //< Clear() requests
+  std::atomic<uint32_t> acked;      //< the last epoch applied by Action()
+  std::atomic<uint64_t> clearMark;  //< pkgCntW at the last Clear()
+  uint64_t dropUntil;    //< Action() drops rb packets up to this pkgCntR
+  uint64_t pkgCntCam;    //< packets of rb written to the CAM, never reset
+  std::atomic<uint64_t> markCam;    //< pkgCntCam at the clear marker of acked
 
-  bool clear;            //< true, when the buffer shall be cleared
   int cntSndDbg;         //< counter for data debugging
   volatile bool started;
 
@@ -61,7 +77,30 @@ private:
    * count will be set to the real written data size.
    * Returns false, if not count bytes could be written.
    */
-  bool PutAndCheck(const uint8_t* Data, int& Count);
+  bool PutAndCheck(const uint8_t* Data, int& Count, int SubSlot = 0);
+
+  /* Write(), with null packets stripped (StripNull), unscrambled packets
+   * going to the adapter's bypass (CamBypass) and packets on the way for
+   * another sub slot consumed (CamDedup). */
+  int WriteFiltered(const uint8_t* Data, int Count, int SubSlot);
+
+  /* true, if Packet of SubSlot is a null packet, see uniqData. */
+  bool IsNull(const uint8_t* Packet, int SubSlot);
+
+  /* Writes null packets to the CAM, if nothing was written for IdleFlushMs:
+   * the CAM emits decrypted packets only while new ones are pushed in.
+   * Repeated every IdleFlushMs until the first of them comes back, as the
+   * CAM may hold more packets than one burst. */
+  void IdleFlush(int IdleFlushMs);
+
+  /* writes Packets, at most FLUSH_PACKETS, flush packets directly to the
+   * CAM. Returns the bytes written or -1. */
+  int WriteFlush(int Packets);
+
+  /* Action() found a new Clear() request: drops the stale packets still in
+   * rb and writes the clear marker of Epoch behind the stale data in the
+   * CAM. */
+  void ApplyClear(uint32_t Epoch);
 
 public:
   /* Constructor, creates a new CAM TS send buffer.
@@ -79,17 +118,51 @@ public:
   virtual void Action(void);
   void Cancel(int waitSec = 0);
 
-  void Clear(void) { clear = true; }
+  /* Drops everything written until now, in rb, on the way through the CAM
+   * and in the CAM slot. Only takes the writer mutex, no thread waits:
+   * the sender thread applies it at its next packet boundary, the deliver
+   * thread drops the CAM output up to the clear marker and calls
+   * cAdapter::Cleared(), which syncs the bypass and the CAM slot buffer.
+   * Nothing written after Clear() is lost, nothing written before leaks.
+   * If the CAM loses the marker, the deliver thread stops dropping after
+   * the packets written before it, see MarkCam().
+   */
+  void Clear(void);
+
+  /* cAdapter::Resize(), with the TS threads held: a new send buffer and
+   * bypass of Packets. false, if the old ones aren't empty. */
+  bool Resize(int Packets);
+
+  /* the clear protocol, see Clear(): the last requested epoch, the last one
+   * applied by the sender thread, whose marker is written, and the packets
+   * written until the last Clear(). */
+  uint32_t Epoch(void)     { return epoch.load(std::memory_order_acquire); }
+  uint32_t Acked(void)     { return acked.load(std::memory_order_acquire); }
+  uint64_t ClearMark(void) { return clearMark.load(std::memory_order_relaxed); }
+  /* the packets written to the CAM before the marker of Acked(), not
+   * counting flush packets and markers. Read after Acked(). */
+  uint64_t MarkCam(void)   { return markCam.load(std::memory_order_relaxed); }
 
   std::string DevPath(void) { return devpath; }
 
+  /* wakes the sender thread, if parked, see cAdapter::Parked(). */
+  void Unpark(void) { wake.Signal(); }
+
+  /* cAdapter::Calibrate(): writes Packets flush packets to the CAM, as
+   * fast as it takes them, once the send buffer is empty. */
+  void Flush(int Packets) { flushRequest += Packets; wake.Signal(); }
+
+  uint64_t NullStripped(void) { return nullStripped; }
+
   /* Write as most of the given data to the send buffer.
    * This function is thread save for multiple writers.
    * @param data the data to send
    * @param count the length of the data (have to be a multiple of TS_SIZE!)
+   * @param subslot the MTD sub slot of the data, 0 without MTD; used by
+   *        the governor (CamGovernor) and the fan-out (CamDedup)
    * @return the number of bytes actually written
    */
-  int Write(const uint8_t* Data, int Count);
+  int Write(const uint8_t* Data, int Count, int SubSlot = 0);
 
   /* Write *all* or *nothing* of the given data to the send buffer.
    * This function is thread save for multiple writers.
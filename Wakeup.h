@@ -0,0 +1,80 @@
+/*******************************************************************************
+ * @file Wakeup.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <algorithm>
+#include <vdr/thread.h>
+
+/*******************************************************************************
+ * The wait of a TS thread for its next data, with adaptive timeouts.
+ *
+ * The ring buffers only wake up a waiting reader once they are filled by
+ * 10%, so a trickle of data used to wait for the full SleepTimeout. Here the
+ * writer calls Signal() for each chunk it put: while data flows, the thread
+ * wakes up at once. The timeout is only left for the periodic work of the
+ * thread; it starts at MinMs (SleepTimeout) and each round without data
+ * doubles it up to MaxMs, so an idle adapter rarely wakes up. Data brings
+ * it back to MinMs. While no slot of the adapter decrypts, the thread is
+ * parked: it waits without timeout, until the next Signal().
+ ******************************************************************************/
+static const int IDLE_TIMEOUT_MS = 1000;   //< the longest timeout of an idle thread
+
+class cWakeup {
+private:
+  cCondWait cond;
+  int minMs;
+  int maxMs;
+  int timeout;
+
+public:
+  cWakeup(int MinMs, int MaxMs = IDLE_TIMEOUT_MS) :
+     minMs(std::min(MinMs, MaxMs)), maxMs(MaxMs), timeout(minMs) {}
+
+  /* any thread: new data or something else to do. A Signal() while the
+   * thread doesn't wait isn't lost, its next Wait() returns at once. */
+  void Signal(void) { cond.Signal(); }
+
+  /* the thread: new limits, f.i. after SVDRP CONF sleeptimer. */
+  void SetLimits(int MinMs, int MaxMs = IDLE_TIMEOUT_MS) {
+     maxMs = MaxMs;
+     minMs = std::min(MinMs, maxMs);
+     timeout = std::min(timeout, maxMs);
+     }
+
+  /* the thread: data came, back to the short timeout. */
+  void Busy(void) { timeout = minMs; }
+
+  /* the thread: a round without data, doubles the timeout. */
+  void Idle(void) { timeout = std::min(2 * timeout, maxMs); }
+
+  /* the thread: the current timeout in ms. */
+  int Timeout(void) { return timeout; }
+
+  /* the thread: sleeps until Signal() or Timeout(), if Park until
+   * Signal() only. A timeout counts as an idle round. */
+  bool Wait(bool Park = false) {
+     if (cond.Wait(Park ? 0 : timeout))   // 0: no timeout
+        return true;
+     if (!Park)
+        Idle();
+     return false;
+     }
+};
@@ -0,0 +1,261 @@
+/*******************************************************************************
+ * @file ZapTimer.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstring>
+#include <vdr/remux.h>
+#include "ZapTimer.h"
+#include "Trace.h"
+
+static const uint8_t CA_PMT_TAG[3]        = { 0x9F, 0x80, 0x32 };  // ca_pmt APDU
+static const uint8_t CPCI_OK_DESCRAMBLING = 0x01;                // ca_pmt_cmd_id
+
+static const char* STEP_NAMES[zsCount] = { "start", "CA PMT", "sent", "read", "clear" };
+
+
+/*******************************************************************************
+ * class cZapTimer
+ ******************************************************************************/
+cZapTimer::cZapTimer(void) :
+  tracking(false), program(-1), when(0), zaps(0), timeouts(0), sum(0), min(0), max(0)
+{
+  for(auto& s:stamp)
+     s = 0;
+  for(auto& p:pids)
+     p = 0;
+}
+
+
+void cZapTimer::Begin(eZapStep Step, uint64_t Now) {
+  if (tracking.load(std::memory_order_acquire))
+     return;
+
+  cMutexLock MutexLock(&mutex);
+  if (tracking.load(std::memory_order_relaxed))
+     return;   // the other thread was first
+  for(auto& s:stamp)
+     s.store(0, std::memory_order_relaxed);
+  for(auto& p:pids)
+     p.store(0, std::memory_order_relaxed);
+  program = -1;
+  when = time(nullptr);
+  stamp[Step].store(Now, std::memory_order_relaxed);
+  tracking.store(true, std::memory_order_release);
+}
+
+
+void cZapTimer::Stamp(eZapStep Step) {
+  uint64_t expected = 0;
+  stamp[Step].compare_exchange_strong(expected, cTraceRing::Now(), std::memory_order_relaxed);
+}
+
+
+bool cZapTimer::Match(const uint8_t* Data, int Count, bool Clear) {
+  for(int i = 0; i + TS_SIZE <= Count; i += TS_SIZE) {
+     const uint8_t* ts = Data + i;
+     if (Clear and (TsIsScrambled(ts) or !TsHasPayload(ts)))
+        continue;
+     int pid = TsPid(ts);
+     if (pids[pid / 32].load(std::memory_order_relaxed) & (1U << (pid % 32)))
+        return true;
+     }
+  return false;
+}
+
+
+void cZapTimer::Start(void) {
+  Begin(zsStart, cTraceRing::Now());
+}
+
+
+int cZapTimer::CaPmt(const uint8_t* Tpdu, int Length) {
+  const uint8_t* apdu = static_cast<const uint8_t*>(memmem(Tpdu, Length, CA_PMT_TAG, sizeof(CA_PMT_TAG)));
+  if (!apdu)
+     return -1;
+
+  // the APDU length field, ASN.1
+  const uint8_t* end = Tpdu + Length;
+  const uint8_t* p = apdu + sizeof(CA_PMT_TAG);
+  if (p >= end)
+     return -1;
+  int len = *p++;
+  if (len & 0x80) {
+     int n = len & 0x7F;
+     for(len = 0; (n-- > 0) and (p < end); p++)
+        len = (len << 8) | *p;
+     }
+  if (end - p > len)
+     end = p + len;
+  if (end - p < 6)
+     return -1;
+
+  /* ca_pmt_list_management, program_number, version, program_info_length,
+   * ca_pmt_cmd_id if there are descriptors, then the elementary streams:
+   * stream_type, elementary_PID, ES_info_length, ca_pmt_cmd_id ... */
+  int number = (p[1] << 8) | p[2];
+  int infoLength = ((p[4] & 0x0F) << 8) | p[5];
+  bool descramble = (infoLength > 0) and (p + 6 < end) and (p[6] == CPCI_OK_DESCRAMBLING);
+  uint32_t found[0x2000 / 32] = { 0 };
+  bool any = false;
+  for(p += 6 + infoLength; p + 5 <= end; ) {
+     int pid = ((p[1] & 0x1F) << 8) | p[2];
+     int esLength = ((p[3] & 0x0F) << 8) | p[4];
+     if ((esLength > 0) and (p + 5 < end) and (p[5] == CPCI_OK_DESCRAMBLING))
+        descramble = true;
+     found[pid / 32] |= 1U << (pid % 32);
+     any = true;
+     p += 5 + esLength;
+     }
+  if (!descramble or !any)
+     return -1;
+
+  uint64_t now = cTraceRing::Now();
+  Begin(zsCaPmt, now);
+  uint64_t expected = 0;
+  stamp[zsCaPmt].compare_exchange_strong(expected, now, std::memory_order_relaxed);
+  int none = -1;
+  program.compare_exchange_strong(none, number, std::memory_order_relaxed);
+  for(size_t i = 0; i < sizeof(found) / sizeof(found[0]); i++)
+     if (found[i])
+        pids[i].fetch_or(found[i], std::memory_order_release);
+  return number;
+}
+
+
+void cZapTimer::Sent(const uint8_t* Data, int Count) {
+  if (stamp[zsCaPmt].load(std::memory_order_acquire) and !stamp[zsSent].load(std::memory_order_relaxed) and
+      Match(Data, Count, false))
+     Stamp(zsSent);
+}
+
+
+void cZapTimer::Received(const uint8_t* Data, int Count) {
+  if (stamp[zsCaPmt].load(std::memory_order_acquire) and !stamp[zsRead].load(std::memory_order_relaxed) and
+      Match(Data, Count, false))
+     Stamp(zsRead);
+}
+
+
+bool cZapTimer::Delivered(const uint8_t* Data, int Count) {
+  if (!stamp[zsCaPmt].load(std::memory_order_acquire) or stamp[zsClear].load(std::memory_order_relaxed) or
+      !Match(Data, Count, true))
+     return false;
+  Stamp(zsClear);
+  Finish(false);
+  return true;
+}
+
+
+bool cZapTimer::TimedOut(void) {
+  if (!tracking.load(std::memory_order_acquire))
+     return false;
+  uint64_t first = stamp[zsStart] ? stamp[zsStart] : stamp[zsCaPmt];
+  if (cTraceRing::Now() - first < uint64_t(ZAP_TIMEOUT_MS) * 1000000)
+     return false;
+  return Finish(true);
+}
+
+
+bool cZapTimer::Finish(bool TimedOut) {
+  cMutexLock MutexLock(&mutex);
+  if (!tracking.load(std::memory_order_relaxed))
+     return false;
+
+  tTimeline t;
+  t.when = when;
+  t.program = program;
+  t.timedOut = TimedOut;
+  uint64_t first = stamp[zsStart] ? stamp[zsStart] : stamp[zsCaPmt];
+  for(int i = 0; i < zsCount; i++) {
+     uint64_t s = stamp[i];
+     t.step[i] = s ? s - first : NO_STEP;
+     }
+  if (TimedOut)
+     ++timeouts;
+  else {
+     uint64_t total = t.step[zsClear];
+     if (!zaps or (total < min))
+        min = total;
+     if (total > max)
+        max = total;
+     sum += total;
+     ++zaps;
+     }
+  history.push_front(t);
+  if (history.size() > ZAP_HISTORY)
+     history.pop_back();
+  tracking.store(false, std::memory_order_release);
+  return true;
+}
+
+
+std::string cZapTimer::Text(const tTimeline& Timeline) {
+  char buf[16];
+  struct tm tm;
+  strftime(buf, sizeof(buf), "%H:%M:%S", localtime_r(&Timeline.when, &tm));
+  std::string s = std::string(buf) + " program " +
+                  (Timeline.program < 0 ? "?" : std::to_string(Timeline.program)) + ":";
+  for(int i = 0; i < zsCount; i++) {
+     s += std::string(i ? ", " : " ") + STEP_NAMES[i] + " ";
+     if (Timeline.step[i] == NO_STEP)
+        s += "-";
+     else
+        s += std::to_string(Timeline.step[i] / 1000000);
+     }
+  s += " ms";
+  if (Timeline.timedOut)
+     s += ", nothing decrypted";
+  return s;
+}
+
+
+std::string cZapTimer::Last(void) {
+  cMutexLock MutexLock(&mutex);
+  return history.empty() ? "" : Text(history.front());
+}
+
+
+uint32_t cZapTimer::LastUs(void) {
+  cMutexLock MutexLock(&mutex);
+  if (history.empty() or (history.front().step[zsClear] == NO_STEP))
+     return 0;
+  const tTimeline& t = history.front();
+  uint64_t from = t.step[zsCaPmt] == NO_STEP ? 0 : t.step[zsCaPmt];
+  return (t.step[zsClear] - from) / 1000;
+}
+
+
+void cZapTimer::Totals(int& Zaps, uint64_t& Ns) {
+  cMutexLock MutexLock(&mutex);
+  Zaps = zaps;
+  Ns = sum;
+}
+
+
+std::string cZapTimer::Stats(int Timelines) {
+  cMutexLock MutexLock(&mutex);
+  std::string s = std::to_string(zaps) + " zaps, " + std::to_string(timeouts) + " without decrypted packet";
+  if (zaps)
+     s += ", zap time min/avg/max " + std::to_string(min / 1000000) + "/" +
+          std::to_string(sum / zaps / 1000000) + "/" + std::to_string(max / 1000000) + " ms";
+  for(int i = 0; (i < Timelines) and (i < int(history.size())); i++)
+     s += "\n  " + Text(history[i]);
+  return s;
+}
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ * @file ZapTimer.h @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <atomic>
+#include <deque>
+#include <string>
+#include <cstdint>
+#include <ctime>
+#include <vdr/thread.h>
+
+/*******************************************************************************
+ * Zap time instrumentation: where the time goes from StartDecrypting() to
+ * the first decrypted packet handed to VDR, which dominates the zap time of
+ * an encrypted channel.
+ *
+ * A zap starts with StartDecrypting() or a CA PMT, whichever comes first.
+ * The CI thread parses each TPDU it writes; a CA PMT with ca_pmt_cmd_id
+ * ok_descrambling adds its elementary PIDs. The next steps are stamped by
+ * the first packet of one of these PIDs: written to the CAM, read back from
+ * the CAM and returned unscrambled by Decrypt() or to MtdPutData(). The
+ * steps are stamped lock free by the thread seeing them first; the TS
+ * threads check Tracking() only, as long as no zap runs.
+ *
+ * Finished zaps go to the statistics and the last ZAP_HISTORY timelines.
+ ******************************************************************************/
+static const int ZAP_TIMEOUT_MS = 10000;   // give up without decrypted packet
+static const int ZAP_HISTORY    = 16;      // timelines kept
+
+enum eZapStep { zsStart, zsCaPmt, zsSent, zsRead, zsClear, zsCount };
+static const uint64_t NO_STEP = UINT64_MAX;  // tTimeline::step not reached
+
+class cZapTimer {
+private:
+  struct tTimeline {
+     time_t   when;                          //< wall clock of the first step
+     uint64_t step[zsCount];                 //< ns since the first step, or NO_STEP
+     int      program;                       //< of the first CA PMT, -1: none
+     bool     timedOut;
+     };
+  std::atomic<bool> tracking;                //< a zap runs
+  std::atomic<uint64_t> stamp[zsCount];      //< cTraceRing::Now(), 0: not yet
+  std::atomic<uint32_t> pids[0x2000 / 32];   //< the elementary PIDs of the CA PMTs
+  std::atomic<int> program;                  //< of the first CA PMT
+  time_t when;                               //< wall clock of the start
+  cMutex mutex;                              //< protects the following
+  std::deque<tTimeline> history;             //< the last ZAP_HISTORY zaps, newest first
+  int zaps;                                  //< finished with a decrypted packet
+  int timeouts;                              //< finished without
+  uint64_t sum, min, max;                    //< of the finished zaps in ns
+
+  /* starts a zap at Now, if none runs. */
+  void Begin(eZapStep Step, uint64_t Now);
+  /* stamps Step, if it is the first one. */
+  void Stamp(eZapStep Step);
+  /* true, if one of the packets is of the zap's PIDs */
+  bool Match(const uint8_t* Data, int Count, bool Clear);
+  /* the zap is over: to the statistics and the history. false, if
+   * another thread finished it already. */
+  bool Finish(bool TimedOut);
+  static std::string Text(const tTimeline& Timeline);
+
+public:
+  cZapTimer(void);
+
+  /* StartDecrypting() of the CAM slot. */
+  void Start(void);
+
+  /* the CI thread: Tpdu was written to the CAM. Returns the program number,
+   * if it is a CA PMT to descramble, -1 otherwise. */
+  int CaPmt(const uint8_t* Tpdu, int Length);
+
+  /* the TS threads call the following only while Tracking(). */
+  bool Tracking(void) { return tracking.load(std::memory_order_relaxed); }
+
+  /* the sender thread: Data was written to the CAM. */
+  void Sent(const uint8_t* Data, int Count);
+
+  /* the deliver thread: Data was read from the CAM. */
+  void Received(const uint8_t* Data, int Count);
+
+  /* Data is handed to VDR, by Decrypt() or to MtdPutData(). true, if the
+   * zap is over now; the caller logs Last(). */
+  bool Delivered(const uint8_t* Data, int Count);
+
+  /* the CI thread: true once, if nothing was decrypted within
+   * ZAP_TIMEOUT_MS. */
+  bool TimedOut(void);
+
+  /* the last zap as text, and its time from the CA PMT (or the start) to
+   * the first decrypted packet in us */
+  std::string Last(void);
+  uint32_t LastUs(void);
+
+  /* the zaps finished with a decrypted packet and their sum in ns */
+  void Totals(int& Zaps, uint64_t& Ns);
+
+  /* statistics and the last Timelines zaps, newest first, as text */
+  std::string Stats(int Timelines);
+};
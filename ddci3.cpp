@@ -29,11 +29,15 @@
 #include <sys/ioctl.h>
 #include <linux/dvb/ca.h>
 #include "CiAdapter.h"
+#include "CamSim.h"
+#include "CamPool.h"
+#include "Profiles.h"
 #include "Logging.h"
 #include "FileList.h"
 
 static const char *VERSION = "2021.01.23_15h27";
 static const char *DESCRIPTION = "Digital Devices CI-Adapter";
+static const int SHUTDOWN_TIMEOUT = 3000; // ms, for all threads of all adapters
 
 int  LogLevel           = 2;      // 1 = error, 2 = info, 3 = debug, 4 = debug + debugBuffers
 bool LogToSyslog        = true;   // true: log to syslog, false: log to /var/log/ddci3.log
@@ -42,6 +46,21 @@ int  BufSize            = 1500;   // in multiple of 188 bytes, 1500..10000
 bool DebugBuffers       = false;  // debug RingBuffer sizes
 bool ClearScramblingBit = false;  // clear the scambling control bit before packet is send to VDR
 int  SleepTimeout       = 100;    // CAM receive/send/deliver thread sleep timer in ms, 100..1000
+std::string TraceDir    = "/tmp"; // directory for trace ring dumps
+bool TraceOn            = true;   // hot path events go to the trace ring of each adapter
+std::string ProfilesFile;         // adapter profiles, empty: adapters.conf in the config directory
+int  SimAdapters        = 0;      // number of simulated CI adapters, 0..8
+tCamSimParams SimParams;          // behaviour of the simulated CAMs
+bool CamBypass          = false;  // unscrambled packets bypass the CAM
+bool StripNull          = false;  // null packets are not sent to the CAM
+int  IdleFlushMs        = 0;      // idle time before null packets push out the CAM, 0 = off
+bool CamGovernor        = false;  // CAM bandwidth by priority of the MTD sub slots
+int  AdmissionPct       = 0;      // max CAM load in % of its throughput for new services, 0 = off
+bool CamBalance         = false;  // new services go to the least loaded CAM of a group
+bool CamDedup           = false;  // MTD sub slots share the decryption of the same packets
+int  RecoverPct         = 0;      // % of a service still scrambled after the CAM to recover it, 0 = off
+int  RecoverSec         = 5;      // for this time in s
+bool CalibrateCams      = false;  // measure the CAMs when ready, derive bufsz and chunk
 
 
 
@@ -65,7 +84,10 @@ public:
 
   virtual bool Initialize(void);
   virtual bool Start(void);
-  virtual void Stop(void)   { for(auto a:adapters) a->Cancel(3); }
+  virtual void Stop(void);
+
+  virtual const char** SVDRPHelpPages(void);
+  virtual cString SVDRPCommand(const char* Command, const char* Option, int& ReplyCode);
 };
 
 
@@ -128,6 +150,15 @@ bool cPluginDDCI3::Find(void) {
         }
      }
 
+  for(int i = 0; i < SimAdapters; i++) {
+     caDevice caDev;
+     new cCamSim(i, SimParams, caDev);   // cAdapter takes the ownership
+     if (caDev.Sim) {
+        log(2, "simulating " + caDev.ca);
+        caDevices.push_back(caDev);
+        }
+     }
+
   _leaving;
   return caDevices.size() > 0;
 }
@@ -150,16 +181,38 @@ bool cPluginDDCI3::Start(void) {
   if (IgnoreActiveFlag)     log(2, "Ignore-active-flag activated");
   if (ClearScramblingBit)   log(2, "Clear scrambling control bit activated");
   if (DebugBuffers)         log(2, "debug RingBuffer sizes");
-
+  if (TraceDir != "/tmp")   log(2, "trace dumps go to " + TraceDir);
+  if (!TraceOn)             log(2, "trace ring off");
+  if (CamBypass)            log(2, "unscrambled packets bypass the CAM");
+  if (StripNull)            log(2, "null packets are stripped");
+  if (IdleFlushMs)          log(2, "idle flush after " + std::to_string(IdleFlushMs) + "ms");
+  if (CamGovernor)          log(2, "CAM bandwidth governor activated");
+  if (AdmissionPct)         log(2, "admission control at " + std::to_string(AdmissionPct) + "% CAM load");
+  if (CamBalance)           log(2, "load balancing between CAMs activated");
+  if (CamDedup)             log(2, "decrypt once for MTD sub slots activated");
+  if (RecoverPct)           log(2, "recover services " + std::to_string(RecoverPct) + "% scrambled for " +
+                                   std::to_string(RecoverSec) + "s");
+  if (CalibrateCams)        log(2, "CAM calibration activated");
+
+
+  std::string profiles = ProfilesFile;
+  if (profiles.empty())
+     profiles = std::string(ConfigDirectory(PLUGIN_NAME_I18N)) + "/adapters.conf";
+  if (!cProfiles::Load(profiles))
+     log(ProfilesFile.empty() ? 3 : 1, "Couldn't read adapter profiles " + profiles);
 
   std::sort(caDevices.begin(), caDevices.end(),
       [](caDevice a, caDevice b) -> bool { return a.sec.compare(b.sec); });
 
   for(auto d:caDevices) {
      log(2, "-- new CI Adapter " + d.ca + " --");
-     adapters.push_back(new cAdapter(d));
+     std::string profile = cProfiles::Settings(d.ca);
+     if (!profile.empty())
+        log(2, "profile " + profile);
+     adapters.push_back(new cAdapter(d, profile));
      log(2, "------------------------------------------");
-     cCondWait::SleepMs(2500);
+     if (!d.Sim)
+        cCondWait::SleepMs(2500);
      }
 
   caDevices.clear();
@@ -169,6 +222,37 @@ bool cPluginDDCI3::Start(void) {
 }
 
 
+/*******************************************************************************
+ * Tells all threads of all adapters to end at once, then waits for them
+ * together: the shutdown takes as long as the slowest thread, at most
+ * SHUTDOWN_TIMEOUT, no matter how many adapters there are.
+ ******************************************************************************/
+void cPluginDDCI3::Stop(void) {
+  for(auto a:adapters)
+     a->Shutdown();
+
+  cTimeMs timeout(SHUTDOWN_TIMEOUT);
+  auto Stopped = [this]() -> bool {
+     for(auto a:adapters)
+        if (!a->Stopped())
+           return false;
+     return true;
+     };
+  while(!Stopped() and !timeout.TimedOut())
+     cCondWait::SleepMs(10);
+
+  for(auto a:adapters) {
+     if (!a->Stopped()) {
+        log(1, "threads of " + a->DevPath() + " won't end (waited " +
+            std::to_string(SHUTDOWN_TIMEOUT) + " ms) - canceling them...");
+        a->Shutdown(true);
+        }
+     }
+  log(3, "stopped " + std::to_string(adapters.size()) + " adapters in " +
+      std::to_string(timeout.Elapsed()) + " ms");
+}
+
+
 bool cPluginDDCI3::ProcessArgs(int argc, char* argv[]) {
   static struct option long_options[] = {
      { "ignact"       , no_argument      , NULL, 'A' },
@@ -178,6 +262,21 @@ bool cPluginDDCI3::ProcessArgs(int argc, char* argv[]) {
      { "local"        , required_argument, NULL, 'L' },
      { "sleeptimer"   , required_argument, NULL, 't' },
      { "debug-buffers", no_argument      , NULL, 129 },
+     { "trace-dir"    , required_argument, NULL, 130 },
+     { "simulate"     , required_argument, NULL, 131 },
+     { "sim-param"    , required_argument, NULL, 132 },
+     { "bypass"       , no_argument      , NULL, 133 },
+     { "strip-null"   , no_argument      , NULL, 134 },
+     { "idle-flush"   , required_argument, NULL, 135 },
+     { "governor"     , no_argument      , NULL, 136 },
+     { "admission"    , required_argument, NULL, 137 },
+     { "balance"      , no_argument      , NULL, 138 },
+     { "dedup"        , no_argument      , NULL, 139 },
+     { "recover"      , required_argument, NULL, 140 },
+     { "recover-time" , required_argument, NULL, 141 },
+     { "profiles"     , required_argument, NULL, 142 },
+     { "calibrate"    , no_argument      , NULL, 143 },
+     { "no-trace"     , no_argument      , NULL, 144 },
      { NULL           , no_argument      , NULL,  0  }};
 
   int c;
@@ -215,6 +314,74 @@ bool cPluginDDCI3::ProcessArgs(int argc, char* argv[]) {
         case 129:
            DebugBuffers = true;
            break;
+        case 130:
+           TraceDir = optarg;
+           break;
+        case 131:
+           if ((sscanf(optarg, "%d", &SimAdapters) < 1) or
+                 (SimAdapters < 0) or (SimAdapters > 8)) {
+              std::cerr << "Invalid number of simulated adapters" << std::endl;
+              return false;
+              }
+           break;
+        case 132:
+           if (!cCamSim::ParseParams(optarg, SimParams)) {
+              std::cerr << "Invalid simulator parameters" << std::endl;
+              return false;
+              }
+           break;
+        case 133:
+           CamBypass = true;
+           break;
+        case 134:
+           StripNull = true;
+           break;
+        case 135:
+           if ((sscanf(optarg, "%d", &IdleFlushMs) < 1) or (IdleFlushMs < 0) or
+                 (IdleFlushMs > 5000) or (IdleFlushMs and (IdleFlushMs < 10))) {
+              std::cerr << "Invalid idle flush time" << std::endl;
+              return false;
+              }
+           break;
+        case 136:
+           CamGovernor = true;
+           break;
+        case 137:
+           if ((sscanf(optarg, "%d", &AdmissionPct) < 1) or (AdmissionPct < 0) or
+                 (AdmissionPct > 100) or (AdmissionPct and (AdmissionPct < 50))) {
+              std::cerr << "Invalid admission percentage" << std::endl;
+              return false;
+              }
+           break;
+        case 138:
+           CamBalance = true;
+           break;
+        case 139:
+           CamDedup = true;
+           break;
+        case 140:
+           if ((sscanf(optarg, "%d", &RecoverPct) < 1) or (RecoverPct < 0) or
+                 (RecoverPct > 100)) {
+              std::cerr << "Invalid recover percentage" << std::endl;
+              return false;
+              }
+           break;
+        case 141:
+           if ((sscanf(optarg, "%d", &RecoverSec) < 1) or (RecoverSec < 2) or
+                 (RecoverSec > 60)) {
+              std::cerr << "Invalid recover time" << std::endl;
+              return false;
+              }
+           break;
+        case 142:
+           ProfilesFile = optarg;
+           break;
+        case 143:
+           CalibrateCams = true;
+           break;
+        case 144:
+           TraceOn = false;
+           break;
         default:
            std::cerr << "Unknown option found" << std::endl;
            return false;
@@ -232,14 +399,217 @@ const char* cPluginDDCI3::CommandLineHelp(void) {
      "                      default: 1500, max: 10000\n"
      "  -c, --clrsct        clear the scambling control bit before the\n"
      "                      packet is send to VDR\n"
+     "      --bypass        unscrambled PES packets, PAT, SI and null packets\n"
+     "                      bypass the CAM and are merged back in order\n"
+     "      --strip-null    don't send null packets (PID 0x1FFF) to the CAM\n"
+     "      --idle-flush    push the packets out of the CAM with null packets,\n"
+     "                      if nothing was sent for this time in ms,\n"
+     "                      default: 0 = off, 10..5000\n"
+     "      --governor      if the CAM can't keep up, MTD sub slots get its\n"
+     "                      bandwidth in the order of their VDR priority\n"
+     "      --admission     refuse new services to VDR, if the CAM load would\n"
+     "                      exceed this % of the measured CAM throughput,\n"
+     "                      default: 0 = off, 50..100\n"
+     "      --balance       new services go to the least loaded of the CAMs\n"
+     "                      with the same CA system ids\n"
+     "      --dedup         the same scrambled packets of two MTD sub slots\n"
+     "                      are decrypted once and copied to both\n"
+     "      --recover       send the CA PMT again, then reset the CAM, if this %\n"
+     "                      of a service stays scrambled after the CAM,\n"
+     "                      default: 0 = off, 1..100\n"
+     "      --recover-time  for this time in s, default: 5, 2..60\n"
+     "      --profiles      file with settings per CI adapter or CAM, default:\n"
+     "                      adapters.conf in the plugin's config directory\n"
+     "      --calibrate     measure throughput, round trip and buffering of\n"
+     "                      each CAM once it's ready, with null packets, and\n"
+     "                      set bufsz and chunk from it, unless a profile does\n"
      "      --debug-buffers debug RingBuffer sizes\n"      
      "  -l, --loglevel      0/1/2/3 log nothing/error/info/debug\n"
      "  -L, --local         log to /var/log/ddci3.log instead of syslog\n"
      "  -t, --sleeptimer    CAM receive/send/deliver thread sleep timer in ms\n"
      "                      default: 100, max: 1000\n"
+     "      --trace-dir     directory for trace ring dumps, default: /tmp\n"
+     "      --no-trace      don't record the data path in the trace rings\n"
+     "      --simulate      number of simulated CI adapters with CAM (for\n"
+     "                      testing without hardware), default: 0, max: 8\n"
+     "      --sim-param     behaviour of the simulated CAMs, default:\n"
+     "                      delay=10,jitter=0,rate=96000,loss=0,reset=0,scrambled=0,\n"
+     "                      hold=0,nullloss=0 (ms, ms, kbit/s, 1/1000 packets, s,\n"
+     "                      1/1000 packets, packets, 1/1000 null packets)\n"
      ;
 
   return help;
 }
 
+
+const char** cPluginDDCI3::SVDRPHelpPages(void) {
+  static const char* HelpPages[] = {
+     "TRCD\n"
+     "    Dump the trace rings of all CI adapters to the trace directory.\n"
+     "    Decode the files with tools/ddci3-trace.",
+     "CAPT [ ON | OFF ] [ <n> ]\n"
+     "    Start or stop capturing both directions of adapterX/secY of all CI\n"
+     "    adapters, or of CI adapter number n only, to the trace directory.\n"
+     "    Without parameters, the running captures are listed.\n"
+     "    Replay the files with tools/ddci3-replay.",
+     "TAP [ ON | OFF ] [ <n> ]\n"
+     "    Start or stop writing the scrambled stream sent to the CAM and the\n"
+     "    decrypted stream received from the CAM to <name>-pre.ts and\n"
+     "    <name>-post.ts in the trace directory, for all CI adapters or\n"
+     "    CI adapter number n only. Without parameters, the running taps\n"
+     "    are listed.",
+     "GOVS [ <n> ]\n"
+     "    Show the measured CAM throughput and, per MTD sub slot, priority\n"
+     "    and the data offered, admitted and refused by the governor, for\n"
+     "    all CI adapters or CI adapter number n only. See --governor and\n"
+     "    --admission.",
+     "POOL\n"
+     "    Show the CI adapters grouped by the CA system ids of their CAMs,\n"
+     "    with the load the CAM pool compares. See --balance.",
+     "ZAPS [ <n> ]\n"
+     "    Show the zap time statistics and the timelines of the last zaps\n"
+     "    (StartDecrypting, CA PMT, first packet sent to and read from the\n"
+     "    CAM, first decrypted packet to VDR) for all CI adapters or CI\n"
+     "    adapter number n only.",
+     "CONF [ <n> [ <name>=<value> ... ] ]\n"
+     "    Show the settings of all CI adapters or CI adapter number n, with\n"
+     "    the data rate from the CAM and the zap times since the settings\n"
+     "    were changed and before. With name=value pairs, change them for CI\n"
+     "    adapter n, as in adapters.conf: bufsz, sleeptimer, ignact, clrsct,\n"
+     "    idleflush, chunk, retries, nice and cpus. New buffer sizes are\n"
+     "    applied once no slot of the adapter decrypts. With --calibrate,\n"
+     "    the results of the CAM calibration are shown, too.",
+     NULL };
+
+  return HelpPages;
+}
+
+
+cString cPluginDDCI3::SVDRPCommand(const char* Command, const char* Option, int& ReplyCode) {
+  if (strcasecmp(Command, "TRCD") == 0) {
+     if (adapters.empty()) {
+        ReplyCode = 550;
+        return "no CI adapters";
+        }
+     std::string s;
+     for(auto a:adapters) {
+        std::string name = a->DumpTrace();
+        if (name.empty()) {
+           ReplyCode = 550;
+           name = "failed";
+           }
+        s += a->DevPath() + ": " + name + "\n";
+        }
+     s.pop_back();
+     return s.c_str();
+     }
+
+  bool govs = strcasecmp(Command, "GOVS") == 0;
+  if (govs or (strcasecmp(Command, "ZAPS") == 0)) {
+     int n = -1;
+     if (*Option and ((sscanf(Option, "%d", &n) < 1) or (n < 0) or
+         (n >= int(adapters.size())))) {
+        ReplyCode = 501;
+        return "invalid parameter";
+        }
+     std::string s;
+     for(size_t i = 0; i < adapters.size(); i++) {
+        if ((n >= 0) and (size_t(n) != i))
+           continue;
+        s += std::to_string(i) + " " + adapters[i]->DevPath() + ": " +
+             (govs ? adapters[i]->Governor().Stats() : adapters[i]->Zap().Stats(ZAP_HISTORY)) + "\n";
+        }
+     if (s.empty()) {
+        ReplyCode = 550;
+        return "no CI adapters";
+        }
+     s.pop_back();
+     return s.c_str();
+     }
+
+  if (strcasecmp(Command, "CONF") == 0) {
+     int n = -1;
+     int len = 0;
+     if (*Option and ((sscanf(Option, "%d%n", &n, &len) < 1) or (n < 0) or
+         (n >= int(adapters.size())))) {
+        ReplyCode = 501;
+        return "invalid parameter";
+        }
+     std::string settings = Option + len;
+     if (settings.find_first_not_of(' ') != std::string::npos) {
+        std::string error = adapters[n]->Configure(settings);
+        if (!error.empty()) {
+           ReplyCode = 501;
+           return error.c_str();
+           }
+        }
+     std::string s;
+     for(size_t i = 0; i < adapters.size(); i++) {
+        if ((n >= 0) and (size_t(n) != i))
+           continue;
+        s += std::to_string(i) + " " + adapters[i]->DevPath() + ": " +
+             adapters[i]->ConfigStats() + "\n";
+        }
+     if (s.empty()) {
+        ReplyCode = 550;
+        return "no CI adapters";
+        }
+     s.pop_back();
+     return s.c_str();
+     }
+
+  if (strcasecmp(Command, "POOL") == 0) {
+     std::string s = cCamPool::Stats();
+     if (s.empty()) {
+        ReplyCode = 550;
+        return "no CI adapters";
+        }
+     return s.c_str();
+     }
+
+  bool capt = strcasecmp(Command, "CAPT") == 0;
+  if (capt or (strcasecmp(Command, "TAP") == 0)) {
+     char onoff[4] = "";
+     int n = -1;
+     if (*Option and ((sscanf(Option, "%3s %d", onoff, &n) < 1) or
+         (strcasecmp(onoff, "ON") and strcasecmp(onoff, "OFF")) or
+         (n >= int(adapters.size())))) {
+        ReplyCode = 501;
+        return "invalid parameter";
+        }
+     std::string s;
+     for(size_t i = 0; i < adapters.size(); i++) {
+        cAdapter* a = adapters[i];
+        if ((n >= 0) and (size_t(n) != i))
+           continue;
+        std::string name;
+        if (!*onoff) {
+           bool on = capt ? a->Capturing() : a->Tapping();
+           name = on ? "on" : "off";
+           }
+        else if (strcasecmp(onoff, "ON") == 0) {
+           name = capt ? a->StartCapture() : a->StartTap();
+           if (name.empty()) {
+              ReplyCode = 550;
+              name = "failed";
+              }
+           }
+        else {
+           name = capt ? a->StopCapture() : a->StopTap();
+           if (name.empty())
+              name = "off";
+           }
+        s += std::to_string(i) + " " + a->DevPath() + ": " + name + "\n";
+        }
+     if (s.empty()) {
+        ReplyCode = 550;
+        return "no CI adapters";
+        }
+     s.pop_back();
+     return s.c_str();
+     }
+
+  return NULL;
+}
+
 VDRPLUGINCREATOR(cPluginDDCI3); // Don't touch this!
@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * @file stub/Globals.cpp @brief plugin globals for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <string>
+
+/*******************************************************************************
+ * The plugin config variables, defined in ddci3.cpp for the VDR plugin.
+ * Standalone programs may change them before creating any cAdapter.
+ ******************************************************************************/
+int  LogLevel           = 2;      // 1 = error, 2 = info, 3 = debug, 4 = debug + debugBuffers
+bool LogToSyslog        = true;   // true: log to stderr (see stub/tools.cpp), false: /var/log/ddci3.log
+bool IgnoreActiveFlag   = false;  // true: active flag in cCiCamSlot is ignored
+int  BufSize            = 1500;   // in multiple of 188 bytes, 1500..10000
+bool DebugBuffers       = false;  // debug RingBuffer sizes
+bool ClearScramblingBit = false;  // clear the scambling control bit before packet is send to VDR
+int  SleepTimeout       = 100;    // CAM receive/send/deliver thread sleep timer in ms, 100..1000
+std::string TraceDir    = "/tmp"; // directory for trace ring dumps
+bool TraceOn            = true;   // hot path events go to the trace ring of each adapter
+bool CamBypass          = false;  // unscrambled packets bypass the CAM
+bool StripNull          = false;  // null packets are not sent to the CAM
+int  IdleFlushMs        = 0;      // idle time before null packets push out the CAM, 0 = off
+bool CamGovernor        = false;  // CAM bandwidth by priority of the MTD sub slots
+int  AdmissionPct       = 0;      // max CAM load in % of its throughput for new services, 0 = off
+bool CamBalance         = false;  // new services go to the least loaded CAM of a group
+bool CamDedup           = false;  // MTD sub slots share the decryption of the same packets
+int  RecoverPct         = 0;      // % of a service still scrambled after the CAM to recover it, 0 = off
+int  RecoverSec         = 5;      // for this time in s
+bool CalibrateCams      = false;  // measure the CAMs when ready, derive bufsz and chunk
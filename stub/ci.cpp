@@ -0,0 +1,222 @@
+/*******************************************************************************
+ * @file stub/ci.cpp @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "vdr/ci.h"
+#include "vdr/mtd.h"
+#include "vdr/device.h"
+
+cCamSlots CamSlots;
+
+static const int MTD_BUFFER_SIZE = 1000 * TS_SIZE;
+
+
+/*******************************************************************************
+ * class cCiAdapter
+ ******************************************************************************/
+cCiAdapter::cCiAdapter(void) {
+  for(int i = 0; i < MAX_CAM_SLOTS_PER_ADAPTER; i++)
+     camSlots[i] = nullptr;
+}
+
+
+cCiAdapter::~cCiAdapter() {
+  Cancel(3);
+  for(int i = 0; i < MAX_CAM_SLOTS_PER_ADAPTER; i++)
+     delete camSlots[i];
+}
+
+
+void cCiAdapter::AddCamSlot(cCamSlot* CamSlot) {
+  for(int i = 0; i < MAX_CAM_SLOTS_PER_ADAPTER; i++) {
+     if (!camSlots[i]) {
+        CamSlot->slotIndex = i;
+        camSlots[i] = CamSlot;
+        return;
+        }
+     }
+  esyslog("ERROR: no free CAM slot in CI adapter");
+}
+
+
+void cCiAdapter::Action(void) {
+  uint8_t Buffer[2048];
+
+  while(Running())
+     Read(Buffer, sizeof(Buffer));
+}
+
+
+/*******************************************************************************
+ * class cCamSlot
+ ******************************************************************************/
+cCamSlot::cCamSlot(cCiAdapter* CiAdapter, bool WantsTsData, cCamSlot* MasterSlot) :
+  ciAdapter(CiAdapter), masterSlot(MasterSlot), assignedDevice(nullptr),
+  slotIndex(-1), slotNumber(0), priority(0), decrypting(false), mtdAvailable(false),
+  mtdCount(0), mtdNumber(0), nextUniqPid(0), mtdBuffer(nullptr), mtdDelivered(false)
+{
+  for(int i = 0; i < 0x2000; i++)
+     uniqPids[i] = -1;
+  if (ciAdapter)
+     ciAdapter->AddCamSlot(this);
+  if (masterSlot)
+     mtdBuffer = new cRingBufferLinear(MTD_BUFFER_SIZE, TS_SIZE, false, "MTD buffer");
+  CamSlots.Add(this);
+  slotNumber = CamSlots.Count();
+}
+
+
+cCamSlot::~cCamSlot() {
+  CamSlots.Del(this, false);
+  for(int i = 0; i < mtdCount; i++)
+     delete mtdSlots[i];
+  delete mtdBuffer;
+}
+
+
+cCamSlot* cCamSlot::MtdSpawn(void) {
+  cMutexLock MutexLock(&mutex);
+  if (!mtdAvailable || mtdCount >= int(sizeof(mtdSlots) / sizeof(mtdSlots[0])))
+     return nullptr;
+  cCamSlot* s = new cCamSlot(nullptr, true, this);
+  s->mtdNumber = mtdCount + 1;
+  mtdSlots[mtdCount++] = s;
+  return s;
+}
+
+
+int cCamSlot::MtdPutData(uchar* Data, int Count) {
+  int Used = 0;
+
+  while(Count >= TS_SIZE) {
+     int Index = (TsPid(Data) >> UNIQ_PID_SHIFT) - 1;
+     if ((Index >= 0) && (Index < mtdCount)) {
+        if (mtdSlots[Index]->MtdSlotPutData(Data, TS_SIZE) == 0)
+           break;
+        }
+     Data  += TS_SIZE;
+     Count -= TS_SIZE;
+     Used  += TS_SIZE;
+     }
+  return Used;
+}
+
+
+int cCamSlot::MtdSlotPutData(const uchar* Data, int Count) {
+  return mtdBuffer->Put(Data, Count);
+}
+
+
+uchar* cCamSlot::MtdSlotDecrypt(uchar* Data, int& Count) {
+  if (Data && Count >= TS_SIZE) {
+     Count = TS_SIZE;
+     int Pid = TsPid(Data);
+     if (uniqPids[Pid] < 0) {
+        uniqPids[Pid] = (mtdNumber << UNIQ_PID_SHIFT) | (nextUniqPid & UNIQ_PID_MASK);
+        realPids[nextUniqPid++ & UNIQ_PID_MASK] = Pid;
+        }
+     TsSetPid(Data, uniqPids[Pid]);
+     MasterSlot()->Decrypt(Data, Count);
+     if (Count == 0)
+        TsSetPid(Data, Pid); // must restore PID for later retry
+     }
+  else
+     Count = 0;
+
+  if (mtdDelivered) {
+     mtdBuffer->Del(TS_SIZE);
+     mtdDelivered = false;
+     }
+
+  int Cnt = 0;
+  uchar* d = mtdBuffer->Get(Cnt);
+  if (d && (Cnt >= TS_SIZE)) {
+     TsSetPid(d, realPids[TsPid(d) & UNIQ_PID_MASK]);
+     mtdDelivered = true;
+     return d;
+     }
+  return nullptr;
+}
+
+
+bool cCamSlot::Assign(cDevice* Device, bool Query) {
+  // MTD sub slots ask the adapter of their master slot.
+  cCiAdapter* a = MasterSlot()->ciAdapter;
+  if (!a)
+     return false;
+  if (a->Assign(Device, true)) {
+     if (!Query) {
+        a->Assign(Device);
+        assignedDevice = Device;
+        }
+     return true;
+     }
+  return false;
+}
+
+
+const int* cCamSlot::GetCaSystemIds(void) {
+  static const int none[] = { 0 };
+  return none;
+}
+
+
+bool cCamSlot::IsDecrypting(void) {
+  cMutexLock MutexLock(&mutex);
+  if (mtdCount) {
+     for(int i = 0; i < mtdCount; i++) {
+        if (mtdSlots[i]->IsDecrypting())
+           return true;
+        }
+     return false;
+     }
+  return decrypting;
+}
+
+
+bool cCamSlot::Reset(void) {
+  return true;
+}
+
+
+void cCamSlot::StartDecrypting(void) {
+  if (masterSlot)
+     masterSlot->StartDecrypting();
+  decrypting = true;
+}
+
+
+void cCamSlot::StopDecrypting(void) {
+  decrypting = false;
+  if (masterSlot) {
+     if (!masterSlot->IsDecrypting())
+        masterSlot->StopDecrypting();
+     mtdBuffer->Clear();
+     mtdDelivered = false;
+     }
+}
+
+
+uchar* cCamSlot::Decrypt(uchar* Data, int& Count) {
+  if (masterSlot)
+     return MtdSlotDecrypt(Data, Count);
+  Count = 0;
+  return nullptr;
+}
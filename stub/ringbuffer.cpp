@@ -0,0 +1,192 @@
+/*******************************************************************************
+ * @file stub/ringbuffer.cpp @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "vdr/ringbuffer.h"
+
+/*******************************************************************************
+ * class cRingBuffer
+ ******************************************************************************/
+cRingBuffer::cRingBuffer(int Size, bool Statistics) :
+  putTimeout(0), getTimeout(0), size(Size) {}
+
+
+void cRingBuffer::SetTimeouts(int PutTimeout, int GetTimeout) {
+  putTimeout = PutTimeout;
+  getTimeout = GetTimeout;
+}
+
+
+void cRingBuffer::WaitForPut(void) {
+  if (putTimeout) {
+     cMutexLock MutexLock(&mutex);
+     readyForPut.TimedWait(mutex, putTimeout);
+     }
+}
+
+
+void cRingBuffer::WaitForGet(void) {
+  if (getTimeout) {
+     cMutexLock MutexLock(&mutex);
+     readyForGet.TimedWait(mutex, getTimeout);
+     }
+}
+
+
+void cRingBuffer::EnablePut(void) {
+  if (putTimeout && Free() > Size() / 10)
+     readyForPut.Broadcast();
+}
+
+
+void cRingBuffer::EnableGet(void) {
+  if (getTimeout && Available() > Size() / 10)
+     readyForGet.Broadcast();
+}
+
+
+/*******************************************************************************
+ * class cRingBufferLinear
+ ******************************************************************************/
+cRingBufferLinear::cRingBufferLinear(int Size, int Margin, bool Statistics, const char* Description) :
+  cRingBuffer(Size, Statistics), margin(Margin), head(Margin), tail(Margin), gotten(0)
+{
+  buffer = new uchar[Size];
+}
+
+
+cRingBufferLinear::~cRingBufferLinear() {
+  delete[] buffer;
+}
+
+
+int cRingBufferLinear::DataReady(const uchar* Data, int Count) {
+  return Count >= margin ? Count : 0;
+}
+
+
+int cRingBufferLinear::Available(void) {
+  int diff = head - tail;
+  return (diff >= 0) ? diff : Size() + diff - margin;
+}
+
+
+void cRingBufferLinear::Clear(void) {
+  int Head = head;
+  tail = Head;
+  gotten = 0;
+  EnablePut();
+}
+
+
+int cRingBufferLinear::Read(int FileHandle, int Max) {
+  int Tail = tail;
+  int diff = Tail - head;
+  int free = (diff > 0) ? diff - 1 : Size() - head;
+  if (Tail <= margin)
+     free--;
+  int Count = -1;
+  errno = EAGAIN;
+  if (free > 0) {
+     if (0 < Max && Max < free)
+        free = Max;
+     uchar* p = buffer + head;
+     Count = safe_read(FileHandle, p, free);
+     if (Count > 0) {
+        int Head = head + Count;
+        if (Head >= Size())
+           Head = margin;
+        head = Head;
+        }
+     }
+  if (Count > 0)
+     EnableGet();
+  return Count;
+}
+
+
+int cRingBufferLinear::Put(const uchar* Data, int Count) {
+  if (Count > 0) {
+     int Tail = tail;
+     int rest = Size() - head;
+     int diff = Tail - head;
+     int free = ((Tail < margin) ? rest : (diff > 0) ? diff : Size() + diff - margin) - 1;
+     if (free > 0) {
+        if (free < Count)
+           Count = free;
+        if (Count >= rest) {
+           memcpy(buffer + head, Data, rest);
+           if (Count - rest)
+              memcpy(buffer + margin, Data + rest, Count - rest);
+           head = margin + Count - rest;
+           }
+        else {
+           memcpy(buffer + head, Data, Count);
+           head += Count;
+           }
+        }
+     else
+        Count = 0;
+     EnableGet();
+     if (Count == 0)
+        WaitForPut();
+     }
+  return Count;
+}
+
+
+uchar* cRingBufferLinear::Get(int& Count) {
+  int Head = head;
+  int rest = Size() - tail;
+  if (rest < margin && Head < tail) {
+     int t = margin - rest;
+     memcpy(buffer + t, buffer + tail, rest);
+     tail = t;
+     rest = Head - tail;
+     }
+  int diff = Head - tail;
+  int cont = (diff >= 0) ? diff : Size() + diff - margin;
+  if (cont > rest)
+     cont = rest;
+  uchar* p = buffer + tail;
+  if ((cont = DataReady(p, cont)) > 0) {
+     Count = gotten = cont;
+     return p;
+     }
+  WaitForGet();
+  return nullptr;
+}
+
+
+void cRingBufferLinear::Del(int Count) {
+  if (Count > gotten) {
+     esyslog("ERROR: invalid Count in cRingBufferLinear::Del: %d (limited to %d)", Count, gotten);
+     Count = gotten;
+     }
+  if (Count > 0) {
+     int Tail = tail;
+     Tail += Count;
+     gotten -= Count;
+     if (Tail >= Size())
+        Tail = margin;
+     tail = Tail;
+     EnablePut();
+     }
+}
@@ -0,0 +1,296 @@
+/*******************************************************************************
+ * @file stub/thread.cpp @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include "vdr/thread.h"
+#include "vdr/tools.h"
+
+static bool GetAbsTime(struct timespec* Abstime, int MillisecondsFromNow) {
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+     long ns = now.tv_nsec + (MillisecondsFromNow % 1000) * 1000000L;
+     Abstime->tv_sec  = now.tv_sec + MillisecondsFromNow / 1000 + ns / 1000000000L;
+     Abstime->tv_nsec = ns % 1000000000L;
+     return true;
+     }
+  return false;
+}
+
+
+static void InitCond(pthread_cond_t* cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+
+/*******************************************************************************
+ * class cCondWait
+ ******************************************************************************/
+cCondWait::cCondWait(void) : signaled(false) {
+  pthread_mutex_init(&mutex, nullptr);
+  InitCond(&cond);
+}
+
+
+cCondWait::~cCondWait() {
+  pthread_cond_broadcast(&cond); // wake up any sleepers
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+
+void cCondWait::SleepMs(int TimeoutMs) {
+  cCondWait w;
+  w.Wait(TimeoutMs > 3 ? TimeoutMs : 3); // making sure the time is >2ms to avoid a possible busy wait
+}
+
+
+bool cCondWait::Wait(int TimeoutMs) {
+  pthread_mutex_lock(&mutex);
+  if (!signaled) {
+     if (TimeoutMs) {
+        struct timespec abstime;
+        if (GetAbsTime(&abstime, TimeoutMs)) {
+           while(!signaled) {
+              if (pthread_cond_timedwait(&cond, &mutex, &abstime) == ETIMEDOUT)
+                 break;
+              }
+           }
+        }
+     else
+        pthread_cond_wait(&cond, &mutex);
+     }
+  bool r = signaled;
+  signaled = false;
+  pthread_mutex_unlock(&mutex);
+  return r;
+}
+
+
+void cCondWait::Signal(void) {
+  pthread_mutex_lock(&mutex);
+  signaled = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+
+/*******************************************************************************
+ * class cCondVar
+ ******************************************************************************/
+cCondVar::cCondVar(void) {
+  InitCond(&cond);
+}
+
+
+cCondVar::~cCondVar() {
+  pthread_cond_broadcast(&cond); // wake up any sleepers
+  pthread_cond_destroy(&cond);
+}
+
+
+void cCondVar::Wait(cMutex& Mutex) {
+  if (Mutex.locked) {
+     int locked = Mutex.locked;
+     Mutex.locked = 0; // have to clear the locked count here, as pthread_cond_wait
+                       // does an implicit unlock of the mutex
+     pthread_cond_wait(&cond, &Mutex.mutex);
+     Mutex.locked = locked;
+     }
+}
+
+
+bool cCondVar::TimedWait(cMutex& Mutex, int TimeoutMs) {
+  bool r = true; // true = condition signaled, false = timeout
+
+  if (Mutex.locked) {
+     struct timespec abstime;
+     if (GetAbsTime(&abstime, TimeoutMs)) {
+        int locked = Mutex.locked;
+        Mutex.locked = 0; // have to clear the locked count here, as pthread_cond_timedwait
+                          // does an implicit unlock of the mutex.
+        if (pthread_cond_timedwait(&cond, &Mutex.mutex, &abstime) == ETIMEDOUT)
+           r = false;
+        Mutex.locked = locked;
+        }
+     }
+  return r;
+}
+
+
+void cCondVar::Broadcast(void) {
+  pthread_cond_broadcast(&cond);
+}
+
+
+/*******************************************************************************
+ * class cMutex
+ ******************************************************************************/
+cMutex::cMutex(void) : locked(0) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+
+cMutex::~cMutex() {
+  pthread_mutex_destroy(&mutex);
+}
+
+
+void cMutex::Lock(void) {
+  pthread_mutex_lock(&mutex);
+  locked++;
+}
+
+
+void cMutex::Unlock(void) {
+  locked--;
+  pthread_mutex_unlock(&mutex);
+}
+
+
+/*******************************************************************************
+ * class cMutexLock
+ ******************************************************************************/
+cMutexLock::cMutexLock(cMutex* Mutex) : mutex(nullptr), locked(false) {
+  if (Mutex)
+     Lock(Mutex);
+}
+
+
+cMutexLock::~cMutexLock() {
+  if (mutex && locked)
+     mutex->Unlock();
+}
+
+
+bool cMutexLock::Lock(cMutex* Mutex) {
+  if (Mutex && !mutex) {
+     mutex = Mutex;
+     Mutex->Lock();
+     locked = true;
+     return true;
+     }
+  return false;
+}
+
+
+/*******************************************************************************
+ * class cThread
+ ******************************************************************************/
+cThread::cThread(const char* Description, bool LowPriority) :
+  active(false), running(false), childTid(0), description(nullptr)
+{
+  if (Description)
+     SetDescription("%s", Description);
+}
+
+
+cThread::~cThread() {
+  Cancel(); // just in case the derived class didn't call it
+  free(description);
+}
+
+
+void cThread::SetDescription(const char* Description, ...) {
+  free(description);
+  description = nullptr;
+  if (Description) {
+     va_list ap;
+     va_start(ap, Description);
+     if (vasprintf(&description, Description, ap) < 0)
+        description = nullptr;
+     va_end(ap);
+     }
+}
+
+
+void* cThread::StartThread(cThread* Thread) {
+  if (Thread->description) {
+     char name[16];
+     strncpy(name, Thread->description, sizeof(name) - 1);
+     name[sizeof(name) - 1] = 0;
+     pthread_setname_np(pthread_self(), name);
+     }
+  Thread->Action();
+  Thread->running = false;
+  Thread->active = false;
+  return nullptr;
+}
+
+
+bool cThread::Start(void) {
+  if (!running) {
+     if (active) {
+        // Action() has ended, the thread is still alive for a short while
+        }
+     if (!active) {
+        active = running = true;
+        if (pthread_create(&childTid, nullptr, (void *(*) (void *)) &StartThread, (void *) this) == 0) {
+           pthread_detach(childTid); // auto-reap
+           }
+        else {
+           active = running = false;
+           return false;
+           }
+        }
+     }
+  return true;
+}
+
+
+bool cThread::Active(void) {
+  return active;
+}
+
+
+void cThread::Cancel(int WaitSeconds) {
+  running = false;
+  if (active && WaitSeconds > -1) {
+     if (WaitSeconds > 0) {
+        for(time_t t0 = time(nullptr) + WaitSeconds; time(nullptr) < t0; ) {
+           if (!Active())
+              return;
+           cCondWait::SleepMs(10);
+           }
+        esyslog("ERROR: %s thread won't end (waited %d seconds) - canceling it...",
+                description ? description : "", WaitSeconds);
+        }
+     pthread_cancel(childTid);
+     childTid = 0;
+     active = false;
+     }
+}
+
+
+pid_t cThread::ThreadId(void) {
+  return syscall(__NR_gettid);
+}
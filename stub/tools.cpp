@@ -0,0 +1,214 @@
+/*******************************************************************************
+ * @file stub/tools.cpp @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <stdarg.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "vdr/tools.h"
+#include "vdr/thread.h"
+
+/*******************************************************************************
+ * logging: stderr instead of syslog.
+ ******************************************************************************/
+void syslog_with_tid(int priority, const char* format, ...) {
+  va_list ap;
+  char fmt[256];
+  snprintf(fmt, sizeof(fmt), "[%d] %s\n", cThread::ThreadId(), format);
+  va_start(ap, format);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+
+/*******************************************************************************
+ * file IO
+ ******************************************************************************/
+ssize_t safe_read(int filedes, void* buffer, size_t size) {
+  for(;;) {
+     ssize_t p = read(filedes, buffer, size);
+     if (p < 0 && errno == EINTR)
+        continue;
+     return p;
+     }
+}
+
+
+ssize_t safe_write(int filedes, const void* buffer, size_t size) {
+  ssize_t p = 0;
+  ssize_t written = size;
+  const unsigned char* ptr = (const unsigned char*) buffer;
+  while(size > 0) {
+     p = write(filedes, ptr, size);
+     if (p < 0) {
+        if (errno == EINTR)
+           continue;
+        break;
+        }
+     ptr  += p;
+     size -= p;
+     }
+  return p < 0 ? p : written;
+}
+
+
+int WriteAllOrNothing(int fd, const uchar* Data, int Length, int TimeoutMs, int RetryMs) {
+  int written = 0;
+  while(Length > 0) {
+     int w = write(fd, Data + written, Length);
+     if (w > 0) {
+        Length  -= w;
+        written += w;
+        }
+     else if (written > 0 && !FATALERRNO) {
+        // we've started writing, so we must finish it!
+        cTimeMs t;
+        cPoller Poller(fd, true);
+        Poller.Poll(RetryMs);
+        if (TimeoutMs > 0 && (TimeoutMs -= t.Elapsed()) <= 0)
+           break;
+        }
+     else
+        // nothing written yet (or fatal error), so we can just return the error code:
+        return w;
+     }
+  return written;
+}
+
+
+/*******************************************************************************
+ * class cTimeMs
+ ******************************************************************************/
+cTimeMs::cTimeMs(int Ms) {
+  if (Ms >= 0)
+     Set(Ms);
+  else
+     begin = 0;
+}
+
+
+uint64_t cTimeMs::Now(void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t(tp.tv_sec)) * 1000 + tp.tv_nsec / 1000000;
+}
+
+
+void cTimeMs::Set(int Ms) {
+  begin = Now() + Ms;
+}
+
+
+bool cTimeMs::TimedOut(void) const {
+  return Now() >= begin;
+}
+
+
+uint64_t cTimeMs::Elapsed(void) const {
+  return Now() - begin;
+}
+
+
+/*******************************************************************************
+ * class cPoller
+ ******************************************************************************/
+cPoller::cPoller(int FileHandle, bool Out) : numFileHandles(0) {
+  Add(FileHandle, Out);
+}
+
+
+bool cPoller::Add(int FileHandle, bool Out) {
+  if (FileHandle >= 0) {
+     for(int i = 0; i < numFileHandles; i++) {
+        if (pfd[i].fd == FileHandle && pfd[i].events == (Out ? POLLOUT : POLLIN))
+           return true;
+        }
+     if (numFileHandles < MAXPOLLFDS) {
+        pfd[numFileHandles].fd = FileHandle;
+        pfd[numFileHandles].events = Out ? POLLOUT : POLLIN;
+        pfd[numFileHandles].revents = 0;
+        numFileHandles++;
+        return true;
+        }
+     esyslog("ERROR: too many file handles in cPoller");
+     }
+  return false;
+}
+
+
+void cPoller::Del(int FileHandle, bool Out) {
+  for(int i = 0; i < numFileHandles; i++) {
+     if (pfd[i].fd == FileHandle && pfd[i].events == (Out ? POLLOUT : POLLIN)) {
+        if (i < numFileHandles - 1)
+           memmove(&pfd[i], &pfd[i + 1], (numFileHandles - i - 1) * sizeof(pollfd));
+        numFileHandles--;
+        }
+     }
+}
+
+
+bool cPoller::Poll(int TimeoutMs) {
+  if (numFileHandles) {
+     if (poll(pfd, numFileHandles, TimeoutMs) != 0)
+        return true; // returns true even in case of an error, to let the caller
+                     // access the file and thus see the error code
+     }
+  return false;
+}
+
+
+/*******************************************************************************
+ * class cListObject, cListBase
+ ******************************************************************************/
+void cListObject::Append(cListObject* Object) {
+  next = Object;
+  Object->prev = this;
+}
+
+
+void cListObject::Unlink(void) {
+  if (next)
+     next->prev = prev;
+  if (prev)
+     prev->next = next;
+  next = prev = nullptr;
+}
+
+
+void cListBase::Add(cListObject* Object) {
+  if (lastObject)
+     lastObject->Append(Object);
+  else
+     objects = Object;
+  lastObject = Object;
+  count++;
+}
+
+
+void cListBase::Del(cListObject* Object, bool DeleteObject) {
+  if (Object == objects)
+     objects = Object->Next();
+  if (Object == lastObject)
+     lastObject = Object->Prev();
+  Object->Unlink();
+  if (DeleteObject)
+     delete Object;
+  count--;
+}
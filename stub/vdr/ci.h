@@ -0,0 +1,123 @@
+/*******************************************************************************
+ * @file stub/vdr/ci.h @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include "thread.h"
+#include "tools.h"
+#include "ringbuffer.h"
+#include "remux.h"
+
+/*******************************************************************************
+ * The parts of <vdr/ci.h> used by the plugin core.
+ *
+ * There is no CI protocol here: cCiAdapter::Action() only keeps calling
+ * Read(), so the adapter's CI thread runs like in VDR. The MTD part mimics
+ * cMtdHandler: sub slots get unique PIDs (sub slot number in the upper bits,
+ * UNIQ_PID_SHIFT), MtdPutData() routes the CAM output back by those bits.
+ ******************************************************************************/
+
+#define MAX_CAM_SLOTS_PER_ADAPTER 16
+#define CAM_READ_TIMEOUT          50 // ms
+
+enum eModuleStatus { msReset = -1, msNone, msPresent, msReady };
+
+class cDevice;
+class cChannel;
+class cMtdMapper;
+class cCamSlot;
+
+
+class cCiAdapter : public cThread {
+  friend class cCamSlot;
+private:
+  cCamSlot* camSlots[MAX_CAM_SLOTS_PER_ADAPTER];
+  void AddCamSlot(cCamSlot* CamSlot);
+protected:
+  virtual void Action(void);
+  virtual int Read(uint8_t* Buffer, int MaxLength) { return 0; }
+  virtual void Write(const uint8_t* Buffer, int Length) {}
+  virtual bool Reset(int Slot) { return false; }
+  virtual eModuleStatus ModuleStatus(int Slot) { return msNone; }
+  virtual bool Assign(cDevice* Device, bool Query = false) { return false; }
+public:
+  cCiAdapter(void);
+  virtual ~cCiAdapter();
+  virtual bool Ready(void) { return true; }
+};
+
+
+class cCamSlot : public cListObject {
+  friend class cCiAdapter;
+private:
+  cMutex mutex;
+  cCiAdapter* ciAdapter;
+  cCamSlot* masterSlot;
+  cDevice* assignedDevice;
+  int slotIndex;
+  int slotNumber;
+  int priority;
+  bool decrypting;
+  bool mtdAvailable;
+  cCamSlot* mtdSlots[15];       // sub slot numbers 1..15 in the unique PIDs
+  int mtdCount;
+  // MTD sub slot only:
+  int mtdNumber;
+  int uniqPids[0x2000];
+  int realPids[0x01FF + 1];     // UNIQ_PID_MASK + 1
+  int nextUniqPid;
+  cRingBufferLinear* mtdBuffer;
+  bool mtdDelivered;
+  int MtdSlotPutData(const uchar* Data, int Count);
+  uchar* MtdSlotDecrypt(uchar* Data, int& Count);
+protected:
+  virtual const int* GetCaSystemIds(void);
+  void MtdEnable(void) { mtdAvailable = true; }
+  int MtdPutData(uchar* Data, int Count);
+public:
+  cCamSlot(cCiAdapter* CiAdapter, bool WantsTsData = false, cCamSlot* MasterSlot = nullptr);
+  virtual ~cCamSlot();
+  bool IsMasterSlot(void) { return !masterSlot; }
+  cCamSlot* MasterSlot(void) { return masterSlot ? masterSlot : this; }
+  cCamSlot* MtdSpawn(void);
+  bool MtdAvailable(void) { return mtdAvailable; }
+  bool MtdActive(void) { return mtdCount > 0; }
+  int SlotIndex(void) { return slotIndex; }
+  int SlotNumber(void) { return slotNumber; }
+  bool Assign(cDevice* Device, bool Query = false);
+  cDevice* Device(void) { return assignedDevice; }
+  virtual bool Ready(void) { return true; }
+  virtual eModuleStatus ModuleStatus(void) { return msReady; }
+  virtual const char* GetCamName(void) { return "stub CAM"; }
+  int Priority(void) { return priority; }
+  virtual bool IsDecrypting(void);
+  virtual bool Reset(void);
+  virtual void SetPid(int Pid, bool Active) {}
+  virtual bool CanDecrypt(const cChannel* Channel, cMtdMapper* MtdMapper = nullptr) { return true; }
+  virtual void StartDecrypting(void);
+  virtual void StopDecrypting(void);
+  virtual uchar* Decrypt(uchar* Data, int& Count);
+  virtual bool Inject(uchar* Data, int Count) { return false; }
+};
+
+
+class cCamSlots : public cList<cCamSlot> {};
+
+extern cCamSlots CamSlots;
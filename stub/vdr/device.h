@@ -0,0 +1,40 @@
+/*******************************************************************************
+ * @file stub/vdr/device.h @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include "ci.h"
+
+#define MAXDEVICES 16
+
+/*******************************************************************************
+ * The parts of <vdr/device.h> used by the plugin core.
+ ******************************************************************************/
+class cDevice {
+private:
+  int number;
+public:
+  cDevice(int Number = 0) : number(Number) {}
+  virtual ~cDevice() {}
+  int DeviceNumber(void) const { return number; }
+  int CardIndex(void) const { return number; }
+protected:
+  bool HasPid(int Pid) const { return false; }   // no receivers here
+};
@@ -0,0 +1,32 @@
+/*******************************************************************************
+ * @file stub/vdr/mtd.h @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include "ci.h"
+#include "remux.h"
+
+/*******************************************************************************
+ * The parts of <vdr/mtd.h> used by the plugin core: an MTD sub slot number
+ * is in the upper bits of the unique PIDs of its sub slot.
+ ******************************************************************************/
+
+#define UNIQ_PID_MASK  0x01FF
+#define UNIQ_PID_SHIFT 9
@@ -0,0 +1,57 @@
+/*******************************************************************************
+ * @file stub/vdr/remux.h @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include "tools.h"
+
+/*******************************************************************************
+ * The TS packet helpers of <vdr/remux.h> used by the plugin core.
+ ******************************************************************************/
+
+#define TS_SYNC_BYTE          0x47
+#define TS_SIZE               188
+#define TS_ERROR              0x80
+#define TS_PAYLOAD_START      0x40
+#define TS_TRANSPORT_PRIORITY 0x20
+#define TS_PID_MASK_HI        0x1F
+#define TS_SCRAMBLING_CONTROL 0xC0
+#define TS_ADAPT_FIELD_EXISTS 0x20
+#define TS_PAYLOAD_EXISTS     0x10
+#define TS_CONT_CNT_MASK      0x0F
+
+#define PATPID 0x0000
+#define CATPID 0x0001
+
+#define MAXPID 0x2000 // for arrays that use a PID as the index
+
+inline bool TsHasPayload(const uchar* p)     { return p[3] & TS_PAYLOAD_EXISTS; }
+inline bool TsHasAdaptationField(const uchar* p) { return p[3] & TS_ADAPT_FIELD_EXISTS; }
+inline bool TsPayloadStart(const uchar* p)   { return p[1] & TS_PAYLOAD_START; }
+inline bool TsError(const uchar* p)          { return p[1] & TS_ERROR; }
+inline int  TsPid(const uchar* p)            { return (p[1] & TS_PID_MASK_HI) * 256 + p[2]; }
+inline void TsSetPid(uchar* p, int Pid)      { p[1] = (p[1] & ~TS_PID_MASK_HI) | ((Pid >> 8) & TS_PID_MASK_HI); p[2] = Pid & 0x00FF; }
+inline bool TsIsScrambled(const uchar* p)    { return p[3] & TS_SCRAMBLING_CONTROL; }
+inline uchar TsContinuityCounter(const uchar* p) { return p[3] & TS_CONT_CNT_MASK; }
+
+inline int TsPayloadOffset(const uchar* p) {
+  int o = TsHasAdaptationField(p) ? p[4] + 5 : 4;
+  return o <= TS_SIZE ? o : TS_SIZE;
+}
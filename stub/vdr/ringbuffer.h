@@ -0,0 +1,75 @@
+/*******************************************************************************
+ * @file stub/vdr/ringbuffer.h @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include "thread.h"
+#include "tools.h"
+
+/*******************************************************************************
+ * The parts of <vdr/ringbuffer.h> used by the plugin core. The buffer logic
+ * (margin handling, Get() wake up at 10% fill level) follows VDR 2.4, so
+ * timing measured against this stub is comparable to the real thing.
+ ******************************************************************************/
+
+class cRingBuffer {
+private:
+  cCondVar readyForPut, readyForGet;
+  int putTimeout;
+  int getTimeout;
+  int size;
+protected:
+  cMutex mutex;
+  void WaitForPut(void);
+  void WaitForGet(void);
+  void EnablePut(void);
+  void EnableGet(void);
+public:
+  cRingBuffer(int Size, bool Statistics = false);
+  virtual ~cRingBuffer() {}
+  void SetTimeouts(int PutTimeout, int GetTimeout);
+  void SetIoThrottle(void) {}
+  void ReportOverflow(int Bytes) {}
+  int Size(void) { return size; }
+  virtual int Available(void) = 0;
+  virtual int Free(void) { return Size() - Available() - 1; }
+  virtual void Clear(void) = 0;
+};
+
+
+class cRingBufferLinear : public cRingBuffer {
+private:
+  int margin;
+  volatile int head, tail;
+  int gotten;
+  uchar* buffer;
+protected:
+  virtual int DataReady(const uchar* Data, int Count);
+public:
+  cRingBufferLinear(int Size, int Margin = 0, bool Statistics = false, const char* Description = nullptr);
+  virtual ~cRingBufferLinear();
+  virtual int Available(void);
+  virtual int Free(void) { return Size() - Available() - 1 - margin; }
+  virtual void Clear(void);
+  int Read(int FileHandle, int Max = 0);
+  int Put(const uchar* Data, int Count);
+  uchar* Get(int& Count);
+  void Del(int Count);
+};
@@ -0,0 +1,101 @@
+/*******************************************************************************
+ * @file stub/vdr/thread.h @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <pthread.h>
+#include <sys/types.h>
+
+/*******************************************************************************
+ * The parts of <vdr/thread.h> used by the plugin core.
+ ******************************************************************************/
+
+class cCondWait {
+private:
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool signaled;
+public:
+  cCondWait(void);
+  ~cCondWait();
+  static void SleepMs(int TimeoutMs);
+  bool Wait(int TimeoutMs = 0);
+  void Signal(void);
+};
+
+
+class cMutex {
+  friend class cCondVar;
+private:
+  pthread_mutex_t mutex;
+  int locked;
+public:
+  cMutex(void);
+  ~cMutex();
+  void Lock(void);
+  void Unlock(void);
+};
+
+
+class cCondVar {
+private:
+  pthread_cond_t cond;
+public:
+  cCondVar(void);
+  ~cCondVar();
+  void Wait(cMutex& Mutex);
+  bool TimedWait(cMutex& Mutex, int TimeoutMs);
+  void Broadcast(void);
+};
+
+
+class cMutexLock {
+private:
+  cMutex* mutex;
+  bool locked;
+public:
+  cMutexLock(cMutex* Mutex = nullptr);
+  ~cMutexLock();
+  bool Lock(cMutex* Mutex);
+};
+
+
+class cThread {
+private:
+  volatile bool active;
+  volatile bool running;
+  pthread_t childTid;
+  cMutex mutex;
+  char* description;
+  static void* StartThread(cThread* Thread);
+protected:
+  void Lock(void) { mutex.Lock(); }
+  void Unlock(void) { mutex.Unlock(); }
+  virtual void Action(void) = 0;
+  bool Running(void) { return running; }
+  void Cancel(int WaitSeconds = 0);
+public:
+  cThread(const char* Description = nullptr, bool LowPriority = false);
+  virtual ~cThread();
+  void SetDescription(const char* Description, ...) __attribute__ ((format (printf, 2, 3)));
+  bool Start(void);
+  bool Active(void);
+  static pid_t ThreadId(void);
+};
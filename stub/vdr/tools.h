@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * @file stub/vdr/tools.h @brief minimal VDR stub for standalone builds.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/*******************************************************************************
+ * The parts of <vdr/tools.h> used by the plugin core. Signatures and
+ * semantics follow VDR 2.4, implementations are kept as small as possible.
+ ******************************************************************************/
+
+typedef unsigned char uchar;
+
+#define FATALERRNO (errno && errno != EAGAIN && errno != EINTR)
+#define KILOBYTE(n) ((n) * 1024)
+#define MEGABYTE(n) ((n) * 1024LL * 1024LL)
+
+#define MAXPOLLFDS 16
+
+void syslog_with_tid(int priority, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+
+#define esyslog(a...) syslog_with_tid(LOG_ERR,   a)
+#define isyslog(a...) syslog_with_tid(LOG_INFO,  a)
+#define dsyslog(a...) syslog_with_tid(LOG_DEBUG, a)
+
+ssize_t safe_read(int filedes, void* buffer, size_t size);
+ssize_t safe_write(int filedes, const void* buffer, size_t size);
+int WriteAllOrNothing(int fd, const uchar* Data, int Length, int TimeoutMs = 0, int RetryMs = 0);
+
+
+class cTimeMs {
+private:
+  uint64_t begin;
+public:
+  cTimeMs(int Ms = 0);
+  static uint64_t Now(void);
+  void Set(int Ms = 0);
+  bool TimedOut(void) const;
+  uint64_t Elapsed(void) const;
+};
+
+
+class cPoller {
+private:
+  pollfd pfd[MAXPOLLFDS];
+  int numFileHandles;
+public:
+  cPoller(int FileHandle = -1, bool Out = false);
+  bool Add(int FileHandle, bool Out);
+  void Del(int FileHandle, bool Out);
+  bool Poll(int TimeoutMs = 0);
+};
+
+
+class cListObject {
+private:
+  cListObject* prev;
+  cListObject* next;
+public:
+  cListObject(void) : prev(nullptr), next(nullptr) {}
+  virtual ~cListObject() {}
+  void Append(cListObject* Object);
+  void Unlink(void);
+  cListObject* Prev(void) const { return prev; }
+  cListObject* Next(void) const { return next; }
+};
+
+
+class cListBase {
+protected:
+  cListObject* objects;
+  cListObject* lastObject;
+  int count;
+  cListBase(void) : objects(nullptr), lastObject(nullptr), count(0) {}
+public:
+  void Add(cListObject* Object);
+  void Del(cListObject* Object, bool DeleteObject = true);
+  int Count(void) const { return count; }
+};
+
+
+template<class T> class cList : public cListBase {
+public:
+  const T* First(void) const { return (T*) objects; }
+  T* First(void) { return (T*) objects; }
+  const T* Next(const T* Object) const { return (T*) Object->cListObject::Next(); }
+  T* Next(const T* Object) { return (T*) Object->cListObject::Next(); }
+};
@@ -0,0 +1,440 @@
+/*******************************************************************************
+ * @file ddci3-bench.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <vdr/remux.h>
+#include "../CiAdapter.h"
+#include "../CamSlot.h"
+#include "../CamSim.h"
+#include "../Common.h"
+
+/*******************************************************************************
+ * ddci3-bench: microbenchmarks of the TS data path, built against the
+ * standalone core ('make bench'). Every result is one JSON object per line
+ * on stdout (or the file given by -o), to be collected and compared over
+ * time. Log messages of the plugin core go to stderr.
+ ******************************************************************************/
+
+extern int LogLevel;
+extern int BufSize;
+extern bool ClearScramblingBit;
+
+typedef std::chrono::steady_clock clk;
+
+static double Seconds = 2.0;     // duration of one measurement
+static int MaxProducers = 8;     // max writer threads for cTsSender
+static std::string Filter;       // run only benchmarks containing this
+static FILE* Out = stdout;
+static int SimNumber = 0;
+
+
+/*******************************************************************************
+ * helpers
+ ******************************************************************************/
+static double Elapsed(clk::time_point Start) {
+  return std::chrono::duration<double>(clk::now() - Start).count();
+}
+
+
+static bool Selected(const char* Name) {
+  return Filter.empty() or (std::string(Name).find(Filter) != std::string::npos);
+}
+
+
+/* prints one result line: {"bench":"<Name>","key":value,...} */
+static void Result(const char* Name, std::vector<std::pair<const char*, double>> Values) {
+  fprintf(Out, "{\"bench\":\"%s\"", Name);
+  for(auto& v:Values)
+     fprintf(Out, ",\"%s\":%.10g", v.first, v.second);
+  fprintf(Out, "}\n");
+  fflush(Out);
+}
+
+
+/* Count TS packets, PID 0x100, payload only, scrambled with even key
+ * if Scrambled. Continuity counters are correct. */
+static std::vector<uint8_t> MakeStream(int Count, bool Scrambled = true) {
+  std::vector<uint8_t> s(Count * TS_SIZE, 0xAA);
+  for(int i = 0; i < Count; i++) {
+     uint8_t* p = &s[i * TS_SIZE];
+     p[0] = TS_SYNC_BYTE;
+     p[1] = 0x01;
+     p[2] = 0x00;
+     p[3] = (Scrambled ? 0x80 : 0x00) | TS_PAYLOAD_EXISTS | (i & TS_CONT_CNT_MASK);
+     }
+  return s;
+}
+
+
+/* a simulated adapter with an unlimited, zero delay CAM */
+static cAdapter* NewAdapter(int ScrambledPermille = 0) {
+  tCamSimParams p;
+  p.DelayMs = 0;
+  p.RateKbit = 0;
+  p.ScrambledPermille = ScrambledPermille;
+  caDevice d;
+  new cCamSim(SimNumber++, p, d);
+  return new cAdapter(d);
+}
+
+
+/* the master CAM slot of the adapter created last */
+static cCamSlot* LastSlot(void) {
+  cCamSlot* slot = nullptr;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s))
+     if (s->IsMasterSlot())
+        slot = s;
+  return slot;
+}
+
+
+/* calls Decrypt() like VDR's device thread: offer Chunk packets, take one. */
+static uint64_t DecryptLoop(cCamSlot* Slot, int Chunk, bool Copy) {
+  std::vector<uint8_t> src = MakeStream(Chunk);
+  std::vector<uint8_t> buf(src);
+  uint64_t got = 0;
+  clk::time_point start = clk::now();
+
+  while(Elapsed(start) < Seconds) {
+     if (Copy)   // MTD sub slots change the PID in place
+        memcpy(buf.data(), src.data(), buf.size());
+     int count = buf.size();
+     uint8_t* d = Slot->Decrypt(buf.data(), count);
+     if (d)
+        ++got;
+     else if (!count)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+     }
+  return got;
+}
+
+
+/*******************************************************************************
+ * CheckTsSync/CheckAllSync on clean and corrupted buffers
+ ******************************************************************************/
+static void BenchSync(void) {
+  const int packets = 1000;
+  std::vector<uint8_t> clean = MakeStream(packets);
+  std::vector<uint8_t> garbage(clean);
+  garbage.insert(garbage.begin(), 37, 0x47); // fake sync bytes, too
+  std::vector<uint8_t> broken(clean);
+  broken[(packets / 2) * TS_SIZE] = 0x00;
+
+  struct { const char* name; std::vector<uint8_t>* buf; bool all; } cases[] = {
+     { "sync_ts_clean",    &clean,   false },
+     { "sync_ts_garbage",  &garbage, false },
+     { "sync_all_clean",   &clean,   true  },
+     { "sync_all_broken",  &broken,  true  } };
+
+  for(auto& c:cases) {
+     if (!Selected(c.name))
+        continue;
+     uint64_t calls = 0;
+     volatile intptr_t sink = 0;
+     clk::time_point start = clk::now();
+     while(Elapsed(start) < Seconds) {
+        for(int i = 0; i < 100; i++) {
+           if (c.all) {
+              uint8_t* pos;
+              sink += CheckAllSync(c.buf->data(), c.buf->size(), pos);
+              }
+           else {
+              int skipped;
+              sink += (intptr_t) CheckTsSync(c.buf->data(), c.buf->size(), skipped);
+              }
+           }
+        calls += 100;
+        }
+     double s = Elapsed(start);
+     std::vector<std::pair<const char*, double>> values = {
+        { "bytes", double(c.buf->size()) }, { "calls", double(calls) },
+        { "ns_per_call", s * 1e9 / calls } };
+     if (c.all) // CheckTsSync only looks for the first sync
+        values.push_back({ "mbyte_per_s", calls * c.buf->size() / s / 1e6 });
+     Result(c.name, values);
+     }
+}
+
+
+/*******************************************************************************
+ * cTsSender::Write/WriteAll with 1..MaxProducers threads, secY = /dev/null
+ ******************************************************************************/
+static void BenchSender(bool All) {
+  const char* name = All ? "sender_writeall" : "sender_write";
+  if (!Selected(name))
+     return;
+
+  cAdapter* adapter = NewAdapter();
+  std::string devnull = "/dev/null";
+
+  for(int chunk:{ 1, 64 }) {
+     for(int producers = 1; producers <= MaxProducers; producers *= 2) {
+        cTsSender* sender = new cTsSender(*adapter, open("/dev/null", O_WRONLY), devnull);
+        sender->Start();
+
+        std::atomic<bool> stop(false);
+        std::atomic<uint64_t> accepted(0), rejected(0);
+        std::vector<std::thread> threads;
+        clk::time_point start = clk::now();
+
+        for(int i = 0; i < producers; i++)
+           threads.emplace_back([&]() {
+              std::vector<uint8_t> src = MakeStream(chunk);
+              uint64_t a = 0, r = 0;
+              while(!stop) {
+                 int w;
+                 if (All)
+                    w = sender->WriteAll(src.data(), src.size()) ? src.size() : 0;
+                 else
+                    w = sender->Write(src.data(), src.size());
+                 a += w / TS_SIZE;
+                 if (w < int(src.size()))
+                    ++r;
+                 }
+              accepted += a;
+              rejected += r;
+              });
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(Seconds));
+        stop = true;
+        for(auto& t:threads)
+           t.join();
+        double s = Elapsed(start);
+        sender->Cancel(3);
+        delete sender;
+
+        Result(name, { { "producers", double(producers) }, { "chunk_packets", double(chunk) },
+                       { "packets", double(accepted) }, { "pkts_per_s", accepted / s },
+                       { "mbit_per_s", accepted * TS_SIZE * 8 / s / 1e6 },
+                       { "rejected_calls", double(rejected) } });
+        }
+     }
+  delete adapter;
+}
+
+
+/*******************************************************************************
+ * cTsReceiver::Deliver: secY -> receive buffer -> cCiCamSlot
+ ******************************************************************************/
+static void BenchDeliver(void) {
+  if (!Selected("deliver"))
+     return;
+
+  cAdapter* adapter = NewAdapter();
+  cCamSlot* slot = LastSlot();
+  slot->StartDecrypting();
+
+  int fds[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  std::string name = "bench/sec0";
+  cTsReceiver* receiver = new cTsReceiver(*adapter, fds[0], name);
+  receiver->Start();
+
+  std::atomic<bool> stop(false);
+  std::thread feeder([&]() {
+     std::vector<uint8_t> src = MakeStream(256, false);
+     while(!stop)
+        if (write(fds[1], src.data(), src.size()) < 0)
+           break;
+     });
+
+  uint64_t got = 0;
+  clk::time_point start = clk::now();
+  while(Elapsed(start) < Seconds) {
+     int count = 0;
+     if (slot->Decrypt(nullptr, count))
+        ++got;
+     else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+     }
+  double s = Elapsed(start);
+
+  stop = true;
+  shutdown(fds[1], SHUT_RDWR);
+  feeder.join();
+  close(fds[1]);
+  receiver->Cancel(3);
+  delete receiver;
+  delete adapter;
+
+  Result("deliver", { { "packets", double(got) }, { "pkts_per_s", got / s },
+                      { "mbit_per_s", got * TS_SIZE * 8 / s / 1e6 } });
+}
+
+
+/*******************************************************************************
+ * cCiCamSlot::Decrypt round trip through a zero delay simulated CAM
+ ******************************************************************************/
+static void BenchDecrypt(const char* Name, bool ClrSct, int Bufsize) {
+  if (!Selected(Name))
+     return;
+
+  int oldBufSize = BufSize;
+  BufSize = Bufsize;
+  ClearScramblingBit = ClrSct;
+
+  // with ClrSct the CAM leaves every packet scrambled, to hit that path.
+  cAdapter* adapter = NewAdapter(ClrSct ? 1000 : 0);
+  cCamSlot* slot = LastSlot();
+  slot->StartDecrypting();
+
+  clk::time_point start = clk::now();
+  uint64_t got = DecryptLoop(slot, 64, false);
+  double s = Elapsed(start);
+
+  delete adapter;
+  BufSize = oldBufSize;
+  ClearScramblingBit = false;
+
+  Result(Name, { { "bufsize", double(Bufsize) }, { "buffer_bytes", double(1 + TS_SIZE * (1 + Bufsize)) },
+                 { "clrsct", double(ClrSct) }, { "packets", double(got) },
+                 { "pkts_per_s", got / s }, { "mbit_per_s", got * TS_SIZE * 8 / s / 1e6 } });
+}
+
+
+/*******************************************************************************
+ * cCiCamSlot::Decrypt with 1..N MTD sub slots, one thread each
+ ******************************************************************************/
+static void BenchDecryptMtd(void) {
+  if (!Selected("decrypt_mtd"))
+     return;
+
+  for(int subs:{ 1, 2, 4, 8 }) {
+     cAdapter* adapter = NewAdapter();
+     cCamSlot* master = LastSlot();
+     std::vector<cCamSlot*> slots;
+     for(int i = 0; i < subs; i++) {
+        slots.push_back(master->MtdSpawn());
+        slots.back()->StartDecrypting();
+        }
+
+     std::vector<uint64_t> got(subs, 0);
+     std::vector<std::thread> threads;
+     clk::time_point start = clk::now();
+     for(int i = 0; i < subs; i++)
+        threads.emplace_back([&, i]() { got[i] = DecryptLoop(slots[i], 1, true); });
+     for(auto& t:threads)
+        t.join();
+     double s = Elapsed(start);
+
+     for(auto sub:slots)
+        sub->StopDecrypting();
+     delete adapter;
+
+     uint64_t total = 0, min = got[0], max = got[0];
+     for(auto g:got) {
+        total += g;
+        if (g < min) min = g;
+        if (g > max) max = g;
+        }
+     Result("decrypt_mtd", { { "subslots", double(subs) }, { "packets", double(total) },
+                             { "pkts_per_s", total / s }, { "mbit_per_s", total * TS_SIZE * 8 / s / 1e6 },
+                             { "min_sub_pkts", double(min) }, { "max_sub_pkts", double(max) } });
+     }
+}
+
+
+/*******************************************************************************
+ * the Decrypt round trip with and without the trace ring (--no-trace). The
+ * runs alternate and the best of each is taken, to keep the noise of the
+ * machine out of the difference.
+ ******************************************************************************/
+static void BenchTrace(void) {
+  if (!Selected("trace"))
+     return;
+
+  double best[2] = { 0, 0 };
+  for(int round = 0; round < 6; round++) {
+     int on = round & 1;
+     TraceOn = on;
+     cAdapter* adapter = NewAdapter();
+     cCamSlot* slot = LastSlot();
+     slot->StartDecrypting();
+
+     clk::time_point start = clk::now();
+     uint64_t got = DecryptLoop(slot, 64, false);
+     best[on] = std::max(best[on], got / Elapsed(start));
+     delete adapter;
+     }
+  TraceOn = true;
+
+  Result("trace", { { "pkts_per_s_off", best[0] }, { "pkts_per_s_on", best[1] },
+                    { "overhead_pct", best[0] ? 100 * (best[0] - best[1]) / best[0] : 0 } });
+}
+
+
+int main(int argc, char* argv[]) {
+  int c;
+  while((c = getopt(argc, argv, "b:ho:p:t:v")) > 0) {
+     switch(c) {
+        case 'b': Filter = optarg; break;
+        case 'o':
+           if (!(Out = fopen(optarg, "w"))) {
+              perror(optarg);
+              return 1;
+              }
+           break;
+        case 'p': MaxProducers = atoi(optarg); break;
+        case 't': Seconds = atof(optarg); break;
+        case 'v': LogLevel = 3; break;
+        case 'h':
+        default:
+           fprintf(c == 'h' ? stdout : stderr,
+              "usage: %s [-b filter] [-h] [-o file] [-p producers] [-t seconds] [-v]\n"
+              "  -b  run only benchmarks whose name contains filter\n"
+              "  -h  print this help\n"
+              "  -o  write results to file instead of stdout (JSON lines)\n"
+              "  -p  max number of cTsSender producer threads, default 8\n"
+              "  -t  seconds per measurement, default 2\n"
+              "  -v  verbose plugin logging\n", argv[0]);
+           return c != 'h';
+        }
+     }
+  if (LogLevel < 3)
+     LogLevel = 1;
+  signal(SIGPIPE, SIG_IGN);
+
+  BenchSync();
+  BenchSender(false);
+  BenchSender(true);
+  BenchDeliver();
+  BenchDecrypt("decrypt", false, BufSize);
+  BenchDecrypt("decrypt_clrsct", true, BufSize);
+  BenchDecryptMtd();
+  BenchTrace();
+  for(int bs:{ 1500, 3000, 6000, 10000 }) {
+     BenchDecrypt("bufsize", false, bs);
+     }
+
+  if (Out != stdout)
+     fclose(Out);
+  return 0;
+}
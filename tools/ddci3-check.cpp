@@ -0,0 +1,471 @@
+/*******************************************************************************
+ * @file ddci3-check.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+#include <signal.h>
+#include <vdr/remux.h>
+#include "../Bypass.h"
+#include "../CiAdapter.h"
+#include "../CamSlot.h"
+#include "../CamSim.h"
+#include "../Common.h"
+
+/*******************************************************************************
+ * ddci3-check: functional checks of the TS data path against simulated CAMs,
+ * built against the standalone core ('make check' builds and runs them).
+ * Each check prints 'ok <name>' or 'FAIL <name>: <what>', the exit code is
+ * the number of failed checks.
+ ******************************************************************************/
+
+extern int LogLevel;
+extern bool CamBypass;
+extern bool StripNull;
+extern int RecoverPct;
+extern int RecoverSec;
+
+typedef std::chrono::steady_clock clk;
+
+static std::string Filter;       // run only checks containing this
+static int SimNumber = 0;
+
+
+/*******************************************************************************
+ * helpers
+ ******************************************************************************/
+/* a TS packet of Pid, payload only, filled with Fill; Data (if any) is put
+ * at the start of the payload. */
+static std::vector<uint8_t> Packet(int Pid, bool Start, bool Scrambled, int Cc,
+                                   std::vector<uint8_t> Data = {}, uint8_t Fill = 0xAA) {
+  std::vector<uint8_t> p(TS_SIZE, Fill);
+  p[0] = TS_SYNC_BYTE;
+  p[1] = (Start ? TS_PAYLOAD_START : 0) | ((Pid >> 8) & TS_PID_MASK_HI);
+  p[2] = Pid & 0xFF;
+  p[3] = (Scrambled ? 0x80 : 0x00) | TS_PAYLOAD_EXISTS | (Cc & TS_CONT_CNT_MASK);
+  std::copy(Data.begin(), Data.end(), p.begin() + 4);
+  return p;
+}
+
+
+/* the first packet of a section with TableId: pointer field 0, table id */
+static std::vector<uint8_t> Section(int Pid, uint8_t TableId, int Cc = 0) {
+  return Packet(Pid, true, false, Cc, { 0x00, TableId, 0xB0, 0x0D });
+}
+
+
+/* a simulated adapter and its master CAM slot */
+static cAdapter* NewAdapter(const tCamSimParams& Params, cCamSlot*& Master) {
+  caDevice d;
+  new cCamSim(SimNumber++, Params, d);
+  cAdapter* adapter = new cAdapter(d);
+  Master = nullptr;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s))
+     if (s->IsMasterSlot())
+        Master = s;
+  return adapter;
+}
+
+
+/* offers Packets to Slot->Decrypt() like VDR's device thread and collects
+ * what comes back, until Expected packets did or Ms passed. */
+static std::vector<std::vector<uint8_t>> RoundTrip(cCamSlot* Slot, const std::vector<std::vector<uint8_t>>& Packets,
+                                                   size_t Expected, int Ms = 2000) {
+  std::vector<std::vector<uint8_t>> out;
+  size_t next = 0;
+  auto end = clk::now() + std::chrono::milliseconds(Ms);
+  while((out.size() < Expected) and (clk::now() < end)) {
+     std::vector<uint8_t> p;
+     int count = 0;
+     if (next < Packets.size()) {
+        p = Packets[next];
+        count = TS_SIZE;
+        }
+     uint8_t* d = Slot->Decrypt(count ? p.data() : nullptr, count);
+     if (count)
+        ++next;
+     if (d)
+        out.emplace_back(d, d + TS_SIZE);
+     else if (!count)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+     }
+  return out;
+}
+
+
+/*******************************************************************************
+ * Bypassable() with unique PIDs: the PAT, SI tables and null packets of MTD
+ * sub slots bypass the CAM, the CAT, PMT, ECMs, EMMs and scrambled packets
+ * don't. Then the same through a sub slot and the simulated CAM.
+ ******************************************************************************/
+static std::string CheckBypassMtd(void) {
+  cBypass bypass(1500);
+  const int uniq = 1 << UNIQ_PID_SHIFT;   // sub slot 1, mapper index 0..
+  struct { const char* what; std::vector<uint8_t> packet; bool bypass; } cases[] = {
+     { "raw null packet",       Packet(0x1FFF, false, false, 0, {}, 0xFF), true },
+     { "raw PAT",               Section(0x0000, 0x00), true },
+     { "raw CAT",               Section(0x0001, 0x01), false },
+     { "mapped PAT",            Section(uniq + 0, 0x00), true },
+     { "mapped SDT",            Section(uniq + 1, 0x42), true },
+     { "mapped EIT",            Section(uniq + 2, 0x4E), true },
+     { "mapped EIT, next",      Packet(uniq + 2, false, false, 1), true },
+     { "mapped CAT",            Section(uniq + 3, 0x01), false },
+     { "mapped CAT, stuffing",  Packet(uniq + 3, false, false, 1, {}, 0xFF), false },
+     { "mapped PMT",            Section(uniq + 4, 0x02), false },
+     { "mapped ECM",            Section(uniq + 5, 0x80), false },
+     { "mapped null packet",    Packet(uniq + 6, false, false, 0, {}, 0xFF), true },
+     { "mapped PES",            Packet(uniq + 7, true, false, 0, { 0x00, 0x00, 0x01, 0xE0 }), true },
+     { "mapped PES, next",      Packet(uniq + 7, false, false, 1), true },
+     { "mapped scrambled",      Packet(uniq + 8, false, true, 0), false },
+     { "mapped, no unit start", Packet(uniq + 9, false, false, 0), false },
+     };
+  for(auto& c:cases)
+     if (bypass.Bypassable(c.packet.data()) != c.bypass)
+        return std::string(c.what) + (c.bypass ? " not bypassed" : " bypassed");
+
+  // through a sub slot: EIT and null packets bypass, the CAM decrypts the rest.
+  CamBypass = true;
+  tCamSimParams params;
+  params.DelayMs = 5;
+  cCamSlot* master;
+  cAdapter* adapter = NewAdapter(params, master);
+  cCamSlot* sub = master->MtdSpawn();
+  sub->StartDecrypting();
+
+  std::vector<std::vector<uint8_t>> in;
+  int cc = 0;
+  for(int i = 0; i < 100; i++, cc++) {
+     in.push_back(i ? Packet(0x0012, false, false, cc) : Section(0x0012, 0x4E, cc));
+     in.push_back(Packet(0x1FFF, false, false, cc, {}, 0xFF));
+     in.push_back(Packet(0x0100, false, true, cc));
+     }
+  std::vector<std::vector<uint8_t>> out = RoundTrip(sub, in, in.size());
+  uint64_t bypassed = adapter->Bypass().Bypassed();
+  sub->StopDecrypting();
+  delete adapter;
+  CamBypass = false;
+
+  if (out.size() != in.size())
+     return std::to_string(out.size()) + " of " + std::to_string(in.size()) + " packets came back";
+  for(size_t i = 0; i < in.size(); i++)
+     if ((TsPid(out[i].data()) != TsPid(in[i].data())) or
+         (TsContinuityCounter(out[i].data()) != TsContinuityCounter(in[i].data())))
+        return "packet " + std::to_string(i) + " out of order";
+  if (bypassed != 200)
+     return std::to_string(bypassed) + " of 200 EIT and null packets bypassed";
+  return "";
+}
+
+
+/*******************************************************************************
+ * StripNull with an MTD sub slot: the null packets, mapped to a unique PID,
+ * don't go to the CAM, the data comes back complete and in order; also when
+ * the stuffing of a section PID is all 0xFF.
+ ******************************************************************************/
+static std::string CheckStripNullMtd(void) {
+  StripNull = true;
+  tCamSimParams params;
+  params.DelayMs = 5;
+  cCamSlot* master;
+  cAdapter* adapter = NewAdapter(params, master);
+  cCamSlot* sub = master->MtdSpawn();
+  sub->StartDecrypting();
+
+  std::vector<std::vector<uint8_t>> in, data;
+  for(int i = 0; i < 100; i++) {
+     std::vector<uint8_t> p = Packet(0x0100, false, true, i);
+     std::vector<uint8_t> s = i ? Packet(0x0012, false, false, i, {}, 0xFF) : Section(0x0012, 0x4E);
+     in.push_back(p);
+     in.push_back(Packet(0x1FFF, false, false, i, {}, 0xFF));
+     in.push_back(s);
+     data.push_back(p);
+     data.push_back(s);
+     }
+  std::vector<std::vector<uint8_t>> out = RoundTrip(sub, in, data.size());
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));   // more than expected?
+  std::vector<std::vector<uint8_t>> late = RoundTrip(sub, {}, 1, 100);
+  uint64_t stripped = adapter->Sender().NullStripped();
+  sub->StopDecrypting();
+  delete adapter;
+  StripNull = false;
+
+  out.insert(out.end(), late.begin(), late.end());
+  if (out.size() != data.size())
+     return std::to_string(out.size()) + " packets came back, expected " + std::to_string(data.size());
+  for(size_t i = 0; i < data.size(); i++)
+     if ((TsPid(out[i].data()) != TsPid(data[i].data())) or
+         (TsContinuityCounter(out[i].data()) != TsContinuityCounter(data[i].data())))
+        return "packet " + std::to_string(i) + " out of order";
+  if (stripped != 100)
+     return std::to_string(stripped) + " of 100 null packets stripped";
+  return "";
+}
+
+
+/*******************************************************************************
+ * The clear protocol with and without the clear markers coming back: zaps
+ * (StopDecrypting() and StartDecrypting()) every 20..120ms on a CAM with
+ * 50ms delay, fed with 2000 packets/s, well below its rate. Nothing of before a zap may come back after it, nothing of
+ * after it may get lost. With nullloss=1000 the CAM drops every marker,
+ * the stale data ends by the packet count then.
+ ******************************************************************************/
+static std::string CheckClearMarkerLost(void) {
+  for(const char* sim:{ "delay=50,rate=8000", "delay=50,rate=8000,nullloss=1000" }) {
+     tCamSimParams params;
+     cCamSim::ParseParams(sim, params);
+     cCamSlot* master;
+     cAdapter* adapter = NewAdapter(params, master);
+     master->StartDecrypting();
+
+     uint32_t seq = 0, expect = 0;
+     uint8_t zap = 0;
+     int stale = 0, gaps = 0, got = 0, zaps = 0;
+     unsigned seed = 1;
+     auto start = clk::now();
+     auto end = start + std::chrono::seconds(3);
+     auto next = start + std::chrono::milliseconds(50);
+     while(clk::now() < end) {
+        if (clk::now() >= next) {
+           master->StopDecrypting();
+           master->StartDecrypting();
+           ++zap;
+           ++zaps;
+           expect = seq;
+           next = clk::now() + std::chrono::milliseconds(20 + rand_r(&seed) % 100);
+           }
+        std::vector<uint8_t> p = Packet(0x0100, false, true, seq);
+        memcpy(&p[4], &seq, sizeof(seq));
+        p[8] = zap;
+        bool due = seq < std::chrono::duration<double>(clk::now() - start).count() * 2000;
+        int count = due ? TS_SIZE : 0;
+        uint8_t* d = master->Decrypt(due ? p.data() : nullptr, count);
+        if (count)
+           ++seq;
+        else
+           std::this_thread::sleep_for(std::chrono::microseconds(200));
+        while(d) {
+           uint32_t s;
+           memcpy(&s, d + 4, sizeof(s));
+           if (d[8] != zap)
+              ++stale;
+           else {
+              if (s != expect)
+                 ++gaps;
+              expect = s + 1;
+              ++got;
+              }
+           count = 0;
+           d = master->Decrypt(nullptr, count);
+           }
+        }
+     master->StopDecrypting();
+     delete adapter;
+
+     std::string what = std::string(sim) + ": " + std::to_string(zaps) + " zaps, " +
+                        std::to_string(got) + " packets, ";
+     if (!got)
+        return what + "nothing came back";
+     if (stale)
+        return what + std::to_string(stale) + " of before a zap came after it";
+     if (gaps)
+        return what + std::to_string(gaps) + " gaps after a zap";
+     }
+  return "";
+}
+
+
+/*******************************************************************************
+ * Flushing MTD sub slots: sub slot A restarts twice, once with packets in the
+ * CAM, once right after with none, sub slot B runs on. Nothing of A from
+ * before a restart may come back after it, nothing of A after it and nothing
+ * of B may get lost.
+ ******************************************************************************/
+static std::string CheckFlushSubSlots(void) {
+  tCamSimParams params;
+  cCamSim::ParseParams("delay=50,rate=8000", params);
+  cCamSlot* master;
+  cAdapter* adapter = NewAdapter(params, master);
+  cCamSlot* slot[2] = { master->MtdSpawn(), master->MtdSpawn() };
+  slot[0]->StartDecrypting();
+  slot[1]->StartDecrypting();
+
+  uint32_t seq[2] = { 0, 0 }, expect[2] = { 0, 0 };
+  uint8_t zap = 0;
+  int stale = 0, gaps[2] = { 0, 0 }, got[2] = { 0, 0 };
+  auto start = clk::now();
+  auto end = start + std::chrono::milliseconds(1500);
+  auto restart = start + std::chrono::milliseconds(500);
+  while(clk::now() < end) {
+     if ((zap < 2) and (clk::now() >= restart)) {
+        // the second restart follows the first before A sends anything.
+        slot[0]->StopDecrypting();
+        slot[0]->StartDecrypting();
+        ++zap;
+        expect[0] = seq[0];
+        if (zap == 1)
+           continue;
+        }
+     bool due = seq[0] < std::chrono::duration<double>(clk::now() - start).count() * 1000;
+     for(int i = 0; i < 2; i++) {
+        std::vector<uint8_t> p = Packet(0x0100, false, true, seq[i]);
+        memcpy(&p[4], &seq[i], sizeof(seq[i]));
+        p[8] = zap;
+        int count = due ? TS_SIZE : 0;
+        uint8_t* d = slot[i]->Decrypt(due ? p.data() : nullptr, count);
+        if (count)
+           ++seq[i];
+        while(d) {
+           uint32_t s;
+           memcpy(&s, d + 4, sizeof(s));
+           if (i == 0 and d[8] != zap)
+              ++stale;
+           else {
+              if (s != expect[i])
+                 ++gaps[i];
+              expect[i] = s + 1;
+              ++got[i];
+              }
+           count = 0;
+           d = slot[i]->Decrypt(nullptr, count);
+           }
+        }
+     if (!due)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+     }
+  slot[0]->StopDecrypting();
+  slot[1]->StopDecrypting();
+  delete adapter;
+
+  if (!got[0] or !got[1])
+     return "nothing came back";
+  if (stale)
+     return std::to_string(stale) + " packets of A from before a restart came after it";
+  if (gaps[0])
+     return std::to_string(gaps[0]) + " gaps of A after a restart";
+  if (gaps[1])
+     return std::to_string(gaps[1]) + " gaps of B";
+  return "";
+}
+
+
+/*******************************************************************************
+ * The scrambled output watch starts over with a new service: a CAM which
+ * returns everything scrambled gets the CA PMT again, then a reset. A zap
+ * (StopDecrypting() and StartDecrypting()) right after the first resend
+ * has to lead to a resend again, not to the reset.
+ ******************************************************************************/
+static std::string CheckScrambleRestart(void) {
+  RecoverPct = 50;
+  RecoverSec = 1;
+  tCamSimParams params;
+  cCamSim::ParseParams("scrambled=1000", params);
+  cCamSlot* master;
+  cAdapter* adapter = NewAdapter(params, master);
+  master->SetPid(0x0100, true);
+  master->StartDecrypting();
+  cScrambleWatch& watch = adapter->Watch();
+
+  bool zapped = false;
+  int cc = 0;
+  auto end = clk::now() + std::chrono::seconds(10);
+  while((clk::now() < end) and (watch.Resends() < 2) and !watch.Resets()) {
+     if (!zapped and watch.Resends()) {
+        master->StopDecrypting();
+        master->SetPid(0x0100, true);
+        master->StartDecrypting();
+        zapped = true;
+        }
+     std::vector<uint8_t> p = Packet(0x0100, false, true, cc++);
+     int count = TS_SIZE;
+     uint8_t* d = master->Decrypt(p.data(), count);
+     while(d) {
+        count = 0;
+        d = master->Decrypt(nullptr, count);
+        }
+     std::this_thread::sleep_for(std::chrono::microseconds(500));
+     }
+  uint64_t resends = watch.Resends(), resets = watch.Resets();
+  master->StopDecrypting();
+  delete adapter;
+  RecoverPct = 0;
+
+  if (resets)
+     return "reset after the zap, not another resend";
+  if (resends < 2)
+     return std::to_string(resends) + " resends in 10s";
+  return "";
+}
+
+
+/*******************************************************************************
+ * main
+ ******************************************************************************/
+static struct {
+  const char* name;
+  std::string (*check)(void);
+} Checks[] = {
+  { "bypass_mtd", CheckBypassMtd },
+  { "strip_null_mtd", CheckStripNullMtd },
+  { "clear_marker_lost", CheckClearMarkerLost },
+  { "flush_sub_slots", CheckFlushSubSlots },
+  { "scramble_restart", CheckScrambleRestart },
+};
+
+
+int main(int argc, char* argv[]) {
+  int c;
+  while((c = getopt(argc, argv, "b:hv")) > 0) {
+     switch(c) {
+        case 'b': Filter = optarg; break;
+        case 'v': LogLevel = 3; break;
+        case 'h':
+        default:
+           fprintf(c == 'h' ? stdout : stderr,
+              "usage: %s [-b filter] [-h] [-v]\n"
+              "  -b  run only checks whose name contains filter\n"
+              "  -h  print this help\n"
+              "  -v  verbose plugin logging\n", argv[0]);
+           return c != 'h';
+        }
+     }
+  if (LogLevel < 3)
+     LogLevel = 1;
+  signal(SIGPIPE, SIG_IGN);
+
+  int failed = 0;
+  for(auto& ch:Checks) {
+     if (!Filter.empty() and (std::string(ch.name).find(Filter) == std::string::npos))
+        continue;
+     std::string error = ch.check();
+     if (error.empty())
+        printf("ok %s\n", ch.name);
+     else {
+        printf("FAIL %s: %s\n", ch.name, error.c_str());
+        ++failed;
+        }
+     fflush(stdout);
+     }
+  return failed;
+}
@@ -0,0 +1,219 @@
+/*******************************************************************************
+ * @file ddci3-replay.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <signal.h>
+#include <vdr/remux.h>
+#include "../CiAdapter.h"
+#include "../CamSlot.h"
+#include "../CamSim.h"
+#include "../Capture.h"
+#include "../Common.h"
+
+/*******************************************************************************
+ * ddci3-replay: feeds a capture file, written by SVDRP command CAPT, back
+ * through the plugin's TS data path, built against the standalone core
+ * ('make bench').
+ *
+ * The captured CAM output is sent by a simulated CAM (cCamSim::Replay()) at
+ * the recorded times. The captured CAM input is passed to cCiCamSlot::Decrypt()
+ * at the recorded times, like VDR's device thread would do. With -s the
+ * session runs faster or slower, -s 0 runs it as fast as possible.
+ ******************************************************************************/
+
+extern int LogLevel;
+extern std::string TraceDir;
+
+static const uint64_t LOOKAHEAD_MS = 200; // CAM output is scheduled this early
+static const uint64_t DRAIN_MS     = 1000; // end, if no output for that time
+
+
+struct tInput {
+  uint64_t due;
+  std::vector<uint8_t> data;
+  size_t consumed;
+};
+
+
+static bool ReadRecord(FILE* f, tCaptureRecord& r, std::vector<uint8_t>& data) {
+  if (fread(&r, sizeof(r), 1, f) != 1)
+     return false;
+  if (r.Direction == cdLost)
+     data.clear();
+  else {
+     data.resize(r.Length);
+     if (r.Length and (fread(data.data(), r.Length, 1, f) != 1))
+        return false;
+     }
+  return true;
+}
+
+
+int main(int argc, char* argv[]) {
+  double speed = 1.0;
+  bool dump = false;
+  bool help = false;
+  int c;
+
+  while((c = getopt(argc, argv, "d:hs:v")) > 0) {
+     switch(c) {
+        case 'd': TraceDir = optarg; dump = true; break;
+        case 's': speed = atof(optarg); break;
+        case 'v': LogLevel = 3; break;
+        case 'h': help = true; // fall through
+        default:
+           optind = argc;
+        }
+     }
+  if ((optind != argc - 1) or (speed < 0)) {
+     fprintf(help ? stdout : stderr,
+        "usage: %s [-d dir] [-h] [-s speed] [-v] <file.cap>\n"
+        "  -d  write the adapter's trace ring to dir at the end\n"
+        "  -h  print this help\n"
+        "  -s  replay speed, default 1.0 = original timing, 0 = as fast as possible\n"
+        "  -v  verbose plugin logging\n", argv[0]);
+     return !help;
+     }
+  if (LogLevel < 3)
+     LogLevel = 1;
+  signal(SIGPIPE, SIG_IGN);
+
+  FILE* f = fopen(argv[optind], "rb");
+  if (!f) {
+     perror(argv[optind]);
+     return 1;
+     }
+  tCaptureHeader h;
+  if ((fread(&h, sizeof(h), 1, f) != 1) or memcmp(h.Magic, CAPTURE_MAGIC, sizeof(h.Magic)) or
+      (h.Version != CAPTURE_VERSION)) {
+     fprintf(stderr, "%s: not a ddci3 capture file\n", argv[optind]);
+     return 1;
+     }
+  printf("%s: %.*s\n", argv[optind], int(sizeof(h.Device)), h.Device);
+
+  tCamSimParams p;
+  p.DelayMs = 0;
+  p.RateKbit = 0;
+  caDevice d;
+  cCamSim* sim = new cCamSim(0, p, d);
+  sim->Replay();
+  cAdapter* adapter = new cAdapter(d);
+
+  cCamSlot* slot = nullptr;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s))
+     if (s->IsMasterSlot())
+        slot = s;
+  if (!slot) {
+     fprintf(stderr, "no CAM slot\n");
+     return 1;
+     }
+  slot->StartDecrypting();
+
+  tCaptureRecord r;
+  std::vector<uint8_t> data;
+  bool eof = !ReadRecord(f, r, data);
+  uint64_t first = eof ? 0 : r.Time;
+  uint64_t last = first;
+  uint64_t start = cTimeMs::Now();
+  auto Due = [&](uint64_t Time) -> uint64_t {
+     return speed > 0 ? start + uint64_t((Time - first) / 1e6 / speed) : cTimeMs::Now();
+     };
+
+  std::deque<tInput> input;
+  uint64_t bytesIn = 0, bytesOut = 0, bytesLost = 0, pktDelivered = 0;
+  uint64_t lastOutput = start, maxGap = 0, maxLate = 0;
+
+  for(;;) {
+     uint64_t now = cTimeMs::Now();
+
+     // read ahead: schedule CAM output, queue CAM input
+     while(!eof and (Due(r.Time) <= now + LOOKAHEAD_MS)) {
+        if (r.Direction == cdFromCam) {
+           sim->Schedule(Due(r.Time), data.data(), data.size());
+           bytesOut += data.size();
+           }
+        else if (r.Direction == cdToCam) {
+           input.push_back({ Due(r.Time), data, 0 });
+           bytesIn += data.size();
+           }
+        else
+           bytesLost += r.Length;
+        last = r.Time;
+        eof = !ReadRecord(f, r, data);
+        }
+
+     // like VDR's device thread: offer the input, take one packet
+     bool busy = false;
+     uint8_t* out;
+     if (!input.empty() and (input.front().due <= now)) {
+        tInput& in = input.front();
+        int count = in.data.size() - in.consumed;
+        out = slot->Decrypt(in.data.data() + in.consumed, count);
+        in.consumed += count;
+        if (in.consumed >= in.data.size()) {
+           if (now - in.due > maxLate)
+              maxLate = now - in.due;
+           input.pop_front();
+           }
+        busy = count > 0;
+        }
+     else {
+        int count = 0;
+        out = slot->Decrypt(nullptr, count);
+        }
+
+     if (out) {
+        ++pktDelivered;
+        if (now - lastOutput > maxGap)
+           maxGap = now - lastOutput;
+        lastOutput = now;
+        busy = true;
+        }
+     else if (eof and input.empty() and (now - lastOutput > DRAIN_MS))
+        break;
+
+     if (!busy)
+        cCondWait::SleepMs(1);
+     }
+
+  double s = (cTimeMs::Now() - start) / 1000.0;
+  printf("replayed %.1fs at speed %g in %.1fs\n",
+         (last - first) / 1e9, speed, s);
+  printf("  to CAM:          %llu bytes\n", (unsigned long long) bytesIn);
+  printf("  from CAM:        %llu bytes\n", (unsigned long long) bytesOut);
+  printf("  not captured:    %llu bytes\n", (unsigned long long) bytesLost);
+  printf("  delivered:       %llu packets (%llu bytes)\n", (unsigned long long) pktDelivered,
+         (unsigned long long) pktDelivered * TS_SIZE);
+  printf("  max output gap:  %llu ms\n", (unsigned long long) maxGap);
+  printf("  max input delay: %llu ms\n", (unsigned long long) maxLate);
+
+  if (dump)
+     printf("  trace:           %s\n", adapter->DumpTrace().c_str());
+
+  fclose(f);
+  delete adapter;
+  return 0;
+}
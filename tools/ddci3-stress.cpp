@@ -0,0 +1,381 @@
+/*******************************************************************************
+ * @file ddci3-stress.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+#include <signal.h>
+#include <vdr/remux.h>
+#include "../CiAdapter.h"
+#include "../CamSlot.h"
+#include "../CamSim.h"
+#include "../Common.h"
+
+/*******************************************************************************
+ * ddci3-stress: MTD stress and fairness test, built against the standalone
+ * core ('make bench').
+ *
+ * For 1..N MTD sub slots, each sub slot gets a producer thread which calls
+ * Decrypt() one packet at a time at its own bitrate, like a VDR device
+ * thread. The packets carry sub slot, sequence number and send time in their
+ * payload, so the returned stream is checked for loss, order and latency.
+ * A packet the CAM send buffer doesn't take is retried, like VDR does; if a
+ * producer falls behind by more than BACKLOG_MS, packets are dropped at the
+ * source, as a full DVB device buffer would.
+ *
+ * One JSON line per sub slot and step, one summary line per step and the
+ * saturation point at the end.
+ *
+ * With -g, the CAM bandwidth governor is on and the sub slots get the VDR
+ * priorities given by -p, to check that the higher ones win when the CAM
+ * saturates.
+ ******************************************************************************/
+
+extern int LogLevel;
+extern bool CamGovernor;
+extern int BufSize;
+
+typedef std::chrono::steady_clock clk;
+
+static const int BACKLOG_MS = 500;
+
+static double Seconds = 5.0;               // duration of one step
+static const int MAX_SUBS = SUB_SLOTS - 1; // sub slot numbers 1..
+static int MaxSubs = MAX_SUBS;             // sub slots of the last step
+static std::vector<double> Rates = { 3, 8, 15 }; // Mbit/s, cycled over the sub slots
+static std::vector<int> Prios = { 0 };     // VDR priorities, cycled over the sub slots
+static tCamSimParams SimParams;
+static FILE* Out = stdout;
+static int SimNumber = 0;
+
+
+struct tSubStats {
+  double rate = 0;             // Mbit/s offered
+  int priority = 0;            // VDR priority of the sub slot
+  uint64_t offered = 0;        // packets due at the source
+  uint64_t accepted = 0;       // packets taken by Decrypt()
+  uint64_t dropped = 0;        // packets dropped at the source
+  uint64_t retries = 0;        // Decrypt() calls with Count = 0
+  uint64_t received = 0;       // packets returned by Decrypt()
+  uint64_t reordered = 0;      // sequence number went backwards
+  uint64_t foreign = 0;        // packet of another sub slot
+  std::vector<uint32_t> latency; // in us
+};
+
+
+static uint64_t NowNs(void) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now().time_since_epoch()).count();
+}
+
+
+static void Result(const char* Name, std::vector<std::pair<const char*, double>> Values) {
+  fprintf(Out, "{\"bench\":\"%s\"", Name);
+  for(auto& v:Values)
+     fprintf(Out, ",\"%s\":%.10g", v.first, v.second);
+  fprintf(Out, "}\n");
+  fflush(Out);
+}
+
+
+static double Percentile(std::vector<uint32_t>& v, double p) {
+  if (v.empty())
+     return 0;
+  size_t n = std::min(v.size() - 1, size_t(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + n, v.end());
+  return v[n];
+}
+
+
+/* one VDR device thread, feeding one MTD sub slot */
+static void Producer(cCamSlot* Sub, int Index, tSubStats& S, std::atomic<bool>& Stop) {
+  const double pps = S.rate * 1e6 / 8 / TS_SIZE;
+  const uint64_t start = NowNs();
+  uint32_t seq = 0;
+  int64_t lastSeq = -1;
+  uint8_t pkt[TS_SIZE];
+  bool pending = false;
+
+  auto Check = [&](uint8_t* d) {
+     uint32_t idx, sq;
+     uint64_t t;
+     memcpy(&idx, d + 4, 4);
+     memcpy(&sq,  d + 8, 4);
+     memcpy(&t,   d + 12, 8);
+     if (int(idx) != Index) {
+        ++S.foreign;
+        return;
+        }
+     ++S.received;
+     if (int64_t(sq) <= lastSeq)
+        ++S.reordered;
+     lastSeq = sq;
+     S.latency.push_back((NowNs() - t) / 1000);
+     };
+
+  while(!Stop) {
+     uint64_t due = (NowNs() - start) / 1e9 * pps;
+     bool busy = false;
+
+     // drop at the source, if too far behind
+     uint64_t behind = due - S.offered;
+     if (behind > pps * BACKLOG_MS / 1000) {
+        S.offered += behind;
+        S.dropped += behind;
+        seq += behind;
+        pending = false;
+        }
+
+     if (!pending and (S.offered < due)) {
+        memset(pkt, 0xAA, sizeof(pkt));
+        pkt[0] = TS_SYNC_BYTE;
+        int pid = 0x100 + Index * 2 + (seq & 1);
+        pkt[1] = pid >> 8;
+        pkt[2] = pid & 0xFF;
+        pkt[3] = 0x80 | TS_PAYLOAD_EXISTS | (seq & TS_CONT_CNT_MASK);
+        memcpy(pkt + 4, &Index, 4);
+        memcpy(pkt + 8, &seq, 4);
+        ++S.offered;
+        ++seq;
+        pending = true;
+        }
+
+     if (pending) {
+        uint64_t t = NowNs();
+        memcpy(pkt + 12, &t, 8);
+        int count = TS_SIZE;
+        uint8_t* d = Sub->Decrypt(pkt, count);
+        if (count) {
+           ++S.accepted;
+           pending = false;
+           busy = true;
+           }
+        else
+           ++S.retries;
+        if (d) {
+           Check(d);
+           busy = true;
+           }
+        }
+     else {
+        int count = 0;
+        uint8_t* d = Sub->Decrypt(nullptr, count);
+        if (d) {
+           Check(d);
+           busy = true;
+           }
+        }
+
+     if (!busy)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+     }
+
+  // what is still due at the source didn't make it in time.
+  uint64_t due = (NowNs() - start) / 1e9 * pps;
+  if (due > S.offered) {
+     S.dropped += due - S.offered;
+     S.offered = due;
+     }
+
+  // drain: no new input, collect what is still inside the CAM
+  auto end = clk::now() + std::chrono::seconds(1);
+  while(clk::now() < end) {
+     int count = 0;
+     uint8_t* d = Sub->Decrypt(nullptr, count);
+     if (d)
+        Check(d);
+     else
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+     }
+}
+
+
+/* one step with Subs sub slots, returns true if the pipeline kept up */
+static bool Step(int Subs) {
+  caDevice d;
+  new cCamSim(SimNumber++, SimParams, d);
+  cAdapter* adapter = new cAdapter(d);
+
+  cCamSlot* master = nullptr;
+  for(cCamSlot* s = CamSlots.First(); s; s = CamSlots.Next(s))
+     if (s->IsMasterSlot())
+        master = s;
+
+  std::vector<cCamSlot*> slots;
+  std::vector<tSubStats> stats(Subs);
+  for(int i = 0; i < Subs; i++) {
+     cCamSlot* sub = master ? master->MtdSpawn() : nullptr;
+     if (!sub) {
+        fprintf(stderr, "couldn't spawn MTD sub slot %d\n", i + 1);
+        delete adapter;
+        return false;
+        }
+     stats[i].rate = Rates[i % Rates.size()];
+     stats[i].priority = Prios[i % Prios.size()];
+     sub->StartDecrypting();
+     // no device here, UpdatePriorities() leaves it as it is.
+     adapter->Governor().SetPriority(cCiCamSlot::SubSlotNumber(sub), stats[i].priority);
+     slots.push_back(sub);
+     }
+
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  for(int i = 0; i < Subs; i++)
+     threads.emplace_back(Producer, slots[i], i, std::ref(stats[i]), std::ref(stop));
+  std::this_thread::sleep_for(std::chrono::duration<double>(Seconds));
+  stop = true;
+  for(auto& t:threads)
+     t.join();
+
+  std::vector<uint64_t> refused;
+  for(auto sub:slots)
+     refused.push_back(adapter->Governor().Refused(cCiCamSlot::SubSlotNumber(sub)));
+  for(auto sub:slots)
+     sub->StopDecrypting();
+  delete adapter;
+
+  double offered = 0, delivered = 0, sum = 0, sum2 = 0, minShare = 1, maxShare = 0;
+  uint64_t lost = 0, dropped = 0, reordered = 0, foreign = 0;
+  std::vector<uint32_t> all;
+  for(int i = 0; i < Subs; i++) {
+     tSubStats& s = stats[i];
+     double share = s.offered ? double(s.received) / s.offered : 0;
+     uint64_t l = s.accepted > s.received ? s.accepted - s.received : 0;
+     Result("mtd_sub", { { "subslots", double(Subs) }, { "sub", double(i + 1) },
+                         { "rate_mbit", s.rate }, { "priority", double(s.priority) },
+                         { "offered", double(s.offered) },
+                         { "accepted", double(s.accepted) }, { "received", double(s.received) },
+                         { "lost", double(l) }, { "dropped", double(s.dropped) },
+                         { "retries", double(s.retries) }, { "reordered", double(s.reordered) },
+                         { "foreign", double(s.foreign) }, { "share", share },
+                         { "gov_refused", double(refused[i] / TS_SIZE) },
+                         { "lat_p50_us", Percentile(s.latency, 0.5) },
+                         { "lat_p99_us", Percentile(s.latency, 0.99) },
+                         { "lat_max_us", Percentile(s.latency, 1.0) } });
+     offered   += s.offered * TS_SIZE * 8 / 1e6 / Seconds;
+     delivered += s.received * TS_SIZE * 8 / 1e6 / Seconds;
+     sum += share;
+     sum2 += share * share;
+     minShare = std::min(minShare, share);
+     maxShare = std::max(maxShare, share);
+     lost += l;
+     dropped += s.dropped;
+     reordered += s.reordered;
+     foreign += s.foreign;
+     all.insert(all.end(), s.latency.begin(), s.latency.end());
+     }
+
+  // Jain's fairness index over the delivered shares: 1 = perfectly fair
+  double jain = sum2 > 0 ? sum * sum / (Subs * sum2) : 0;
+  bool ok = (delivered >= 0.98 * offered) and !lost and !reordered and !foreign;
+  Result("mtd_step", { { "subslots", double(Subs) }, { "offered_mbit", offered },
+                       { "delivered_mbit", delivered }, { "lost", double(lost) },
+                       { "dropped", double(dropped) }, { "reordered", double(reordered) },
+                       { "foreign", double(foreign) }, { "fairness", jain },
+                       { "min_share", minShare }, { "max_share", maxShare },
+                       { "lat_p50_us", Percentile(all, 0.5) },
+                       { "lat_p99_us", Percentile(all, 0.99) },
+                       { "saturated", double(!ok) } });
+  return ok;
+}
+
+
+int main(int argc, char* argv[]) {
+  int c;
+  while((c = getopt(argc, argv, "b:ghm:n:o:p:r:s:t:v")) > 0) {
+     switch(c) {
+        case 'm': {
+           Rates.clear();
+           std::stringstream ss(optarg);
+           std::string item;
+           while(std::getline(ss, item, ','))
+              if (atof(item.c_str()) > 0)
+                 Rates.push_back(atof(item.c_str()));
+           if (Rates.empty())
+              Rates.push_back(8);
+           break;
+           }
+        case 'b': BufSize = std::max(1500, std::min(atoi(optarg), 10000)); break;
+        case 'g': CamGovernor = true; break;
+        case 'p': {
+           Prios.clear();
+           std::stringstream ss(optarg);
+           std::string item;
+           while(std::getline(ss, item, ','))
+              Prios.push_back(atoi(item.c_str()));
+           if (Prios.empty())
+              Prios.push_back(0);
+           break;
+           }
+        case 'n': MaxSubs = std::max(1, std::min(atoi(optarg), MAX_SUBS)); break;
+        case 'o':
+           if (!(Out = fopen(optarg, "w"))) {
+              perror(optarg);
+              return 1;
+              }
+           break;
+        case 's':
+           if (!cCamSim::ParseParams(optarg, SimParams)) {
+              fprintf(stderr, "invalid simulator parameters\n");
+              return 1;
+              }
+           break;
+        case 't': Seconds = atof(optarg); break;
+        case 'v': LogLevel = 3; break;
+        case 'h':
+        default:
+           fprintf(c == 'h' ? stdout : stderr,
+              "usage: %s [-b packets] [-g] [-h] [-m rates] [-n subslots] [-o file] [-p prios]\n"
+              "          [-s simparams] [-t seconds] [-v]\n"
+              "  -b  CAM buffer size in packets (--bufsz), default 1500\n"
+              "  -g  CAM bandwidth governor on (--governor)\n"
+              "  -h  print this help\n"
+              "  -m  Mbit/s per sub slot, cycled over the sub slots, default 3,8,15\n"
+              "  -n  max number of MTD sub slots, default and max %d\n"
+              "  -o  write results to file instead of stdout (JSON lines)\n"
+              "  -p  VDR priority per sub slot, cycled over the sub slots, default 0\n"
+              "  -s  simulated CAM, see --sim-param, default delay=10,rate=96000\n"
+              "  -t  seconds per step, default 5\n"
+              "  -v  verbose plugin logging\n", argv[0], MAX_SUBS);
+           return c != 'h';
+        }
+     }
+  if (LogLevel < 3)
+     LogLevel = 1;
+  signal(SIGPIPE, SIG_IGN);
+
+  int saturation = 0;
+  for(int subs = 1; subs <= MaxSubs; subs++)
+     if (!Step(subs) and !saturation)
+        saturation = subs;
+
+  Result("mtd_saturation", { { "subslots", double(saturation) },
+                             { "cam_rate_kbit", double(SimParams.RateKbit) } });
+
+  if (Out != stdout)
+     fclose(Out);
+  return 0;
+}
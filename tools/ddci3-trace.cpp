@@ -0,0 +1,106 @@
+/*******************************************************************************
+ * @file ddci3-trace.cpp @brief Digital Devices Common Interface plugin for VDR.
+ * Copyright (c) 2021 by Winfried Khler.  All Rights Reserved.
+ * Contributor(s):
+ * License: GPLv2
+ *
+ * This file is part of vdr-plugin-ddci3.
+ *
+ * vdr-plugin-ddci3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vdr-plugin-ddci3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vdr-plugin-ddci3.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "../Trace.h"
+
+/*******************************************************************************
+ * ddci3-trace: decodes the trace ring dumps written by the ddci3 plugin,
+ * either on error or on demand by SVDRP command TRCD.
+ *
+ * Times are printed relative to the dump time, deltas relative to the
+ * previous event. A per event summary follows the event list.
+ ******************************************************************************/
+
+static bool Decode(const char* FileName) {
+  FILE* f = fopen(FileName, "rb");
+  if (!f) {
+     fprintf(stderr, "%s: %s\n", FileName, strerror(errno));
+     return false;
+     }
+
+  tTraceHeader h;
+  if ((fread(&h, sizeof(h), 1, f) != 1) or memcmp(h.Magic, TRACE_MAGIC, sizeof(h.Magic))) {
+     fprintf(stderr, "%s: not a ddci3 trace file\n", FileName);
+     fclose(f);
+     return false;
+     }
+  if (h.Version != TRACE_VERSION) {
+     fprintf(stderr, "%s: unsupported trace version %u\n", FileName, h.Version);
+     fclose(f);
+     return false;
+     }
+
+  std::vector<tTraceRecord> records(h.Records);
+  size_t n = h.Records ? fread(records.data(), sizeof(tTraceRecord), h.Records, f) : 0;
+  fclose(f);
+  if (n != h.Records)
+     fprintf(stderr, "%s: truncated, %zu of %u events\n", FileName, n, h.Records);
+
+  h.Device[sizeof(h.Device) - 1] = 0;
+  h.Reason[sizeof(h.Reason) - 1] = 0;
+  time_t t = h.RealTime / 1000000000;
+  char buf[32];
+  strftime(buf, sizeof(buf), "%F %T", localtime(&t));
+
+  printf("# %s\n", FileName);
+  printf("# device %s, reason '%s', %zu events, dumped %s.%03u\n",
+         h.Device, h.Reason, n, buf, unsigned((h.RealTime / 1000000) % 1000));
+  printf("#     time [ms]   delta [us]    tid  event               value\n");
+
+  unsigned count[teCount + 1] = { 0 };
+  uint64_t last = n ? records[0].Time : 0;
+
+  for(size_t i = 0; i < n; i++) {
+     const tTraceRecord& r = records[i];
+     double rel   = (double(r.Time) - double(h.MonoTime)) / 1e6;
+     double delta = (double(r.Time) - double(last)) / 1e3;
+     last = r.Time;
+     printf("%15.3f %12.1f  %5u  %-14s %10u\n", rel, delta, r.Tid,
+            TraceEventName(r.Event), r.Value);
+     count[(r.Event < teCount) ? r.Event : teCount]++;
+     }
+
+  if (n > 1)
+     printf("# %.3f ms covered\n", (records[n - 1].Time - records[0].Time) / 1e6);
+  printf("# summary:\n");
+  for(int e = 1; e <= teCount; e++)
+     if (count[e])
+        printf("#   %-14s %8u\n", TraceEventName(e), count[e]);
+  return true;
+}
+
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+     fprintf(stderr, "usage: %s <trace file> [<trace file> ...]\n", argv[0]);
+     return 1;
+     }
+
+  int ret = 0;
+  for(int i = 1; i < argc; i++)
+     if (!Decode(argv[i]))
+        ret = 1;
+  return ret;
+}